@@ -0,0 +1,262 @@
+/*
+** File keycache.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keycache.c
+**
+** Event mode verdict cache
+**
+** The entries are hashed on the device identity, and kept on a list from
+** the most to the least recently used one. Once the cache is full, each new
+** verdict evicts the least recently used entry. An expired entry is dropped
+** when it is looked up, or when it reaches the end of the list.
+**
+** The cache is only used by the decisions, at most once per plugged device,
+** so a single spinlock protects all of it. The hash table has a bucket per
+** entry, rounded up to a power of two.
+**
+** A flush bumps keycache_generation. A decision reads it along with its
+** lookup miss, and its verdict is only inserted if no flush happened
+** meanwhile: an authority asked before a flush may have answered from the
+** policy the flush was meant to forget.
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/siphash.h>
+#include "keycache.h"
+#include "trace.h"
+
+struct keycache_entry {
+  struct hlist_node node;
+  struct list_head lru;
+  unsigned long expires;	/* jiffies */
+  u64 hash;
+  u16 idVendor;
+  u16 idProduct;
+  u8 len;
+  u8 verdict;
+  char serial[USBWALL_SERIAL_MAX];
+};
+
+static struct hlist_head *keycache_table;
+static u32 keycache_mask;		/* buckets - 1 */
+static LIST_HEAD(keycache_lru);		/* most recently used first */
+static DEFINE_SPINLOCK(keycache_lock);
+static u64 keycache_generation;		/* flushes, under keycache_lock */
+static unsigned int keycache_max;
+static struct keycache_stats keycache_stats;
+static siphash_key_t keycache_secret;
+
+/*!
+** \brief hash of the device identity, and length of its serial number
+*/
+static u64 keycache_hash(const struct usbwall_token_info *info, u8 *len)
+{
+  u8 buf[2 * sizeof(u16) + USBWALL_SERIAL_MAX];
+
+  *len = strnlen(info->idSerialNumber, USBWALL_SERIAL_MAX - 1);
+  memcpy(buf, &info->idVendor, sizeof(u16));
+  memcpy(buf + sizeof(u16), &info->idProduct, sizeof(u16));
+  memcpy(buf + 2 * sizeof(u16), info->idSerialNumber, *len);
+  return siphash(buf, 2 * sizeof(u16) + *len, &keycache_secret);
+}
+
+/*!
+** \brief entry of the device, under keycache_lock
+*/
+static struct keycache_entry *keycache_find(const struct usbwall_token_info *info,
+                                            u8 len,
+                                            u64 hash)
+{
+  struct keycache_entry *entry;
+
+  hlist_for_each_entry(entry, &keycache_table[hash & keycache_mask], node) {
+    if (entry->hash == hash &&
+        entry->idVendor == info->idVendor &&
+        entry->idProduct == info->idProduct &&
+        entry->len == len &&
+        memcmp(entry->serial, info->idSerialNumber, len) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/*!
+** \brief unlink an entry, under keycache_lock
+*/
+static void keycache_remove(struct keycache_entry *entry)
+{
+  hlist_del(&entry->node);
+  list_del(&entry->lru);
+  keycache_stats.entries--;
+}
+
+int	keycache_lookup(const struct internal_token_info *keyinfo, u64 *generation)
+{
+  struct keycache_entry *entry;
+  struct keycache_entry *expired = NULL;
+  int verdict = -ENOENT;
+  u64 hash;
+  u8 len;
+
+  if (keycache_max == 0) {
+    return -ENOENT;
+  }
+  hash = keycache_hash(&keyinfo->info, &len);
+  spin_lock(&keycache_lock);
+  *generation = keycache_generation;
+  entry = keycache_find(&keyinfo->info, len, hash);
+  if (entry != NULL && time_after_eq(jiffies, entry->expires)) {
+    keycache_remove(entry);
+    keycache_stats.expired++;
+    expired = entry;
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    list_move(&entry->lru, &keycache_lru);
+    verdict = entry->verdict;
+    keycache_stats.hits++;
+  } else {
+    keycache_stats.misses++;
+  }
+  spin_unlock(&keycache_lock);
+  kfree(expired);
+  return verdict;
+}
+
+void	keycache_insert(const struct internal_token_info *keyinfo,
+                        int verdict,
+                        unsigned int ttl,
+                        u64 generation)
+{
+  struct keycache_entry *entry;
+  struct keycache_entry *old;
+  struct keycache_entry *evicted = NULL;
+
+  if (keycache_max == 0 || ttl == 0) {
+    return;
+  }
+  entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+  if (entry == NULL) {
+    /* the next replug only asks the authority again */
+    return;
+  }
+  entry->hash = keycache_hash(&keyinfo->info, &entry->len);
+  entry->idVendor = keyinfo->info.idVendor;
+  entry->idProduct = keyinfo->info.idProduct;
+  memcpy(entry->serial, keyinfo->info.idSerialNumber, entry->len);
+  entry->verdict = verdict;
+  entry->expires = jiffies + msecs_to_jiffies(min_t(unsigned int, ttl, KEYCACHE_TTL_MAX) * 1000);
+
+  spin_lock(&keycache_lock);
+  if (generation != keycache_generation) {
+    /* flushed since the lookup */
+    spin_unlock(&keycache_lock);
+    kfree(entry);
+    return;
+  }
+  /* two decisions on a same device may both have asked the authority */
+  old = keycache_find(&keyinfo->info, entry->len, entry->hash);
+  if (old != NULL) {
+    keycache_remove(old);
+  } else if (keycache_stats.entries >= keycache_max) {
+    old = list_last_entry(&keycache_lru, struct keycache_entry, lru);
+    keycache_remove(old);
+    if (time_after_eq(jiffies, old->expires)) {
+      keycache_stats.expired++;
+    } else {
+      keycache_stats.evictions++;
+    }
+  }
+  hlist_add_head(&entry->node, &keycache_table[entry->hash & keycache_mask]);
+  list_add(&entry->lru, &keycache_lru);
+  keycache_stats.entries++;
+  keycache_stats.inserts++;
+  evicted = old;
+  spin_unlock(&keycache_lock);
+  kfree(evicted);
+}
+
+void	keycache_flush(void)
+{
+  struct keycache_entry *entry;
+  struct keycache_entry *next;
+  LIST_HEAD(flushed);
+
+  spin_lock(&keycache_lock);
+  list_for_each_entry_safe(entry, next, &keycache_lru, lru) {
+    hlist_del(&entry->node);
+  }
+  list_splice_init(&keycache_lru, &flushed);
+  keycache_stats.entries = 0;
+  keycache_generation++;
+  spin_unlock(&keycache_lock);
+  list_for_each_entry_safe(entry, next, &flushed, lru) {
+    kfree(entry);
+  }
+}
+
+void	keycache_get_stats(struct keycache_stats *stats)
+{
+  spin_lock(&keycache_lock);
+  *stats = keycache_stats;
+  spin_unlock(&keycache_lock);
+  stats->max_entries = keycache_max;
+}
+
+int	keycache_init(unsigned int max_entries)
+{
+  u32 buckets;
+  u32 i;
+
+  max_entries = min_t(unsigned int, max_entries, KEYCACHE_ENTRIES_MAX);
+  keycache_max = 0;
+  if (max_entries != 0) {
+    buckets = roundup_pow_of_two(max_entries);
+    keycache_table = kvmalloc_array(buckets, sizeof(*keycache_table), GFP_KERNEL);
+    if (keycache_table == NULL) {
+      return -ENOMEM;
+    }
+    for (i = 0; i < buckets; i++) {
+      INIT_HLIST_HEAD(&keycache_table[i]);
+    }
+    keycache_mask = buckets - 1;
+  }
+  get_random_bytes(&keycache_secret, sizeof(keycache_secret));
+  keycache_max = max_entries;
+  DBG_TRACE(DBG_LEVEL_DEBUG, "verdict cache of %u entries", max_entries);
+  return 0;
+}
+
+void	keycache_release(void)
+{
+  keycache_flush();
+  kvfree(keycache_table);
+  keycache_table = NULL;
+  keycache_max = 0;
+}
@@ -0,0 +1,78 @@
+/*
+** File keycache.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keycache.h
+**
+** Event mode verdict cache: the last verdicts of the userspace authority,
+** per (idVendor, idProduct, idSerialNumber), each one kept for the time to
+** live given with it.
+*/
+
+#ifndef KEYCACHE_H_
+# define KEYCACHE_H_
+
+#include "keylist_info.h"
+
+/* upper bound of the time to live of a verdict, in seconds */
+#define KEYCACHE_TTL_MAX	86400
+/* upper bound of the cached verdicts */
+#define KEYCACHE_ENTRIES_MAX	(1U << 20)
+
+struct keycache_stats {
+  u32 entries;
+  u32 max_entries;
+  u64 hits;
+  u64 misses;
+  u64 inserts;
+  u64 evictions;	/* least recently used entries dropped for room */
+  u64 expired;		/* entries found past their time to live */
+};
+
+/*
+** hold up to max_entries verdicts (at most KEYCACHE_ENTRIES_MAX), 0
+** disabling the cache. Returns -ENOMEM if the hash table can't be allocated.
+*/
+int	keycache_init(unsigned int max_entries);
+
+void	keycache_release(void);
+
+/*
+** cached verdict of the device (USBWALL_VERDICT_ALLOW or
+** USBWALL_VERDICT_BLOCK), or -ENOENT. generation is set to the flush
+** generation, to be given to keycache_insert().
+*/
+int	keycache_lookup(const struct internal_token_info *keyinfo, u64 *generation);
+
+/*
+** cache the verdict of the device for ttl seconds (at most
+** KEYCACHE_TTL_MAX). A 0 ttl caches nothing, nor does a flush since the
+** lookup which returned generation.
+*/
+void	keycache_insert(const struct internal_token_info *keyinfo,
+                        int verdict,
+                        unsigned int ttl,
+                        u64 generation);
+
+/* forget all the verdicts */
+void	keycache_flush(void);
+
+void	keycache_get_stats(struct keycache_stats *stats);
+
+#endif /* !KEYCACHE_H_ */
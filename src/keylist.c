@@ -35,110 +35,1701 @@
 **
 */
 
+#include <linux/atomic.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/random.h>
+#include <linux/siphash.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/crc32.h>
+#include <linux/refcount.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/preempt.h>
 #include "keylist.h"
 #include "keylist_info.h"
+#include "keypattern.h"
 #include "usbwall.h"
 #include "trace.h"
+#include "usbwall_stats.h"
+#include "usbwall_trace.h"
 
-static struct list_head key_list_head;
-static struct internal_token_info* keyinfo_tmp, *tmp;
-static int listempty = 0;
+/*
+** The authorized keys are stored in an immutable policy snapshot:
+** - the keys are sorted on (idVendor, idProduct, rule tier, serial number)
+**   and stored as two parallel arrays: vidpid[] holds the packed
+**   idVendor:idProduct, serial[] the reference to the serial number in the
+**   arena, tagged with the rule tier. A device whose idVendor:idProduct is
+**   not in the dense vidpid[] is rejected without reading any serial.
+** - fence[] holds the first vidpid[] entry of each block of
+**   KEYLIST_SCAN_BLOCK keys. It is small enough to stay in cache, so a
+**   vidpid[] search only reads one block.
+** - arena[] holds the serial numbers, each one as a length byte followed by
+**   the characters, without terminating NUL. A serial number shared by keys
+**   of several idVendor:idProduct is stored once. Offset 0 is the empty
+**   serial of the wildcard rules.
+** - index[] is an open addressed table of (key position + 1), keyed by
+**   the siphash of the key, with at most one key per two slots.
+** - bloom[] is a blocked Bloom filter of the index hashes: all the bits of a
+**   hash are in the same cache line, picked by the low bits of the hash.
+** They live in a single allocation, right after the header.
+**
+** The Bloom filter answers the definite misses, which are most of the probes,
+** without touching the index nor the keys. Serial pattern rules are entered
+** in the filter as their idVendor:idProduct wildcard, which is probed for the
+** pattern tier too. A commit that only adds keys to a same sized filter
+** copies the previous one and sets the new bits, any deletion rebuilds it.
+**
+** Wildcard rules are stored as keys whose ignored fields are cleared, so a
+** lookup probes the index once per tier, from the exact serial to the vendor
+** rules, and stops at the first hit. Empty tiers are not probed. The serial
+** patterns tier is matched by the automaton compiled from all the pattern
+** rules, which is shared by the next snapshots until a pattern changes.
+**
+** A single key deletion doesn't build a new snapshot: the key is marked dead
+** in place, which no lookup matches anymore, and the next commit leaves it
+** out. The dead keys keep their index slot and their filter bits until then.
+** The deletions of pattern rules, which change the automaton, are committed.
+**
+** Locking:
+** - readers (usbwall_probe, procfs) only take rcu_read_lock() and never wait
+**   for a writer.
+** - writers are serialized by keylist_mutex. A commit builds a new snapshot
+**   beside the current one, publishes it with a new generation number and
+**   frees the old one after a grace period. Readers see either the whole
+**   transaction or nothing of it.
+** - a deletion in place marks the key dead and bumps the generation of the
+**   current snapshot inside its seqcount, so that the readers of the whole
+**   policy (the exports) see either all of it or retry.
+*/
+#define KEYLIST_TIER_BITS 3
+#define KEYLIST_TIER_MASK ((1U << KEYLIST_TIER_BITS) - 1)
+/* in serial[], above the arena offset: the key was deleted in place */
+#define KEYLIST_KEY_DEAD (1U << 31)
+#define KEYLIST_ARENA_MAX (1U << (31 - KEYLIST_TIER_BITS))
+
+/* keeps the index size of an image policy within 32 bits */
+#define KEYLIST_IMAGE_MAX_KEYS (1U << 28)
+
+struct keylist_policy {
+  u64 generation;
+  seqcount_t seq;		/* deletions in place */
+  u32 count;			/* keys, dead ones included */
+  u32 dead;			/* keys deleted in place */
+  u32 tier_count[KEYLIST_MATCH_MAX];	/* live keys of each tier */
+  u32 index_mask;
+  u32 *index;
+  u32 bloom_mask;		/* number of bloom blocks - 1 */
+  unsigned long *bloom;
+  u32 arena_size;		/* bytes used in arena[] */
+  u8 *arena;
+  u32 *serial;			/* dead | arena offset << KEYLIST_TIER_BITS | tier */
+  u32 *fence;
+  struct keypattern_dfa *dfa;
+  size_t size;			/* bytes allocated for the snapshot */
+  struct rcu_head rcu;
+  u32 vidpid[];			/* idVendor << 16 | idProduct */
+};
+
+/* a key being looked up or merged, whatever it is stored in */
+struct keylist_view {
+  u32 vidpid;
+  enum keylist_match tier;
+  const char *serial;
+  u32 len;
+};
+
+/* serial numbers already in the arena of the snapshot being built */
+struct keylist_intern {
+  u32 *slots;			/* arena offset, 0 if free */
+  u32 mask;
+};
+
+#define KEYLIST_INDEX_MIN_SLOTS 16
+
+/* vidpid[] entries per fence, scanned a word at a time: two cache lines */
+#define KEYLIST_SCAN_BLOCK 32
+/* above this, the Bloom filter rejects an unknown device faster than a scan */
+#define KEYLIST_SCAN_MAX_KEYS 256
+
+/* Bloom filter geometry: one 512 bits block per 32 keys, 6 bits per key */
+#define KEYLIST_BLOOM_BLOCK_BITS 512
+#define KEYLIST_BLOOM_BLOCK_KEYS 32
+#define KEYLIST_BLOOM_HASHES 6
+#define KEYLIST_BLOOM_BLOCK_LONGS (KEYLIST_BLOOM_BLOCK_BITS / BITS_PER_LONG)
+
+/* lookups outcome, per cpu so that probes never share a cache line */
+struct keylist_filter_counters {
+  u64 queries;
+  u64 negatives;
+  u64 false_positives;
+};
+
+static DEFINE_PER_CPU(struct keylist_filter_counters, keylist_filter_counters);
+
+/* staged operation, sorted on the key then on the staging order */
+struct keylist_op {
+  struct keylist_view view;
+  int *status;			/* result of the operation, set by the merge */
+  u32 seq;
+  u32 del;			/* USBWALL_KEY_DEL, else USBWALL_KEY_ADD */
+};
+
+/*
+** Only the keys staged in a transaction come from a dedicated slab cache
+** (usbwall_keyinfo in /proc/slabinfo), backed by a reserve so that staging
+** never fails. The policy itself is the single kvmalloc() block of its
+** snapshot, whose size /proc/usbwall/stats gives.
+*/
+#define KEYLIST_KEYINFO_RESERVE 256
+
+static struct kmem_cache *keyinfo_cache = NULL;
+static mempool_t *keyinfo_pool = NULL;
+/* keys staged in all the transactions, at most KEYLIST_STAGED_MAX */
+static atomic_t keylist_staged = ATOMIC_INIT(0);
+
+/* userspace snapshot of a policy generation, see keylist_export_get() */
+struct keylist_export {
+  struct list_head list;
+  refcount_t refcount;
+  u64 generation;
+  struct usbwall_map_header *map;
+  size_t size;
+};
+
+static DEFINE_MUTEX(keylist_mutex);
+static struct keylist_policy __rcu *key_policy = NULL;
+/* list of the exports still referenced, nested in keylist_mutex */
+static DEFINE_MUTEX(keylist_export_mutex);
+static LIST_HEAD(keylist_exports);
+/* secret key of the index hash, so that serial strings can't force collisions */
+static siphash_key_t key_hash_secret;
+
+/*!
+** \brief return the tier of a rule
+*/
+static enum keylist_match keylist_tier(const struct usbwall_token_info *info)
+{
+  if (info->keyflags & USBWALL_KEY_ANY_PRODUCT) {
+    return KEYLIST_MATCH_VENDOR;
+  }
+  if (info->keyflags & USBWALL_KEY_ANY_SERIAL) {
+    return KEYLIST_MATCH_PRODUCT;
+  }
+  if (info->keyflags & USBWALL_KEY_SERIAL_PATTERN) {
+    return KEYLIST_MATCH_PATTERN;
+  }
+  return KEYLIST_MATCH_SERIAL;
+}
+
+/*!
+** \brief view a token, whose serial number is NUL terminated
+*/
+static void keylist_view_info(struct keylist_view *view,
+                              const struct usbwall_token_info *info)
+{
+  view->vidpid = (u32)info->idVendor << 16 | info->idProduct;
+  view->tier = keylist_tier(info);
+  view->serial = info->idSerialNumber;
+  view->len = strnlen(info->idSerialNumber, sizeof(info->idSerialNumber));
+}
+
+/*!
+** \brief view a key of a policy snapshot, dead or not
+**
+** \return whether the key was deleted in place
+*/
+static int keylist_view_key(struct keylist_view *view,
+                            const struct keylist_policy *policy,
+                            u32 pos)
+{
+  u32 ref = READ_ONCE(policy->serial[pos]);
+  const u8 *serial = policy->arena + ((ref & ~KEYLIST_KEY_DEAD) >> KEYLIST_TIER_BITS);
 
+  view->vidpid = policy->vidpid[pos];
+  view->tier = ref & KEYLIST_TIER_MASK;
+  view->serial = (const char *)serial + 1;
+  view->len = serial[0];
+  return !!(ref & KEYLIST_KEY_DEAD);
+}
 
-int	key_add(struct internal_token_info*	keyinfo)
+/*!
+** \brief order two keys on (idVendor, idProduct, tier, serial number)
+*/
+static int keylist_view_cmp(const struct keylist_view *a,
+                            const struct keylist_view *b)
 {
-  if(list_empty(&(key_list_head))) {
-    DBG_TRACE(DBG_LEVEL_NOTICE, "Empty list! Adding first key");
+  int ret;
+
+  if (a->vidpid != b->vidpid) {
+    return a->vidpid < b->vidpid ? -1 : 1;
+  }
+  if (a->tier != b->tier) {
+    return a->tier < b->tier ? -1 : 1;
+  }
+  ret = memcmp(a->serial, b->serial, min(a->len, b->len));
+  if (ret != 0) {
+    return ret;
+  }
+  if (a->len != b->len) {
+    return a->len < b->len ? -1 : 1;
   }
-  DBG_TRACE(DBG_LEVEL_INFO, "Adding key %s to keylist", keyinfo->info.idSerialNumber);
-  list_add_tail(&keyinfo->list, &key_list_head); /* Insert struct after the last element */;
-  listempty++;
   return 0;
 }
 
-int	key_del(struct internal_token_info*	keyinfo)
+/*!
+** \brief compute the keyed hash of (idVendor, idProduct, tier, serial number)
+*/
+static u64 keylist_view_hash(const struct keylist_view *view)
 {
-  int idSerialNumber_cmp;
-  if(!list_empty(&(key_list_head)))
-  {
-    list_for_each_entry(keyinfo_tmp, &key_list_head, list) /* Get each item */
-    {
-      idSerialNumber_cmp = strcmp(keyinfo_tmp->info.idSerialNumber, keyinfo->info.idSerialNumber);
-      if(keyinfo->info.idVendor == keyinfo_tmp->info.idVendor  &&
-         keyinfo->info.idProduct == keyinfo_tmp->info.idProduct &&
-         idSerialNumber_cmp == 0)
-      {
-        list_del(&(keyinfo_tmp->list)); /* Delete struct */
-        kfree(keyinfo_tmp);
-        kfree(keyinfo);
-        break;
+  u8 buf[sizeof(u32) + 1 + USBWALL_SERIAL_MAX];
+
+  memcpy(buf, &view->vidpid, sizeof(u32));
+  buf[sizeof(u32)] = view->tier;
+  memcpy(buf + sizeof(u32) + 1, view->serial, view->len);
+  return siphash(buf, sizeof(u32) + 1 + view->len, &key_hash_secret);
+}
+
+/*!
+** \brief allocate a policy snapshot able to hold count keys
+**
+** \param arena_size upper bound of the serial numbers arena size
+*/
+static struct keylist_policy *keylist_policy_alloc(u32 count, size_t arena_size)
+{
+  struct keylist_policy *policy;
+  u32 slots = KEYLIST_INDEX_MIN_SLOTS;
+  u32 blocks = 1;
+  size_t index_size;
+  size_t bloom_off;
+
+  while (slots < 2 * count) {
+    slots <<= 1;
+  }
+  while (blocks * KEYLIST_BLOOM_BLOCK_KEYS < count) {
+    blocks <<= 1;
+  }
+  index_size = (size_t)slots * sizeof(u32);
+  bloom_off = ALIGN(sizeof(*policy) +
+                    (2 * (size_t)count + DIV_ROUND_UP(count, KEYLIST_SCAN_BLOCK)) * sizeof(u32) +
+                    index_size + arena_size, SMP_CACHE_BYTES);
+  policy = kvzalloc(bloom_off + blocks * (KEYLIST_BLOOM_BLOCK_BITS / 8), GFP_KERNEL);
+  if (policy == NULL) {
+    return NULL;
+  }
+  policy->size = bloom_off + blocks * (KEYLIST_BLOOM_BLOCK_BITS / 8);
+  seqcount_init(&policy->seq);
+  policy->index_mask = slots - 1;
+  policy->serial = policy->vidpid + count;
+  policy->fence = policy->serial + count;
+  policy->index = policy->fence + DIV_ROUND_UP(count, KEYLIST_SCAN_BLOCK);
+  policy->arena = (u8 *)policy->index + index_size;
+  /* offset 0: the empty serial, already zeroed */
+  policy->arena_size = 1;
+  policy->bloom_mask = blocks - 1;
+  policy->bloom = (unsigned long *)((u8 *)policy + bloom_off);
+  return policy;
+}
+
+/*!
+** \brief return the arena offset of a serial number, adding it if needed
+**
+** The arena of policy is large enough for every serial interned in it.
+*/
+static u32 keylist_intern(struct keylist_policy *policy,
+                          struct keylist_intern *table,
+                          const char *serial,
+                          u32 len)
+{
+  u32 slot;
+  u32 off;
+
+  if (len == 0) {
+    return 0;
+  }
+  slot = siphash(serial, len, &key_hash_secret) & table->mask;
+  while ((off = table->slots[slot]) != 0) {
+    if (policy->arena[off] == len && memcmp(policy->arena + off + 1, serial, len) == 0) {
+      return off;
+    }
+    slot = (slot + 1) & table->mask;
+  }
+  off = policy->arena_size;
+  policy->arena[off] = len;
+  memcpy(policy->arena + off + 1, serial, len);
+  policy->arena_size += len + 1;
+  table->slots[slot] = off;
+  return off;
+}
+
+/*!
+** \brief set or test the bits of a hash in the Bloom filter
+**
+** The block is picked by the low bits of the hash, the bits in the block by
+** double hashing on the high 32 bits.
+**
+** \return when testing, 1 if all the bits are set
+*/
+static int keylist_bloom(unsigned long *bloom, u32 bloom_mask, u64 hash, int set)
+{
+  unsigned long *block = &bloom[(hash & bloom_mask) * KEYLIST_BLOOM_BLOCK_LONGS];
+  u32 h1 = hash >> 32;
+  u32 h2 = (hash >> 41) | 1;
+  u32 bit;
+  int i;
+
+  for (i = 0; i < KEYLIST_BLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) % KEYLIST_BLOOM_BLOCK_BITS;
+    if (set) {
+      __set_bit(bit, block);
+    } else if (!test_bit(bit, block)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*!
+** \brief return the hash entered in the Bloom filter for a rule
+**
+** Serial patterns are entered as the wildcard of their idVendor:idProduct.
+*/
+static u64 keylist_bloom_hash(const struct keylist_view *view)
+{
+  struct keylist_view tag;
+
+  if (view->tier != KEYLIST_MATCH_PATTERN) {
+    return keylist_view_hash(view);
+  }
+  tag.vidpid = view->vidpid;
+  tag.tier = KEYLIST_MATCH_PRODUCT;
+  tag.serial = "";
+  tag.len = 0;
+  return keylist_view_hash(&tag);
+}
+
+/*!
+** \brief fill the Bloom filter of a new policy
+**
+** \param removed whether a key of old is missing from policy
+*/
+static void keylist_policy_filter(struct keylist_policy *policy,
+                                  const struct keylist_policy *old,
+                                  const struct keylist_op *ops,
+                                  u32 nr_ops,
+                                  int removed)
+{
+  struct keylist_view view;
+  u32 i;
+
+  if (!removed && policy->bloom_mask == old->bloom_mask) {
+    memcpy(policy->bloom, old->bloom,
+           (old->bloom_mask + 1) * (KEYLIST_BLOOM_BLOCK_BITS / 8));
+    for (i = 0; i < nr_ops; i++) {
+      if (!ops[i].del && *ops[i].status == 0) {
+        keylist_bloom(policy->bloom, policy->bloom_mask, keylist_bloom_hash(&ops[i].view), 1);
       }
     }
+    return;
+  }
+  for (i = 0; i < policy->count; i++) {
+    keylist_view_key(&view, policy, i);
+    keylist_bloom(policy->bloom, policy->bloom_mask, keylist_bloom_hash(&view), 1);
+  }
+}
+
+static void keylist_policy_free(struct keylist_policy *policy)
+{
+  keypattern_put(policy->dfa);
+  kvfree(policy);
+}
+
+static void keylist_policy_free_rcu(struct rcu_head *head)
+{
+  keylist_policy_free(container_of(head, struct keylist_policy, rcu));
+}
+
+/*!
+** \brief give the policy the automaton of its serial patterns
+**
+** \param changed whether a pattern rule was added or deleted since old
+*/
+static int keylist_policy_compile(struct keylist_policy *policy,
+                                  const struct keylist_policy *old,
+                                  int changed)
+{
+  struct keypattern_rule *rules;
+  struct keypattern_dfa *dfa;
+  struct keylist_view view;
+  u32 nr_rules = 0;
+  u32 i;
+
+  if (policy->tier_count[KEYLIST_MATCH_PATTERN] == 0) {
+    policy->dfa = NULL;
     return 0;
   }
-  else
-  {
-    DBG_TRACE(DBG_LEVEL_ERROR, "Empty list! Initializing internal keylist");
-    return -EFAULT;
+  if (!changed) {
+    policy->dfa = keypattern_get(old->dfa);
+    return 0;
+  }
+  rules = kvmalloc_array(policy->tier_count[KEYLIST_MATCH_PATTERN], sizeof(*rules), GFP_KERNEL);
+  if (rules == NULL) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < policy->count; i++) {
+    keylist_view_key(&view, policy, i);
+    if (view.tier == KEYLIST_MATCH_PATTERN) {
+      rules[nr_rules].idVendor = view.vidpid >> 16;
+      rules[nr_rules].idProduct = view.vidpid & 0xffff;
+      rules[nr_rules].pattern = view.serial;
+      rules[nr_rules].len = view.len;
+      nr_rules++;
+    }
   }
+  dfa = keypattern_compile(rules, nr_rules);
+  kvfree(rules);
+  if (IS_ERR(dfa)) {
+    return PTR_ERR(dfa);
+  }
+  policy->dfa = dfa;
+  return 0;
 }
 
-int	is_key_authorized(struct internal_token_info*	keyinfo)
+/*!
+** \brief fill the hash index and the fences of a policy whose keys are complete
+*/
+static void keylist_policy_index(struct keylist_policy *policy)
 {
-  int idSerialNumber_cmp;
-  if(!list_empty(&(key_list_head)))
-  {
-    list_for_each_entry(keyinfo_tmp, &key_list_head, list) /* Get each item */
-    {
-      DBG_TRACE (DBG_LEVEL_NOTICE, "Vendor list %x, Product list %x, Serial Number list %s", keyinfo_tmp->info.idVendor, keyinfo_tmp->info.idProduct, keyinfo_tmp->info.idSerialNumber);
-      idSerialNumber_cmp = strcmp(keyinfo_tmp->info.idSerialNumber, keyinfo->info.idSerialNumber);
-      if(keyinfo->info.idVendor == keyinfo_tmp->info.idVendor  &&
-         keyinfo->info.idProduct == keyinfo_tmp->info.idProduct &&
-         idSerialNumber_cmp == 0)
-      {
-        DBG_TRACE (DBG_LEVEL_INFO, "Corresponding usb mass storage device found in list. Authorization granted.");
-        return 1;
+  struct keylist_view view;
+  u32 i;
+  u32 slot;
+
+  for (i = 0; i < policy->count; i += KEYLIST_SCAN_BLOCK) {
+    policy->fence[i / KEYLIST_SCAN_BLOCK] = policy->vidpid[i];
+  }
+  for (i = 0; i < policy->count; i++) {
+    keylist_view_key(&view, policy, i);
+    slot = keylist_view_hash(&view) & policy->index_mask;
+    while (policy->index[slot] != 0) {
+      slot = (slot + 1) & policy->index_mask;
+    }
+    policy->index[slot] = i + 1;
+  }
+}
+
+/*!
+** \brief find a live key in a policy snapshot
+**
+** The serial number in the arena is only compared once the packed
+** idVendor:idProduct and the tier match.
+**
+** \param hash keylist_view_hash() of view
+**
+** \return the key position, or -1
+*/
+static int keylist_policy_find(const struct keylist_policy *policy,
+                               const struct keylist_view *view,
+                               u64 hash)
+{
+  const u8 *serial;
+  u32 slot = hash & policy->index_mask;
+  u32 pos;
+  u32 ref;
+
+  while ((pos = READ_ONCE(policy->index[slot])) != 0) {
+    ref = READ_ONCE(policy->serial[pos - 1]);
+    /* a dead key has no tier */
+    if (policy->vidpid[pos - 1] == view->vidpid &&
+        (ref & (KEYLIST_KEY_DEAD | KEYLIST_TIER_MASK)) == view->tier) {
+      serial = policy->arena + (ref >> KEYLIST_TIER_BITS);
+      if (serial[0] == view->len && memcmp(serial + 1, view->serial, view->len) == 0) {
+        return pos - 1;
       }
     }
-    return 0;
+    slot = (slot + 1) & policy->index_mask;
   }
-  else
-  {
-    DBG_TRACE (DBG_LEVEL_ERROR, "error : the list is empty");
+  return -1;
+}
+
+/*!
+** \brief tell whether any key of a policy is for idVendor:idProduct
+**
+** The fences give the only block that may hold it, whose entries are compared
+** two at a time: with x the xor of two entries and the packed pair, a 32 bits
+** lane of x is zero for a match, and (x - 1) & ~x sets the high bit of zero
+** lanes only. Neither the search nor the scan branch on the keys, so a probe
+** costs the same whatever the outcome.
+*/
+static int keylist_policy_scan(const struct keylist_policy *policy, u32 vidpid)
+{
+  const u64 ones = 0x0000000100000001ULL;
+  const u64 highs = 0x8000000080000000ULL;
+  u64 pair = vidpid * ones;
+  u64 match = 0;
+  u64 word;
+  u32 nr_fences = DIV_ROUND_UP(policy->count, KEYLIST_SCAN_BLOCK);
+  u32 base = 0;
+  u32 half;
+  u32 pos;
+  u32 end;
+
+  if (nr_fences == 0 || policy->fence[0] > vidpid) {
     return 0;
   }
+  /* last block starting at or before vidpid */
+  while (nr_fences > 1) {
+    half = nr_fences / 2;
+    base = (policy->fence[base + half] <= vidpid) ? base + half : base;
+    nr_fences -= half;
+  }
+  pos = base * KEYLIST_SCAN_BLOCK;
+  end = min(policy->count, pos + KEYLIST_SCAN_BLOCK);
+  for (; pos + 2 <= end; pos += 2) {
+    memcpy(&word, &policy->vidpid[pos], sizeof(word));
+    word ^= pair;
+    match |= (word - ones) & ~word & highs;
+  }
+  return match != 0 || (pos < end && policy->vidpid[pos] == vidpid);
 }
 
-void	print_keylist(char* status_buffer)
+/*!
+** \brief tell the mapped exports the generation of the current policy
+*/
+static void keylist_export_live(u64 generation)
 {
-  int nb_key = 0;
-  if(!list_empty(&(key_list_head)))
-  {
-    list_for_each_entry(keyinfo_tmp, &key_list_head, list) /* Get each item */
-    {
-      sprintf(status_buffer, "Key : %d\tidVendor : %x\tidProduct : %x\tSerial Number : %s\n", nb_key, keyinfo_tmp->info.idVendor, keyinfo_tmp->info.idProduct, keyinfo_tmp->info.idSerialNumber);
-      nb_key++;
+  struct keylist_export *export;
+
+  mutex_lock(&keylist_export_mutex);
+  list_for_each_entry(export, &keylist_exports, list) {
+    WRITE_ONCE(export->map->live_generation, cpu_to_le64(generation));
+  }
+  mutex_unlock(&keylist_export_mutex);
+}
+
+/*!
+** \brief replace the current policy by a complete new one
+**
+** Must be called with keylist_mutex held. The old policy is freed once no
+** reader can see it anymore.
+*/
+static void keylist_policy_publish(struct keylist_policy *policy,
+                                   struct keylist_policy *old)
+{
+  policy->generation = old->generation + 1;
+  rcu_assign_pointer(key_policy, policy);
+  call_rcu(&old->rcu, keylist_policy_free_rcu);
+  keylist_export_live(policy->generation);
+}
+
+static int keylist_op_cmp(const void *a, const void *b)
+{
+  const struct keylist_op *opa = a;
+  const struct keylist_op *opb = b;
+  int ret;
+
+  ret = keylist_view_cmp(&opa->view, &opb->view);
+  if (ret != 0) {
+    return ret;
+  }
+  return opa->seq < opb->seq ? -1 : 1;
+}
+
+/*!
+** \brief append a key to a policy whose keys are being built
+*/
+static void keylist_policy_append(struct keylist_policy *policy,
+                                  struct keylist_intern *table,
+                                  const struct keylist_view *view)
+{
+  policy->vidpid[policy->count] = view->vidpid;
+  policy->serial[policy->count] =
+    keylist_intern(policy, table, view->serial, view->len) << KEYLIST_TIER_BITS | view->tier;
+  policy->count++;
+  policy->tier_count[view->tier]++;
+}
+
+/*!
+** \brief merge the sorted staged operations into the current keys
+**
+** Operations on the same key are replayed in staging order, so that each
+** one gets the status it would have had if applied alone: -EEXIST when adding
+** a present key, -ENOENT when deleting an absent one. The serial numbers are
+** interned in the arena of the new policy as the keys are appended, and the
+** keys of old deleted in place are left out.
+**
+** \param removed set if a key of old is not in policy anymore
+**
+** \return whether a serial pattern rule was added or deleted
+*/
+static int keylist_policy_merge(struct keylist_policy *policy,
+                                 const struct keylist_policy *old,
+                                 struct keylist_intern *table,
+                                 struct keylist_op *ops,
+                                 u32 nr_ops,
+                                 int *removed)
+{
+  struct keylist_view view;
+  u32 i = 0;
+  u32 j = 0;
+  u32 k;
+  int cmp;
+  int present;
+  int patterns_changed = 0;
+
+  policy->count = 0;
+  memset(policy->tier_count, 0, sizeof(policy->tier_count));
+  while (i < old->count || j < nr_ops) {
+    if (i < old->count && keylist_view_key(&view, old, i)) {
+      *removed = 1;
+      i++;
+      continue;
+    }
+    if (j == nr_ops) {
+      cmp = -1;
+    } else if (i == old->count) {
+      cmp = 1;
+    } else {
+      cmp = keylist_view_cmp(&view, &ops[j].view);
+    }
+    if (cmp < 0) {
+      keylist_policy_append(policy, table, &view);
+      i++;
+      continue;
+    }
+    present = (cmp == 0);
+    for (k = j; k < nr_ops && keylist_view_cmp(&ops[k].view, &ops[j].view) == 0; k++) {
+      if (ops[k].del) {
+        *ops[k].status = present ? 0 : -ENOENT;
+        present = 0;
+      } else {
+        *ops[k].status = present ? -EEXIST : 0;
+        present = 1;
+      }
+    }
+    if (present != (cmp == 0) && ops[j].view.tier == KEYLIST_MATCH_PATTERN) {
+      patterns_changed = 1;
+    }
+    if (cmp == 0 && !present) {
+      *removed = 1;
+    }
+    if (present) {
+      keylist_policy_append(policy, table, &ops[j].view);
+    }
+    if (cmp == 0) {
+      i++;
+    }
+    j = k;
+  }
+  return patterns_changed;
+}
+
+void	keylist_txn_begin(struct keylist_txn *txn)
+{
+  INIT_LIST_HEAD(&txn->ops);
+  txn->nr_ops = 0;
+}
+
+/*!
+** \brief prepare a key from userspace to be merged
+*/
+static void keylist_normalize(struct usbwall_token_info *info)
+{
+  /* never trust the serial termination from userspace */
+  info->idSerialNumber[sizeof(info->idSerialNumber) - 1] = '\0';
+  /* clear the fields ignored by wildcard rules so that they compare equal */
+  if (info->keyflags & USBWALL_KEY_ANY_PRODUCT) {
+    info->keyflags |= USBWALL_KEY_ANY_SERIAL;
+    info->idProduct = 0;
+  }
+  if (info->keyflags & USBWALL_KEY_ANY_SERIAL) {
+    info->keyflags &= ~USBWALL_KEY_SERIAL_PATTERN;
+    memset(info->idSerialNumber, 0, sizeof(info->idSerialNumber));
+  }
+}
+
+int	keylist_txn_stage(struct keylist_txn *txn, struct internal_token_info *keyinfo)
+{
+  if (!(keyinfo->info.keyflags & (USBWALL_KEY_ADD | USBWALL_KEY_DEL)) ||
+      ((keyinfo->info.keyflags & USBWALL_KEY_ADD) && (keyinfo->info.keyflags & USBWALL_KEY_DEL))) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "staged key must be either added or deleted");
+    return -EINVAL;
+  }
+  if (txn->nr_ops >= KEYLIST_TXN_MAX_OPS) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "too many staged keys");
+    return -ENOSPC;
+  }
+  if (!atomic_add_unless(&keylist_staged, 1, KEYLIST_STAGED_MAX)) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "too many keys staged by all the transactions");
+    return -ENOSPC;
+  }
+  keylist_normalize(&keyinfo->info);
+  keyinfo->status = 0;
+  list_add_tail(&keyinfo->list, &txn->ops);
+  txn->nr_ops++;
+  return 0;
+}
+
+/*!
+** \brief fill an operation on a normalized key
+*/
+static void keylist_op_init(struct keylist_op *op,
+                            const struct usbwall_token_info *info,
+                            int del,
+                            int *status,
+                            u32 seq)
+{
+  keylist_view_info(&op->view, info);
+  op->status = status;
+  *status = 0;
+  op->seq = seq;
+  op->del = del;
+}
+
+/*!
+** \brief apply operations to the current policy and publish the result
+**
+** The operations are sorted in place, then merged into a new snapshot. They
+** must point to keys that stay valid until the function returns.
+*/
+static int keylist_commit_ops(struct keylist_op *ops, u32 nr_ops, u64 *generation)
+{
+  struct keylist_policy *old;
+  struct keylist_policy *policy;
+  struct keylist_intern table;
+  size_t arena_size = 0;
+  u32 count;
+  u32 added = 0;
+  u32 deleted = 0;
+  u32 i;
+  int patterns_changed;
+  int removed = 0;
+  int ret;
+
+  for (i = 0; i < nr_ops; i++) {
+    if (!ops[i].del) {
+      arena_size += ops[i].view.len + 1;
+    }
+  }
+  sort(ops, nr_ops, sizeof(*ops), keylist_op_cmp, NULL);
+
+  mutex_lock(&keylist_mutex);
+  old = rcu_dereference_protected(key_policy, lockdep_is_held(&keylist_mutex));
+  count = old->count + nr_ops;
+  /* every serial of old, plus each added one */
+  arena_size += old->arena_size;
+  if (arena_size > KEYLIST_ARENA_MAX) {
+    ret = -E2BIG;
+    goto fail;
+  }
+  table.mask = KEYLIST_INDEX_MIN_SLOTS - 1;
+  while (table.mask < 2 * count) {
+    table.mask = (table.mask << 1) | 1;
+  }
+  table.slots = kvcalloc((size_t)table.mask + 1, sizeof(u32), GFP_KERNEL);
+  if (table.slots == NULL) {
+    ret = -ENOMEM;
+    goto fail;
+  }
+  policy = keylist_policy_alloc(count, arena_size);
+  if (policy == NULL) {
+    kvfree(table.slots);
+    ret = -ENOMEM;
+    goto fail;
+  }
+  patterns_changed = keylist_policy_merge(policy, old, &table, ops, nr_ops, &removed);
+  kvfree(table.slots);
+  ret = keylist_policy_compile(policy, old, patterns_changed);
+  if (ret != 0) {
+    kvfree(policy);
+    goto fail;
+  }
+  keylist_policy_index(policy);
+  keylist_policy_filter(policy, old, ops, nr_ops, removed);
+  keylist_policy_publish(policy, old);
+  if (generation != NULL) {
+    *generation = policy->generation;
+  }
+  mutex_unlock(&keylist_mutex);
+  DBG_TRACE(DBG_LEVEL_INFO, "policy generation %llu committed: %u keys, %u serial bytes",
+            (unsigned long long)policy->generation, policy->count, policy->arena_size);
+  for (i = 0; i < nr_ops; i++) {
+    trace_usbwall_key(ops[i].del, ops[i].view.vidpid, ops[i].view.tier, ops[i].view.serial,
+                      ops[i].view.len, *ops[i].status);
+    if (*ops[i].status == 0) {
+      if (ops[i].del) {
+        deleted++;
+      } else {
+        added++;
+      }
+    }
+  }
+  usbwall_stat_add(USBWALL_STAT_KEY_ADDS, added);
+  usbwall_stat_add(USBWALL_STAT_KEY_DELS, deleted);
+  return 0;
+
+fail:
+  mutex_unlock(&keylist_mutex);
+  DBG_TRACE(DBG_LEVEL_ERROR, "unable to build a %u keys policy: error %d", count, ret);
+  return ret;
+}
+
+int	keylist_txn_commit(struct keylist_txn *txn, u64 *generation)
+{
+  struct keylist_op *ops;
+  struct internal_token_info *keyinfo;
+  u32 nr_ops = 0;
+  int ret;
+
+  ops = kvmalloc_array(max_t(u32, txn->nr_ops, 1), sizeof(*ops), GFP_KERNEL);
+  if (ops == NULL) {
+    return -ENOMEM;
+  }
+  list_for_each_entry(keyinfo, &txn->ops, list) {
+    keylist_op_init(&ops[nr_ops], &keyinfo->info, keyinfo->info.keyflags & USBWALL_KEY_DEL,
+                    &keyinfo->status, nr_ops);
+    nr_ops++;
+  }
+  ret = keylist_commit_ops(ops, nr_ops, generation);
+  kvfree(ops);
+  return ret;
+}
+
+int	keylist_apply_batch(struct usbwall_token_info *infos,
+                            u32 count,
+                            keyflags_t op,
+                            int *status,
+                            u64 *generation)
+{
+  struct keylist_op *ops;
+  int *own_status = NULL;
+  int del;
+  u32 i;
+  int ret;
+
+  if (count > KEYLIST_TXN_MAX_OPS) {
+    return -E2BIG;
+  }
+  ops = kvmalloc_array(max_t(u32, count, 1), sizeof(*ops), GFP_KERNEL);
+  if (ops != NULL && status == NULL) {
+    /* the filter update needs the status of each addition */
+    status = own_status = kvmalloc_array(max_t(u32, count, 1), sizeof(*status), GFP_KERNEL);
+  }
+  if (ops == NULL || status == NULL) {
+    kvfree(ops);
+    return -ENOMEM;
+  }
+  for (i = 0; i < count; i++) {
+    del = op ? (op == USBWALL_KEY_DEL) : !!(infos[i].keyflags & USBWALL_KEY_DEL);
+    infos[i].keyflags &= USBWALL_KEY_MATCH_MASK;
+    keylist_normalize(&infos[i]);
+    keylist_op_init(&ops[i], &infos[i], del, &status[i], i);
+  }
+  ret = keylist_commit_ops(ops, count, generation);
+  kvfree(own_status);
+  kvfree(ops);
+  return ret;
+}
+
+void	keylist_txn_release(struct keylist_txn *txn)
+{
+  struct internal_token_info *keyinfo, *next;
+
+  list_for_each_entry_safe(keyinfo, next, &txn->ops, list) {
+    list_del(&keyinfo->list);
+    keyinfo_free(keyinfo);
+  }
+  atomic_sub(txn->nr_ops, &keylist_staged);
+  txn->nr_ops = 0;
+}
+
+/*!
+** \brief check and copy the key sections of a policy image
+**
+** The sections have the layout of the snapshot: they are copied as is, and
+** only checked to be sorted and to reference the arena correctly.
+*/
+static int keylist_image_keys(struct keylist_policy *policy,
+                              const struct usbwall_image_header *header,
+                              const u8 *data)
+{
+  const __le32 *vidpid = (const __le32 *)(data + header->vidpid_off);
+  const __le32 *serial = (const __le32 *)(data + header->serial_off);
+  struct keylist_view prev;
+  struct keylist_view view;
+  u32 off;
+  u32 i;
+
+  memcpy(policy->arena, data + header->arena_off, header->arena_size);
+  policy->arena_size = header->arena_size;
+  if (policy->arena[0] != 0) {
+    return -EINVAL;
+  }
+  for (i = 0; i < header->count; i++) {
+    policy->vidpid[i] = le32_to_cpu(vidpid[i]);
+    policy->serial[i] = le32_to_cpu(serial[i]);
+    off = policy->serial[i] >> KEYLIST_TIER_BITS;
+    if ((policy->serial[i] & KEYLIST_TIER_MASK) < KEYLIST_MATCH_SERIAL ||
+        (policy->serial[i] & KEYLIST_TIER_MASK) >= KEYLIST_MATCH_MAX ||
+        off >= policy->arena_size ||
+        policy->arena[off] > policy->arena_size - off - 1 ||
+        policy->arena[off] >= USBWALL_SERIAL_MAX) {
+      return -EINVAL;
+    }
+    keylist_view_key(&view, policy, i);
+    if ((view.tier >= KEYLIST_MATCH_PRODUCT && view.len != 0) ||
+        (view.tier == KEYLIST_MATCH_VENDOR && (view.vidpid & 0xffff) != 0) ||
+        (i > 0 && keylist_view_cmp(&prev, &view) >= 0)) {
+      return -EINVAL;
+    }
+    policy->tier_count[view.tier]++;
+    prev = view;
+  }
+  policy->count = header->count;
+  return 0;
+}
+
+int	keylist_load_image(const void *image, size_t size, u64 *generation)
+{
+  const u8 *data = image;
+  struct usbwall_image_header header;
+  struct keylist_policy *old;
+  struct keylist_policy *policy;
+  size_t keys_size;
+  u32 crc;
+  int ret;
+
+  if (size < sizeof(header)) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "policy image too short: %zu bytes", size);
+    return -EINVAL;
+  }
+  memcpy(&header, data, sizeof(header));
+  header.crc32 = 0;
+  crc = crc32_le(~0, (const u8 *)&header, sizeof(header));
+  crc = crc32_le(crc, data + sizeof(header), size - sizeof(header)) ^ ~0;
+  header.magic = le32_to_cpu(header.magic);
+  header.version = le32_to_cpu(header.version);
+  header.count = le32_to_cpu(header.count);
+  header.arena_size = le32_to_cpu(header.arena_size);
+  header.vidpid_off = le32_to_cpu(header.vidpid_off);
+  header.serial_off = le32_to_cpu(header.serial_off);
+  header.arena_off = le32_to_cpu(header.arena_off);
+  if (header.magic != USBWALL_IMAGE_MAGIC || header.version != USBWALL_IMAGE_VERSION) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "not a version %u policy image", USBWALL_IMAGE_VERSION);
+    return -EINVAL;
+  }
+  if (crc != le32_to_cpu(((const struct usbwall_image_header *)data)->crc32)) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "policy image checksum mismatch");
+    return -EBADMSG;
+  }
+  keys_size = (size_t)header.count * sizeof(u32);
+  if (header.count > KEYLIST_IMAGE_MAX_KEYS || keys_size > size ||
+      header.arena_size == 0 || header.arena_size > KEYLIST_ARENA_MAX ||
+      header.arena_size > size ||
+      (header.vidpid_off | header.serial_off) % sizeof(u32) != 0 ||
+      header.vidpid_off < sizeof(header) || header.vidpid_off > size - keys_size ||
+      header.serial_off < sizeof(header) || header.serial_off > size - keys_size ||
+      header.arena_off < sizeof(header) || header.arena_off > size - header.arena_size) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "policy image sections out of bounds");
+    return -EINVAL;
+  }
+
+  policy = keylist_policy_alloc(header.count, header.arena_size);
+  if (policy == NULL) {
+    return -ENOMEM;
+  }
+  ret = keylist_image_keys(policy, &header, data);
+  if (ret != 0) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "policy image keys are not valid");
+    kvfree(policy);
+    return ret;
+  }
+  ret = keylist_policy_compile(policy, NULL, 1);
+  if (ret != 0) {
+    kvfree(policy);
+    return ret;
+  }
+  /* the index and the filter depend on the hash secret of this boot */
+  keylist_policy_index(policy);
+  keylist_policy_filter(policy, NULL, NULL, 0, 1);
+
+  mutex_lock(&keylist_mutex);
+  old = rcu_dereference_protected(key_policy, lockdep_is_held(&keylist_mutex));
+  keylist_policy_publish(policy, old);
+  if (generation != NULL) {
+    *generation = policy->generation;
+  }
+  mutex_unlock(&keylist_mutex);
+  DBG_TRACE(DBG_LEVEL_INFO, "policy image loaded: generation %llu, %u keys",
+            (unsigned long long)policy->generation, policy->count);
+  return 0;
+}
+
+/*!
+** \brief write the policy image of the live keys of a snapshot, sized by
+** the caller for count keys
+**
+** The serial numbers of the dead keys stay in the arena, unreferenced.
+*/
+static void keylist_image_fill(const struct keylist_policy *policy, u32 count,
+                               u8 *data, size_t size)
+{
+  struct usbwall_image_header header;
+  __le32 *vidpid;
+  __le32 *serial;
+  u32 ref;
+  u32 crc;
+  u32 i;
+  u32 j = 0;
+
+  header.magic = cpu_to_le32(USBWALL_IMAGE_MAGIC);
+  header.version = cpu_to_le32(USBWALL_IMAGE_VERSION);
+  header.count = cpu_to_le32(count);
+  header.arena_size = cpu_to_le32(policy->arena_size);
+  header.vidpid_off = sizeof(header);
+  header.serial_off = header.vidpid_off + count * sizeof(u32);
+  header.arena_off = header.serial_off + count * sizeof(u32);
+  vidpid = (__le32 *)(data + header.vidpid_off);
+  serial = (__le32 *)(data + header.serial_off);
+  /* bounded by count, should a deletion race with the caller */
+  for (i = 0; i < policy->count && j < count; i++) {
+    ref = READ_ONCE(policy->serial[i]);
+    if (ref & KEYLIST_KEY_DEAD) {
+      continue;
+    }
+    vidpid[j] = cpu_to_le32(policy->vidpid[i]);
+    serial[j] = cpu_to_le32(ref);
+    j++;
+  }
+  memcpy(data + header.arena_off, policy->arena, policy->arena_size);
+  header.vidpid_off = cpu_to_le32(header.vidpid_off);
+  header.serial_off = cpu_to_le32(header.serial_off);
+  header.arena_off = cpu_to_le32(header.arena_off);
+  header.crc32 = 0;
+  crc = crc32_le(~0, (const u8 *)&header, sizeof(header));
+  crc = crc32_le(crc, data + sizeof(header), size - sizeof(header)) ^ ~0;
+  header.crc32 = cpu_to_le32(crc);
+  memcpy(data, &header, sizeof(header));
+}
+
+/*!
+** \brief return a reference on the export of a generation, or NULL if it
+** has none. Must be called with keylist_export_mutex held: the exports of
+** the list are all still referenced.
+*/
+static struct keylist_export *keylist_export_find(u64 generation)
+{
+  struct keylist_export *export;
+
+  list_for_each_entry(export, &keylist_exports, list) {
+    if (export->generation == generation) {
+      refcount_inc(&export->refcount);
+      return export;
+    }
+  }
+  return NULL;
+}
+
+/*!
+** \brief return a reference on the export of the current policy
+**
+** The export of the current generation is shared if it is still referenced,
+** else a new one is built. keylist_export_mutex only guards the list of the
+** exports: the image is built without it, so that the exports of different
+** files and the commits never wait for one another. The buffer is allocated
+** outside of the RCU read side and filled inside it, from the snapshot it was
+** sized for, and filled again if a key was deleted in place meanwhile. Two
+** files exporting a same new generation at once may both build it, the first
+** one installed being kept.
+*/
+struct keylist_export	*keylist_export_get(void)
+{
+  const struct keylist_policy *policy;
+  struct keylist_export *export;
+  struct keylist_export *new;
+  struct usbwall_map_header *map = NULL;
+  size_t image_size;
+  size_t size = 0;
+  u64 generation;
+  unsigned int seq;
+  u32 count;
+
+  mutex_lock(&keylist_export_mutex);
+  export = keylist_export_find(keylist_generation());
+  mutex_unlock(&keylist_export_mutex);
+  if (export != NULL) {
+    return export;
+  }
+
+  new = kmalloc(sizeof(*new), GFP_KERNEL);
+  if (new == NULL) {
+    return ERR_PTR(-ENOMEM);
+  }
+  for (;;) {
+    rcu_read_lock();
+    policy = rcu_dereference(key_policy);
+    seq = read_seqcount_begin(&policy->seq);
+    count = policy->count - policy->dead;
+    image_size = sizeof(struct usbwall_image_header) +
+      2 * (size_t)count * sizeof(u32) + policy->arena_size;
+    if (size == sizeof(struct usbwall_map_header) + image_size) {
+      generation = policy->generation;
+      keylist_image_fill(policy, count, (u8 *)(map + 1), image_size);
+      if (!read_seqcount_retry(&policy->seq, seq)) {
+        break;
+      }
+      /* a key was deleted in place meanwhile */
+      rcu_read_unlock();
+      continue;
+    }
+    rcu_read_unlock();
+    /* first try, or the policy changed size meanwhile */
+    vfree(map);
+    size = sizeof(struct usbwall_map_header) + image_size;
+    /* zeroed, page aligned and allowed in a user mapping */
+    map = vmalloc_user(size);
+    if (map == NULL) {
+      export = ERR_PTR(-ENOMEM);
+      goto out;
+    }
+  }
+  rcu_read_unlock();
+  map->magic = cpu_to_le32(USBWALL_MAP_MAGIC);
+  map->image_off = cpu_to_le32(sizeof(struct usbwall_map_header));
+  map->image_size = cpu_to_le32(image_size);
+  map->generation = cpu_to_le64(generation);
+
+  mutex_lock(&keylist_export_mutex);
+  export = keylist_export_find(generation);
+  if (export == NULL) {
+    export = new;
+    export->generation = generation;
+    export->map = map;
+    export->size = size;
+    refcount_set(&export->refcount, 1);
+    list_add(&export->list, &keylist_exports);
+    /* a commit published before the list_add() did not update it */
+    map->live_generation = cpu_to_le64(keylist_generation());
+    new = NULL;
+    map = NULL;
+    DBG_TRACE(DBG_LEVEL_INFO, "policy generation %llu exported: %zu bytes",
+              (unsigned long long)export->generation, export->size);
+  }
+  mutex_unlock(&keylist_export_mutex);
+out:
+  vfree(map);
+  kfree(new);
+  return export;
+}
+
+void	keylist_export_hold(struct keylist_export *export)
+{
+  refcount_inc(&export->refcount);
+}
+
+/*!
+** \brief drop a reference on an export, freeing it with the last one
+*/
+void	keylist_export_put(struct keylist_export *export)
+{
+  if (!refcount_dec_and_mutex_lock(&export->refcount, &keylist_export_mutex)) {
+    return;
+  }
+  list_del(&export->list);
+  mutex_unlock(&keylist_export_mutex);
+  vfree(export->map);
+  kfree(export);
+}
+
+void	*keylist_export_map(const struct keylist_export *export, size_t *size)
+{
+  *size = export->size;
+  return export->map;
+}
+
+/* content of a struct usbwall_key_cursor: the last key returned */
+struct keylist_cursor {
+  u32 started;
+  u32 vidpid;
+  u32 tier;
+  u32 len;
+  char serial[USBWALL_SERIAL_MAX];
+};
+
+/* keyflags of the rules of each tier, as normalized by keylist_normalize() */
+static const keyflags_t keylist_tier_flags[KEYLIST_MATCH_MAX] = {
+  [KEYLIST_MATCH_PATTERN] = USBWALL_KEY_SERIAL_PATTERN,
+  [KEYLIST_MATCH_PRODUCT] = USBWALL_KEY_ANY_SERIAL,
+  [KEYLIST_MATCH_VENDOR] = USBWALL_KEY_ANY_PRODUCT | USBWALL_KEY_ANY_SERIAL,
+};
+
+/*!
+** \brief copy up to max keys following a cursor, and move the cursor
+**
+** The cursor holds the last key returned rather than a position, so a page
+** resumes right after it in the current snapshot, whatever the keys added or
+** deleted before it since the previous page.
+**
+** \param end set if the last key of the policy has been returned
+** \return the number of keys written, or -EINVAL for a corrupted cursor
+*/
+int	keylist_list_keys(struct usbwall_key_cursor *ucursor,
+                          struct usbwall_token_info *keys,
+                          u32 max,
+                          int *end,
+                          u64 *generation)
+{
+  struct keylist_cursor *cursor = (struct keylist_cursor *)ucursor;
+  const struct keylist_policy *policy;
+  struct keylist_view last;
+  struct keylist_view view;
+  u32 pos = 0;
+  u32 high;
+  u32 mid;
+  u32 i = 0;
+
+  BUILD_BUG_ON(sizeof(struct keylist_cursor) != sizeof(struct usbwall_key_cursor));
+  if (cursor->started &&
+      (cursor->tier == KEYLIST_MATCH_NONE || cursor->tier >= KEYLIST_MATCH_MAX ||
+       cursor->len >= USBWALL_SERIAL_MAX)) {
+    return -EINVAL;
+  }
+  last.vidpid = cursor->vidpid;
+  last.tier = cursor->tier;
+  last.serial = cursor->serial;
+  last.len = cursor->len;
+
+  rcu_read_lock();
+  policy = rcu_dereference(key_policy);
+  if (cursor->started) {
+    /* first key above the cursor */
+    high = policy->count;
+    while (pos < high) {
+      mid = pos + (high - pos) / 2;
+      keylist_view_key(&view, policy, mid);
+      if (keylist_view_cmp(&view, &last) <= 0) {
+        pos = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+  }
+  for (; i < max && pos < policy->count; pos++) {
+    /* the dead keys keep their place in the order, but are not listed */
+    if (keylist_view_key(&view, policy, pos)) {
+      continue;
+    }
+    memset(&keys[i], 0, sizeof(keys[i]));
+    keys[i].keyflags = keylist_tier_flags[view.tier];
+    keys[i].idVendor = view.vidpid >> 16;
+    keys[i].idProduct = view.vidpid & 0xffff;
+    memcpy(keys[i].idSerialNumber, view.serial, view.len);
+    last = view;
+    i++;
+  }
+  if (i != 0) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->started = 1;
+    cursor->vidpid = last.vidpid;
+    cursor->tier = last.tier;
+    cursor->len = last.len;
+    memcpy(cursor->serial, last.serial, last.len);
+  }
+  *end = (pos == policy->count);
+  *generation = READ_ONCE(policy->generation);
+  rcu_read_unlock();
+  return i;
+}
+
+/*!
+** \brief allocate a key to be staged. May sleep, never fails.
+*/
+struct internal_token_info	*keyinfo_alloc(void)
+{
+  return mempool_alloc(keyinfo_pool, GFP_KERNEL);
+}
+
+void	keyinfo_free(struct internal_token_info *keyinfo)
+{
+  mempool_free(keyinfo, keyinfo_pool);
+}
+
+/*!
+** \brief delete a key of the current policy in place
+**
+** The key is marked dead in the current snapshot, and the generation bumped,
+** without allocating anything: a deletion never fails for lack of memory,
+** and the next commit compacts the snapshot.
+*/
+static int keylist_policy_kill(const struct keylist_view *view)
+{
+  struct keylist_policy *policy;
+  u64 generation;
+  int status = 0;
+  int pos;
+
+  mutex_lock(&keylist_mutex);
+  policy = rcu_dereference_protected(key_policy, lockdep_is_held(&keylist_mutex));
+  pos = keylist_policy_find(policy, view, keylist_view_hash(view));
+  if (pos < 0) {
+    status = -ENOENT;
+  } else {
+    /* seqcount writers must not be preempted */
+    preempt_disable();
+    write_seqcount_begin(&policy->seq);
+    WRITE_ONCE(policy->serial[pos], policy->serial[pos] | KEYLIST_KEY_DEAD);
+    WRITE_ONCE(policy->tier_count[view->tier], policy->tier_count[view->tier] - 1);
+    WRITE_ONCE(policy->dead, policy->dead + 1);
+    WRITE_ONCE(policy->generation, policy->generation + 1);
+    write_seqcount_end(&policy->seq);
+    preempt_enable();
+    generation = policy->generation;
+    keylist_export_live(generation);
+    DBG_TRACE(DBG_LEVEL_INFO, "policy generation %llu: key %d deleted in place, %u dead keys",
+              (unsigned long long)generation, pos, policy->dead);
+  }
+  mutex_unlock(&keylist_mutex);
+  trace_usbwall_key(1, view->vidpid, view->tier, view->serial, view->len, status);
+  if (status == 0) {
+    usbwall_stat_add(USBWALL_STAT_KEY_DELS, 1);
+  }
+  return status;
+}
+
+/*!
+** \brief apply a single operation as its own transaction
+**
+** The key is copied on the stack: an addition allocates nothing but the new
+** snapshot, and a deletion nothing at all, but for a pattern rule, whose
+** automaton is compiled again by the commit.
+*/
+static int keylist_apply_one(const struct usbwall_token_info *info, keyflags_t op)
+{
+  struct usbwall_token_info key = *info;
+  struct keylist_op keyop;
+  int status;
+  int ret;
+
+  key.keyflags &= USBWALL_KEY_MATCH_MASK;
+  keylist_normalize(&key);
+  keylist_op_init(&keyop, &key, op == USBWALL_KEY_DEL, &status, 0);
+  if (keyop.del && keyop.view.tier != KEYLIST_MATCH_PATTERN) {
+    return keylist_policy_kill(&keyop.view);
+  }
+  ret = keylist_commit_ops(&keyop, 1, NULL);
+  return ret != 0 ? ret : status;
+}
+
+int	key_add(const struct usbwall_token_info*	info)
+{
+  DBG_TRACE(DBG_LEVEL_INFO, "Adding key %.*s to keylist", USBWALL_SERIAL_MAX, info->idSerialNumber);
+  return keylist_apply_one(info, USBWALL_KEY_ADD);
+}
+
+int	key_del(const struct usbwall_token_info*	info)
+{
+  DBG_TRACE(DBG_LEVEL_INFO, "Deleting key %.*s from keylist", USBWALL_SERIAL_MAX, info->idSerialNumber);
+  return keylist_apply_one(info, USBWALL_KEY_DEL);
+}
+
+/*!
+** \brief look a key up in the Bloom filter, then in the index
+**
+** \return the key position, or -1
+*/
+static int keylist_policy_probe(const struct keylist_policy *policy,
+                                const struct keylist_view *view,
+                                u64 hash)
+{
+  int pos;
+
+  this_cpu_inc(keylist_filter_counters.queries);
+  if (!keylist_bloom(policy->bloom, policy->bloom_mask, hash, 0)) {
+    this_cpu_inc(keylist_filter_counters.negatives);
+    return -1;
+  }
+  pos = keylist_policy_find(policy, view, hash);
+  if (pos < 0) {
+    this_cpu_inc(keylist_filter_counters.false_positives);
+  }
+  return pos;
+}
+
+/*!
+** \brief find the pattern rule a device matched
+**
+** Only called once the automaton matched: the pattern rules of the device
+** idVendor:idProduct, which follow its first key, are then matched one by one.
+**
+** \return the position of the first matching pattern rule, or -1
+*/
+static int keylist_policy_pattern(const struct keylist_policy *policy,
+                                  const struct keylist_view *device)
+{
+  const u8 *pattern;
+  u32 lo = 0;
+  u32 hi = policy->count;
+  u32 mid;
+  u32 ref;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (policy->vidpid[mid] < device->vidpid) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
+  for (; lo < policy->count && policy->vidpid[lo] == device->vidpid; lo++) {
+    ref = READ_ONCE(policy->serial[lo]);
+    if ((ref & (KEYLIST_KEY_DEAD | KEYLIST_TIER_MASK)) != KEYLIST_MATCH_PATTERN) {
+      continue;
+    }
+    pattern = policy->arena + (ref >> KEYLIST_TIER_BITS);
+    if (keypattern_match_one((const char *)pattern + 1, pattern[0], device->serial, device->len)) {
+      return lo;
+    }
+  }
+  return -1;
+}
+
+/*!
+** \brief build the key a tier's rules are stored as, for a device
+*/
+static void keylist_tier_view(struct keylist_view *key,
+                              const struct keylist_view *device,
+                              enum keylist_match tier)
+{
+  *key = *device;
+  if (tier == KEYLIST_MATCH_SERIAL) {
+    return;
+  }
+  /* serial patterns are filtered as the idVendor:idProduct wildcard */
+  key->tier = (tier == KEYLIST_MATCH_PATTERN) ? KEYLIST_MATCH_PRODUCT : tier;
+  key->serial = "";
+  key->len = 0;
+  if (tier == KEYLIST_MATCH_VENDOR) {
+    key->vidpid &= 0xffff0000;
+  }
+}
+
+int	keylist_match(struct internal_token_info *keyinfo, struct keylist_rule *rule)
+{
+  const struct keylist_policy *policy;
+  struct keylist_view device;
+  struct keylist_view key;
+  enum keylist_match tier;
+  int known = 1;
+  int found = 0;
+  int pos = -1;
+
+  usbwall_stat_inc(USBWALL_STAT_LOOKUPS);
+  keylist_view_info(&device, &keyinfo->info);
+  device.tier = KEYLIST_MATCH_SERIAL;
+  rcu_read_lock();
+  policy = rcu_dereference(key_policy);
+  /*
+  ** the serial, pattern and product tiers all need a key for the device
+  ** vid:pid. While vidpid[] is a few cache lines, scanning it is cheaper
+  ** than hashing the serial number for an unknown device.
+  */
+  if (policy->count <= KEYLIST_SCAN_MAX_KEYS) {
+    known = keylist_policy_scan(policy, device.vidpid);
+  }
+  for (tier = KEYLIST_MATCH_SERIAL; tier < KEYLIST_MATCH_MAX; tier++) {
+    if (READ_ONCE(policy->tier_count[tier]) == 0) {
+      continue;
+    }
+    if (!known && tier != KEYLIST_MATCH_VENDOR) {
+      continue;
+    }
+    keylist_tier_view(&key, &device, tier);
+    if (tier == KEYLIST_MATCH_PATTERN) {
+      found = keylist_bloom(policy->bloom, policy->bloom_mask, keylist_view_hash(&key), 0) &&
+              keypattern_match(policy->dfa, keyinfo->info.idVendor, keyinfo->info.idProduct,
+                               device.serial, device.len);
+      if (found && rule != NULL) {
+        pos = keylist_policy_pattern(policy, &device);
+      }
+    } else {
+      pos = keylist_policy_probe(policy, &key, keylist_view_hash(&key));
+      found = pos >= 0;
+    }
+    if (found) {
+      break;
+    }
+  }
+  if (found && rule != NULL) {
+    rule->generation = READ_ONCE(policy->generation);
+    rule->vidpid = key.vidpid;
+    rule->serial_off = pos < 0 ? 0 : (READ_ONCE(policy->serial[pos]) & ~KEYLIST_KEY_DEAD) >>
+                                     KEYLIST_TIER_BITS;
+  }
+  rcu_read_unlock();
+  if (!found)
+  {
+    return KEYLIST_MATCH_NONE;
+  }
+  DBG_TRACE (DBG_LEVEL_INFO, "Corresponding usb mass storage device found in list (tier %d). Authorization granted.", tier);
+  return tier;
+}
+
+int	is_key_authorized(struct internal_token_info*	keyinfo)
+{
+  return keylist_match(keyinfo, NULL);
+}
+
+void	keylist_filter_stats(struct keylist_filter_stats *stats)
+{
+  const struct keylist_policy *policy;
+  const struct keylist_filter_counters *counters;
+  int cpu;
+
+  memset(stats, 0, sizeof(*stats));
+  rcu_read_lock();
+  policy = rcu_dereference(key_policy);
+  stats->bits = (u64)(policy->bloom_mask + 1) * KEYLIST_BLOOM_BLOCK_BITS;
+  stats->hashes = KEYLIST_BLOOM_HASHES;
+  stats->keys = policy->count - READ_ONCE(policy->dead);
+  rcu_read_unlock();
+  for_each_possible_cpu(cpu) {
+    counters = per_cpu_ptr(&keylist_filter_counters, cpu);
+    stats->queries += READ_ONCE(counters->queries);
+    stats->negatives += READ_ONCE(counters->negatives);
+    stats->false_positives += READ_ONCE(counters->false_positives);
+  }
+}
+
+void	keylist_usage(u32 *count, size_t *size)
+{
+  const struct keylist_policy *policy;
+
+  rcu_read_lock();
+  policy = rcu_dereference(key_policy);
+  *count = policy->count - READ_ONCE(policy->dead);
+  *size = policy->size;
+  rcu_read_unlock();
+}
+
+u64	keylist_generation(void)
+{
+  u64 generation;
+
+  rcu_read_lock();
+  generation = READ_ONCE(rcu_dereference(key_policy)->generation);
+  rcu_read_unlock();
+  return generation;
+}
+
+/*!
+** \brief start a seq_file walk of the keys of the current policy
+**
+** Position 0 is SEQ_START_TOKEN, for the header of the caller, position n is
+** the key n - 1. Each read() chunk walks the snapshot current at its start,
+** under rcu_read_lock(), so a commit between two chunks shifts the next keys.
+*/
+void	*keylist_seq_start(struct seq_file *m, loff_t *pos)
+  __acquires(RCU)
+{
+  const struct keylist_policy *policy;
+
+  rcu_read_lock();
+  policy = rcu_dereference(key_policy);
+  m->private = (void *)policy;
+  if (*pos == 0) {
+    return SEQ_START_TOKEN;
+  }
+  if (*pos > policy->count) {
+    return NULL;
+  }
+  return (void *)&policy->vidpid[*pos - 1];
+}
+
+void	*keylist_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+  const struct keylist_policy *policy = m->private;
+
+  (*pos)++;
+  if (*pos > policy->count) {
+    return NULL;
+  }
+  return (void *)&policy->vidpid[*pos - 1];
+}
+
+void	keylist_seq_stop(struct seq_file *m, void *v)
+  __releases(RCU)
+{
+  rcu_read_unlock();
+}
+
+/*!
+** \brief print the key v returned by keylist_seq_start() or keylist_seq_next()
+*/
+int	keylist_seq_show(struct seq_file *m, void *v)
+{
+  const struct keylist_policy *policy = m->private;
+  struct keylist_view view;
+  u32 pos = (const u32 *)v - policy->vidpid;
+
+  if (keylist_view_key(&view, policy, pos)) {
+    return SEQ_SKIP;
+  }
+  seq_printf(m, "Key : %u\tidVendor : %x\tidProduct : %x\tSerial Number : %.*s\n",
+             pos, view.vidpid >> 16, view.vidpid & 0xffff, (int)view.len, view.serial);
+  return 0;
 }
 
 int keylist_init()
 {
+  struct keylist_policy *policy;
+
   DBG_TRACE(DBG_LEVEL_INFO, "initialize key list");
-  INIT_LIST_HEAD(&key_list_head); /* Initialize the list */
+  get_random_bytes(&key_hash_secret, sizeof(key_hash_secret));
+  keyinfo_cache = kmem_cache_create("usbwall_keyinfo", sizeof(struct internal_token_info),
+                                    0, 0, NULL);
+  if (keyinfo_cache == NULL) {
+    goto fail_cache;
+  }
+  keyinfo_pool = mempool_create_slab_pool(KEYLIST_KEYINFO_RESERVE, keyinfo_cache);
+  if (keyinfo_pool == NULL) {
+    goto fail_pool;
+  }
+  policy = keylist_policy_alloc(0, 1);
+  if (policy == NULL) {
+    goto fail_policy;
+  }
+  RCU_INIT_POINTER(key_policy, policy);
   return 0;
+
+fail_policy:
+  mempool_destroy(keyinfo_pool);
+fail_pool:
+  kmem_cache_destroy(keyinfo_cache);
+fail_cache:
+  DBG_TRACE(DBG_LEVEL_ERROR, "unable to allocate key policy");
+  return -ENOMEM;
 }
 
+/*!
+** \brief free the current policy. No reader nor writer may be running.
+*/
 void keylist_release()
 {
-  if (!list_empty(&(key_list_head))) {
-    list_for_each_entry_safe(keyinfo_tmp, tmp, &key_list_head, list) /* Get each item */
-    {
-      list_del(&(keyinfo_tmp->list));
-      kfree(keyinfo_tmp);
-    }
-  }
+  mutex_lock(&keylist_mutex);
+  keylist_policy_free(rcu_dereference_protected(key_policy, lockdep_is_held(&keylist_mutex)));
+  RCU_INIT_POINTER(key_policy, NULL);
+  mutex_unlock(&keylist_mutex);
+  /* wait for the pending snapshot frees before the module text goes away */
+  rcu_barrier();
+  mempool_destroy(keyinfo_pool);
+  kmem_cache_destroy(keyinfo_cache);
   DBG_TRACE(DBG_LEVEL_INFO, "release keylist");
 }
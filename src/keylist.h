@@ -41,13 +41,153 @@
 #include "keylist_info.h"
 #include <linux/list.h>
 
-int	key_add(struct internal_token_info*	keyinfo);
+struct seq_file;
 
-int	key_del(struct internal_token_info*	keyinfo);
+/* upper bound of the operations staged in a single transaction */
+#define KEYLIST_TXN_MAX_OPS	(1U << 20)
+/*
+** upper bound of the operations staged in all the open transactions at
+** once: each open file of /dev/usbwall may hold one
+*/
+#define KEYLIST_STAGED_MAX	(1U << 20)
+
+/*
+** A transaction stages key additions and deletions (USBWALL_KEY_ADD or
+** USBWALL_KEY_DEL in keyflags). Nothing is visible to the lookups until
+** keylist_txn_commit() swaps the whole new policy in.
+*/
+struct keylist_txn {
+  struct list_head ops;
+  unsigned int nr_ops;
+};
+
+void	keylist_txn_begin(struct keylist_txn *txn);
+
+int	keylist_txn_stage(struct keylist_txn *txn, struct internal_token_info *keyinfo);
+
+int	keylist_txn_commit(struct keylist_txn *txn, u64 *generation);
+
+void	keylist_txn_release(struct keylist_txn *txn);
+
+/*
+** apply count additions or deletions (op is USBWALL_KEY_ADD or
+** USBWALL_KEY_DEL, or 0 to take it from the keyflags of each key) as a single
+** transaction, without staging the keys. The keys are normalized in place.
+** If status is not NULL, status[i] is set to the result of infos[i]: 0,
+** -EEXIST when adding a present key, -ENOENT when deleting an absent one.
+*/
+int	keylist_apply_batch(struct usbwall_token_info *infos,
+                            u32 count,
+                            keyflags_t op,
+                            int *status,
+                            u64 *generation);
+
+struct internal_token_info	*keyinfo_alloc(void);
+
+void	keyinfo_free(struct internal_token_info *keyinfo);
+
+/*
+** replace the whole policy by the keys of a binary policy image (see
+** struct usbwall_image_header). The current policy is left unchanged if the
+** image is not valid.
+*/
+int	keylist_load_image(const void *image, size_t size, u64 *generation);
+
+/*
+** read-only snapshot of the policy for userspace: a vmalloc_user() buffer
+** holding a struct usbwall_map_header and the policy image. The exports of a
+** same generation are shared, and each one stays valid until its last
+** reference is put.
+*/
+struct keylist_export;
+
+struct keylist_export	*keylist_export_get(void);
+
+void	keylist_export_hold(struct keylist_export *export);
+
+void	keylist_export_put(struct keylist_export *export);
+
+void	*keylist_export_map(const struct keylist_export *export, size_t *size);
+
+/*
+** copy up to max keys of the current policy following cursor (see
+** USBWALL_IO_LISTKEYS), and move the cursor past them. Returns the number of
+** keys copied, end is set once the listing reached the last key.
+*/
+int	keylist_list_keys(struct usbwall_key_cursor *cursor,
+                          struct usbwall_token_info *keys,
+                          u32 max,
+                          int *end,
+                          u64 *generation);
+
+int	key_add(const struct usbwall_token_info*	info);
+
+int	key_del(const struct usbwall_token_info*	info);
+
+/*
+** rule tiers, from the most specific one. is_key_authorized() returns the
+** tier of the first matching rule, or KEYLIST_MATCH_NONE.
+*/
+enum keylist_match {
+  KEYLIST_MATCH_NONE = 0,
+  KEYLIST_MATCH_SERIAL,		/* exact (idVendor, idProduct, idSerialNumber) */
+  KEYLIST_MATCH_PATTERN,	/* USBWALL_KEY_SERIAL_PATTERN rule */
+  KEYLIST_MATCH_PRODUCT,	/* USBWALL_KEY_ANY_SERIAL rule */
+  KEYLIST_MATCH_VENDOR,		/* USBWALL_KEY_ANY_PRODUCT rule */
+  KEYLIST_MATCH_MAX
+};
 
 int	is_key_authorized(struct internal_token_info*	keyinfo);
 
-void 	print_keylist(char* status_buffer);
+/*
+** the rule a device matched, as a key of the policy image of generation:
+** serial_off is the arena offset of its serial number or pattern, 0 for the
+** wildcard rules.
+*/
+struct keylist_rule {
+  u64 generation;
+  u32 vidpid;			/* idVendor << 16 | idProduct, 0 idProduct for tier 4 */
+  u32 serial_off;
+};
+
+/*
+** is_key_authorized(), also filling rule, if not NULL, on a match
+*/
+int	keylist_match(struct internal_token_info *keyinfo, struct keylist_rule *rule);
+
+/*
+** Bloom filter geometry and outcome of the index lookups since load. A
+** false positive is a lookup that passed the filter and missed the index.
+*/
+struct keylist_filter_stats {
+  u64 bits;
+  u32 hashes;
+  u32 keys;
+  u64 queries;
+  u64 negatives;
+  u64 false_positives;
+};
+
+void	keylist_filter_stats(struct keylist_filter_stats *stats);
+
+/*
+** number of keys of the current policy, and bytes held by its snapshot
+*/
+void	keylist_usage(u32 *count, size_t *size);
+
+u64	keylist_generation(void);
+
+/*
+** seq_file iterator on the keys of the current policy. keylist_seq_show()
+** only prints the keys: SEQ_START_TOKEN is left to the caller.
+*/
+void	*keylist_seq_start(struct seq_file *m, loff_t *pos);
+
+void	*keylist_seq_next(struct seq_file *m, void *v, loff_t *pos);
+
+void	keylist_seq_stop(struct seq_file *m, void *v);
+
+int	keylist_seq_show(struct seq_file *m, void *v);
 
 int 	keylist_init(void);
 
@@ -40,7 +40,8 @@
 
 struct internal_token_info {
  struct usbwall_token_info info;
- struct list_head list;
+ struct list_head list; /* transaction staging */
+ int status; /* operation result, set on commit */
 };
 
 #endif /*! KEYLIST_INFO_H_*/
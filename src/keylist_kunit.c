@@ -0,0 +1,468 @@
+/*
+** File keylist_kunit.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keylist_kunit.c
+**
+** KUnit concurrency stress suite of the policy engine
+**
+** Built with "make KUNIT=1" into usbwall_kunit.ko, which holds the policy
+** engine and this suite but not the USB driver, so that it also loads under
+** UML. Each round runs 1 to KEYLIST_KUNIT_MAX_THREADS kthreads for
+** stress_ms, each one mixing is_key_authorized() with key_add(), key_del()
+** and small batches, as the ioctl and probe paths do.
+**
+** Every thread owns the keys of its own vendor id and is the only one
+** writing them, so the status of each of its operations, and the tier found
+** for each of its keys, are known even while the others write. The lookups
+** also check keys which never change during a round: pinned serial keys, a
+** vendor wildcard, and an unknown vendor. Once the threads are stopped, the
+** whole policy must hold exactly the keys the threads believe present.
+**
+** Each round reports its throughput, to catch scaling regressions:
+**
+**   # keylist_test_stress_lookups: 4 threads: 1843211 lookups/s, 97011 writes/s, 485055 ops/s per thread
+**
+** The suite is meant to run on a kernel built with CONFIG_KCSAN and
+** CONFIG_PROVE_LOCKING, which report any data race or lock misuse of the
+** engine on the console while it runs.
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/bitmap.h>
+#include <linux/sched.h>
+#include <kunit/test.h>
+#include "keylist.h"
+#include "keylist_info.h"
+#include "usbwall.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 0)
+# error "the KUnit suite needs a 5.5 kernel or later"
+#endif
+
+#define KEYLIST_KUNIT_MAX_THREADS	16
+/* keys owned by each thread, all of them on its own vendor id */
+#define KEYLIST_KUNIT_KEYS		64
+#define KEYLIST_KUNIT_BATCH		8
+#define KEYLIST_KUNIT_PINNED		64
+
+#define KEYLIST_KUNIT_PINNED_VENDOR	0xfd00
+#define KEYLIST_KUNIT_WILDCARD_VENDOR	0xfd01
+#define KEYLIST_KUNIT_ABSENT_VENDOR	0xfc00
+#define KEYLIST_KUNIT_THREAD_VENDOR	0xfe00
+
+static unsigned int stress_ms = 200;
+module_param(stress_ms, uint, 0444);
+MODULE_PARM_DESC(stress_ms, "Duration of each stress round, in milliseconds (default 200)");
+
+struct keylist_kunit_round;
+
+struct keylist_kunit_worker {
+  struct task_struct *task;
+  struct keylist_kunit_round *round;
+  unsigned int id;
+  u64 state;
+  DECLARE_BITMAP(present, KEYLIST_KUNIT_KEYS);	/* own keys in the policy */
+  u64 generation;				/* last one seen */
+  u64 lookups;
+  u64 writes;
+  unsigned long errors;
+  const char *error;				/* first inconsistency */
+};
+
+struct keylist_kunit_round {
+  struct completion start;
+  unsigned int nr_workers;
+  unsigned int write_percent;
+  struct keylist_kunit_worker workers[KEYLIST_KUNIT_MAX_THREADS];
+};
+
+static u32 keylist_kunit_rand(struct keylist_kunit_worker *worker)
+{
+  /* xorshift64*: each thread has its own sequence, no shared state */
+  worker->state ^= worker->state >> 12;
+  worker->state ^= worker->state << 25;
+  worker->state ^= worker->state >> 27;
+  return (u32)((worker->state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static void keylist_kunit_key(struct usbwall_token_info *info, u16 vendor, unsigned int key)
+{
+  memset(info, 0, sizeof(*info));
+  info->idVendor = vendor;
+  info->idProduct = 1;
+  snprintf(info->idSerialNumber, sizeof(info->idSerialNumber), "KUNIT%04x", key);
+}
+
+static void keylist_kunit_error(struct keylist_kunit_worker *worker, const char *error)
+{
+  if (worker->errors++ == 0) {
+    worker->error = error;
+  }
+}
+
+/*!
+** \brief add or delete one of the own keys of the worker
+*/
+static void keylist_kunit_write_one(struct keylist_kunit_worker *worker)
+{
+  struct usbwall_token_info info;
+  unsigned int key = keylist_kunit_rand(worker) % KEYLIST_KUNIT_KEYS;
+  int present = test_bit(key, worker->present);
+  int del = keylist_kunit_rand(worker) & 1;
+  int want;
+  int ret;
+
+  keylist_kunit_key(&info, KEYLIST_KUNIT_THREAD_VENDOR + worker->id, key);
+  if (del) {
+    ret = key_del(&info);
+    want = present ? 0 : -ENOENT;
+  } else {
+    ret = key_add(&info);
+    want = present ? -EEXIST : 0;
+  }
+  if (ret != want) {
+    keylist_kunit_error(worker, del ? "unexpected key_del() status" : "unexpected key_add() status");
+  } else if (ret == 0) {
+    __change_bit(key, worker->present);
+  }
+}
+
+/*!
+** \brief apply a batch of additions and deletions of the own keys of the
+** worker, some of them on the same key
+*/
+static void keylist_kunit_write_batch(struct keylist_kunit_worker *worker)
+{
+  struct usbwall_token_info infos[KEYLIST_KUNIT_BATCH];
+  int status[KEYLIST_KUNIT_BATCH];
+  unsigned int keys[KEYLIST_KUNIT_BATCH];
+  int del[KEYLIST_KUNIT_BATCH];
+  unsigned int count = 1 + keylist_kunit_rand(worker) % KEYLIST_KUNIT_BATCH;
+  unsigned int i;
+  int present;
+  int ret;
+
+  for (i = 0; i < count; i++) {
+    keys[i] = keylist_kunit_rand(worker) % (KEYLIST_KUNIT_KEYS / 4);
+    keylist_kunit_key(&infos[i], KEYLIST_KUNIT_THREAD_VENDOR + worker->id, keys[i]);
+    del[i] = keylist_kunit_rand(worker) & 1;
+    infos[i].keyflags = del[i] ? USBWALL_KEY_DEL : USBWALL_KEY_ADD;
+  }
+  ret = keylist_apply_batch(infos, count, 0, status, NULL);
+  if (ret < 0) {
+    keylist_kunit_error(worker, "keylist_apply_batch() failed");
+    return;
+  }
+  /* the operations of a batch apply in order, on normalized keys */
+  for (i = 0; i < count; i++) {
+    present = test_bit(keys[i], worker->present);
+    if (del[i]) {
+      if (status[i] != (present ? 0 : -ENOENT)) {
+        keylist_kunit_error(worker, "unexpected batch deletion status");
+      }
+      __clear_bit(keys[i], worker->present);
+    } else {
+      if (status[i] != (present ? -EEXIST : 0)) {
+        keylist_kunit_error(worker, "unexpected batch addition status");
+      }
+      __set_bit(keys[i], worker->present);
+    }
+  }
+}
+
+/*!
+** \brief look a device up, and check the tier found when it is known
+*/
+static void keylist_kunit_lookup(struct keylist_kunit_worker *worker)
+{
+  struct keylist_kunit_round *round = worker->round;
+  struct internal_token_info device;
+  u32 r = keylist_kunit_rand(worker);
+  unsigned int key = (r >> 8) % KEYLIST_KUNIT_KEYS;
+  unsigned int other;
+  int want = -1;	/* either KEYLIST_MATCH_NONE or KEYLIST_MATCH_SERIAL */
+  u64 generation;
+  int tier;
+
+  memset(&device, 0, sizeof(device));
+  switch (r % 5) {
+    case 0:
+      keylist_kunit_key(&device.info, KEYLIST_KUNIT_PINNED_VENDOR, key % KEYLIST_KUNIT_PINNED);
+      want = KEYLIST_MATCH_SERIAL;
+      break;
+    case 1:
+      keylist_kunit_key(&device.info, KEYLIST_KUNIT_WILDCARD_VENDOR, key);
+      device.info.idProduct = r >> 16;
+      want = KEYLIST_MATCH_VENDOR;
+      break;
+    case 2:
+      keylist_kunit_key(&device.info, KEYLIST_KUNIT_ABSENT_VENDOR, key);
+      want = KEYLIST_MATCH_NONE;
+      break;
+    case 3:
+      keylist_kunit_key(&device.info, KEYLIST_KUNIT_THREAD_VENDOR + worker->id, key);
+      want = test_bit(key, worker->present) ? KEYLIST_MATCH_SERIAL : KEYLIST_MATCH_NONE;
+      break;
+    default:
+      /* written by another thread meanwhile */
+      other = (r >> 16) % round->nr_workers;
+      keylist_kunit_key(&device.info, KEYLIST_KUNIT_THREAD_VENDOR + other, key);
+      break;
+  }
+  tier = is_key_authorized(&device);
+  if (want < 0 ? (tier != KEYLIST_MATCH_NONE && tier != KEYLIST_MATCH_SERIAL) : tier != want) {
+    keylist_kunit_error(worker, "unexpected is_key_authorized() tier");
+  }
+  /* a thread never sees an older policy than one it already saw */
+  generation = keylist_generation();
+  if (generation < worker->generation) {
+    keylist_kunit_error(worker, "policy generation went backwards");
+  }
+  worker->generation = generation;
+}
+
+static int keylist_kunit_thread(void *data)
+{
+  struct keylist_kunit_worker *worker = data;
+  struct keylist_kunit_round *round = worker->round;
+
+  wait_for_completion(&round->start);
+  while (!kthread_should_stop()) {
+    if (keylist_kunit_rand(worker) % 100 < round->write_percent) {
+      if (keylist_kunit_rand(worker) % 8 == 0) {
+        keylist_kunit_write_batch(worker);
+      } else {
+        keylist_kunit_write_one(worker);
+      }
+      worker->writes++;
+    } else {
+      keylist_kunit_lookup(worker);
+      worker->lookups++;
+    }
+    cond_resched();
+  }
+  return 0;
+}
+
+/*!
+** \brief check that the policy holds exactly the keys the workers believe
+** present, then delete them for the next round
+*/
+static void keylist_kunit_check(struct kunit *test, struct keylist_kunit_round *round)
+{
+  struct keylist_kunit_worker *worker;
+  struct internal_token_info device;
+  struct usbwall_token_info info;
+  unsigned int present = 0;
+  unsigned int i;
+  unsigned int key;
+  u32 count;
+  size_t size;
+  int want;
+
+  for (i = 0; i < round->nr_workers; i++) {
+    worker = &round->workers[i];
+    for (key = 0; key < KEYLIST_KUNIT_KEYS; key++) {
+      memset(&device, 0, sizeof(device));
+      keylist_kunit_key(&device.info, KEYLIST_KUNIT_THREAD_VENDOR + i, key);
+      want = test_bit(key, worker->present) ? KEYLIST_MATCH_SERIAL : KEYLIST_MATCH_NONE;
+      KUNIT_EXPECT_EQ_MSG(test, is_key_authorized(&device), want,
+                          "thread %u key %u", i, key);
+    }
+    present += bitmap_weight(worker->present, KEYLIST_KUNIT_KEYS);
+  }
+  keylist_usage(&count, &size);
+  KUNIT_EXPECT_EQ(test, count, KEYLIST_KUNIT_PINNED + 1 + present);
+
+  for (i = 0; i < round->nr_workers; i++) {
+    worker = &round->workers[i];
+    for_each_set_bit(key, worker->present, KEYLIST_KUNIT_KEYS) {
+      keylist_kunit_key(&info, KEYLIST_KUNIT_THREAD_VENDOR + i, key);
+      KUNIT_EXPECT_EQ(test, key_del(&info), 0);
+    }
+  }
+}
+
+/*!
+** \brief run one round of nr_workers threads for stress_ms, and report
+** their throughput
+*/
+static void keylist_kunit_round(struct kunit *test, unsigned int nr_workers, unsigned int write_percent)
+{
+  struct keylist_kunit_round *round;
+  struct keylist_kunit_worker *worker;
+  ktime_t start;
+  u64 elapsed_us;
+  u64 lookups = 0;
+  u64 writes = 0;
+  unsigned int i;
+
+  round = kunit_kzalloc(test, sizeof(*round), GFP_KERNEL);
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, round);
+  init_completion(&round->start);
+  round->nr_workers = nr_workers;
+  round->write_percent = write_percent;
+  for (i = 0; i < nr_workers; i++) {
+    worker = &round->workers[i];
+    worker->round = round;
+    worker->id = i;
+    worker->state = 0x9e3779b97f4a7c15ULL * (i + 1) + nr_workers;
+    worker->task = kthread_run(keylist_kunit_thread, worker, "usbwall_kunit/%u", i);
+    if (IS_ERR(worker->task)) {
+      KUNIT_FAIL(test, "unable to start thread %u: error %ld", i, PTR_ERR(worker->task));
+      /* the started ones wait for round->start */
+      round->nr_workers = i;
+      break;
+    }
+  }
+
+  start = ktime_get();
+  complete_all(&round->start);
+  if (round->nr_workers == nr_workers) {
+    msleep(stress_ms);
+  }
+  /* kthread_stop() waits for each thread to return */
+  for (i = 0; i < round->nr_workers; i++) {
+    kthread_stop(round->workers[i].task);
+  }
+  elapsed_us = max_t(u64, ktime_us_delta(ktime_get(), start), 1);
+
+  for (i = 0; i < round->nr_workers; i++) {
+    worker = &round->workers[i];
+    KUNIT_EXPECT_EQ_MSG(test, worker->errors, 0UL, "thread %u: %s", i,
+                        worker->error ? worker->error : "");
+    lookups += worker->lookups;
+    writes += worker->writes;
+  }
+  keylist_kunit_check(test, round);
+  if (round->nr_workers != 0) {
+    kunit_info(test, "%u threads: %llu lookups/s, %llu writes/s, %llu ops/s per thread\n",
+               round->nr_workers,
+               div64_u64(lookups * USEC_PER_SEC, elapsed_us),
+               div64_u64(writes * USEC_PER_SEC, elapsed_us),
+               div64_u64((lookups + writes) * USEC_PER_SEC, elapsed_us * round->nr_workers));
+  }
+}
+
+static void keylist_kunit_stress(struct kunit *test, unsigned int write_percent)
+{
+  unsigned int nr_workers;
+
+  for (nr_workers = 1; nr_workers <= KEYLIST_KUNIT_MAX_THREADS; nr_workers *= 2) {
+    keylist_kunit_round(test, nr_workers, write_percent);
+  }
+}
+
+/*!
+** \brief statuses of single key operations, without concurrency
+*/
+static void keylist_test_statuses(struct kunit *test)
+{
+  struct internal_token_info device;
+  struct usbwall_token_info info;
+
+  keylist_kunit_key(&info, KEYLIST_KUNIT_THREAD_VENDOR, 0);
+  memset(&device, 0, sizeof(device));
+  device.info = info;
+  KUNIT_EXPECT_EQ(test, is_key_authorized(&device), KEYLIST_MATCH_NONE);
+  KUNIT_EXPECT_EQ(test, key_add(&info), 0);
+  KUNIT_EXPECT_EQ(test, key_add(&info), -EEXIST);
+  KUNIT_EXPECT_EQ(test, is_key_authorized(&device), KEYLIST_MATCH_SERIAL);
+  KUNIT_EXPECT_EQ(test, key_del(&info), 0);
+  KUNIT_EXPECT_EQ(test, key_del(&info), -ENOENT);
+  KUNIT_EXPECT_EQ(test, is_key_authorized(&device), KEYLIST_MATCH_NONE);
+}
+
+/* the probe path: mostly lookups, a few policy changes */
+static void keylist_test_stress_lookups(struct kunit *test)
+{
+  keylist_kunit_stress(test, 5);
+}
+
+/* the ioctl path: writers contending on the policy mutex */
+static void keylist_test_stress_writes(struct kunit *test)
+{
+  keylist_kunit_stress(test, 50);
+}
+
+/*!
+** \brief start each test from a fresh policy holding the keys which the
+** lookups expect to find
+*/
+static int keylist_kunit_init(struct kunit *test)
+{
+  struct usbwall_token_info info;
+  unsigned int key;
+  int err;
+
+  err = keylist_init();
+  if (err) {
+    return err;
+  }
+  for (key = 0; key < KEYLIST_KUNIT_PINNED; key++) {
+    keylist_kunit_key(&info, KEYLIST_KUNIT_PINNED_VENDOR, key);
+    err = key_add(&info);
+    if (err) {
+      goto fail;
+    }
+  }
+  memset(&info, 0, sizeof(info));
+  info.keyflags = USBWALL_KEY_ANY_PRODUCT;
+  info.idVendor = KEYLIST_KUNIT_WILDCARD_VENDOR;
+  err = key_add(&info);
+  if (err) {
+    goto fail;
+  }
+  return 0;
+
+fail:
+  keylist_release();
+  return err;
+}
+
+static void keylist_kunit_exit(struct kunit *test)
+{
+  keylist_release();
+}
+
+static struct kunit_case keylist_kunit_cases[] = {
+  KUNIT_CASE(keylist_test_statuses),
+  KUNIT_CASE(keylist_test_stress_lookups),
+  KUNIT_CASE(keylist_test_stress_writes),
+  {}
+};
+
+static struct kunit_suite keylist_kunit_suite = {
+  .name = "usbwall_keylist",
+  .init = keylist_kunit_init,
+  .exit = keylist_kunit_exit,
+  .test_cases = keylist_kunit_cases,
+};
+
+kunit_test_suite(keylist_kunit_suite);
+
+MODULE_DESCRIPTION ("KUnit suite of the usbwall policy engine");
+MODULE_LICENSE ("GPL");
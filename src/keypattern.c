@@ -0,0 +1,416 @@
+/*
+** File keypattern.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keypattern.c
+**
+** Serial number glob patterns, compiled into a single automaton
+**
+** Each pattern of length n is a chain of n + 1 NFA positions, the last one
+** being accepting. A '*' position loops on any byte and is always entered
+** together with the next position. The DFA is built by subset construction
+** over the bytes classes of the patterns: all the bytes that don't appear as
+** a literal in any pattern behave the same, and share class 0.
+**
+** The DFA state 0 is the dead state: matching stops as soon as it is reached.
+*/
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/bitmap.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
+#include <linux/refcount.h>
+#include <linux/string.h>
+#include <linux/sched.h>
+#include "keypattern.h"
+#include "trace.h"
+
+struct keypattern_dfa {
+  refcount_t ref;
+  u32 nr_states;
+  u32 nr_classes;
+  u32 start;
+  u8 class_of[256];
+  u32 *trans;		/* [nr_states][nr_classes] */
+  u32 *accept_off;	/* [nr_states + 1], bounds of each state in accept[] */
+  u32 *accept;		/* sorted idVendor << 16 | idProduct */
+};
+
+/* subset construction working area */
+struct keypattern_build {
+  u32 nr_pos;
+  u32 words;			/* bitmap words of a positions set */
+  u8 *pos_char;			/* literal, '?', '*' or 0 on accepting positions */
+  u32 *pos_vidpid;
+  u8 class_of[256];
+  u32 nr_classes;
+  u32 nr_states;
+  unsigned long *sets;		/* [KEYPATTERN_MAX_STATES][words] */
+  u32 *trans;			/* [KEYPATTERN_MAX_STATES][nr_classes] */
+  u32 *hash_head;		/* [KEYPATTERN_MAX_STATES], state + 1 */
+  u32 *hash_next;		/* [KEYPATTERN_MAX_STATES], state + 1 */
+};
+
+static unsigned long *keypattern_set(struct keypattern_build *b, u32 state)
+{
+  return &b->sets[(size_t)state * b->words];
+}
+
+/*!
+** \brief enter the next position of every '*' of the set
+**
+** The positions are visited in increasing order, so chained '*' are handled
+** by the same sweep.
+*/
+static void keypattern_closure(struct keypattern_build *b, unsigned long *set)
+{
+  unsigned long pos;
+
+  for_each_set_bit(pos, set, b->nr_pos) {
+    if (b->pos_char[pos] == '*') {
+      __set_bit(pos + 1, set);
+    }
+  }
+}
+
+/*!
+** \brief return the DFA state of a positions set, creating it if needed
+**
+** \return the state number, or -E2BIG when there are too many states
+*/
+static int keypattern_state(struct keypattern_build *b, const unsigned long *set)
+{
+  u32 bucket = jhash(set, b->words * sizeof(unsigned long), 0) % KEYPATTERN_MAX_STATES;
+  u32 state;
+
+  for (state = b->hash_head[bucket]; state != 0; state = b->hash_next[state - 1]) {
+    if (bitmap_equal(keypattern_set(b, state - 1), set, b->nr_pos)) {
+      return state - 1;
+    }
+  }
+  if (b->nr_states == KEYPATTERN_MAX_STATES) {
+    return -E2BIG;
+  }
+  state = b->nr_states++;
+  bitmap_copy(keypattern_set(b, state), set, b->nr_pos);
+  b->hash_next[state] = b->hash_head[bucket];
+  b->hash_head[bucket] = state + 1;
+  return state;
+}
+
+static int keypattern_u32_cmp(const void *a, const void *b)
+{
+  u32 ua = *(const u32 *)a;
+  u32 ub = *(const u32 *)b;
+
+  return ua < ub ? -1 : ua > ub;
+}
+
+/*!
+** \brief build the DFA transitions, states are numbered as they are found
+*/
+static int keypattern_subset(struct keypattern_build *b, u32 *start)
+{
+  unsigned long *next;
+  unsigned long pos;
+  u32 state;
+  u32 class;
+  u8 ch;
+  int ret;
+
+  next = bitmap_zalloc(b->nr_pos, GFP_KERNEL);
+  if (next == NULL) {
+    return -ENOMEM;
+  }
+  /* dead state first, so that it gets number 0 */
+  ret = keypattern_state(b, next);
+  /* then the start state: the first position of every pattern */
+  for (pos = 0; pos < b->nr_pos; pos++) {
+    if (pos == 0 || b->pos_char[pos - 1] == 0) {
+      __set_bit(pos, next);
+    }
+  }
+  keypattern_closure(b, next);
+  ret = keypattern_state(b, next);
+  *start = ret;
+  /*
+  ** the states array grows while it is walked. Up to
+  ** KEYPATTERN_MAX_STATES x classes x positions steps, under keylist_mutex:
+  ** let the other tasks run between the states.
+  */
+  for (state = 0; state < b->nr_states; state++) {
+    cond_resched();
+    for (class = 0; class < b->nr_classes; class++) {
+      bitmap_zero(next, b->nr_pos);
+      for_each_set_bit(pos, keypattern_set(b, state), b->nr_pos) {
+        ch = b->pos_char[pos];
+        if (ch == '*') {
+          __set_bit(pos, next);
+        } else if (ch == '?' || (ch != 0 && b->class_of[ch] == class)) {
+          __set_bit(pos + 1, next);
+        }
+      }
+      keypattern_closure(b, next);
+      ret = keypattern_state(b, next);
+      if (ret < 0) {
+        goto out;
+      }
+      b->trans[state * b->nr_classes + class] = ret;
+    }
+  }
+  ret = 0;
+out:
+  bitmap_free(next);
+  return ret;
+}
+
+/*!
+** \brief copy the built automaton into a single allocation
+*/
+static struct keypattern_dfa *keypattern_pack(struct keypattern_build *b, u32 start)
+{
+  struct keypattern_dfa *dfa;
+  unsigned long pos;
+  u32 nr_accept = 0;
+  u32 state;
+  u32 i;
+  u32 n;
+  u32 *accept;
+  size_t trans_size = (size_t)b->nr_states * b->nr_classes * sizeof(u32);
+
+  for (state = 0; state < b->nr_states; state++) {
+    for_each_set_bit(pos, keypattern_set(b, state), b->nr_pos) {
+      nr_accept += (b->pos_char[pos] == 0);
+    }
+  }
+  dfa = kvmalloc(sizeof(*dfa) + trans_size + (b->nr_states + 1 + nr_accept) * sizeof(u32),
+                 GFP_KERNEL);
+  if (dfa == NULL) {
+    return ERR_PTR(-ENOMEM);
+  }
+  refcount_set(&dfa->ref, 1);
+  dfa->nr_states = b->nr_states;
+  dfa->nr_classes = b->nr_classes;
+  dfa->start = start;
+  memcpy(dfa->class_of, b->class_of, sizeof(dfa->class_of));
+  dfa->trans = (u32 *)(dfa + 1);
+  dfa->accept_off = dfa->trans + (size_t)b->nr_states * b->nr_classes;
+  dfa->accept = dfa->accept_off + b->nr_states + 1;
+  memcpy(dfa->trans, b->trans, trans_size);
+  nr_accept = 0;
+  for (state = 0; state < b->nr_states; state++) {
+    dfa->accept_off[state] = nr_accept;
+    accept = &dfa->accept[nr_accept];
+    n = 0;
+    for_each_set_bit(pos, keypattern_set(b, state), b->nr_pos) {
+      if (b->pos_char[pos] == 0) {
+        accept[n++] = b->pos_vidpid[pos];
+      }
+    }
+    /* several patterns of a same idVendor:idProduct may end here */
+    sort(accept, n, sizeof(u32), keypattern_u32_cmp, NULL);
+    for (i = 0; i < n; i++) {
+      if (i == 0 || accept[i] != dfa->accept[nr_accept - 1]) {
+        dfa->accept[nr_accept++] = accept[i];
+      }
+    }
+  }
+  dfa->accept_off[b->nr_states] = nr_accept;
+  return dfa;
+}
+
+static void keypattern_build_free(struct keypattern_build *b)
+{
+  kvfree(b->pos_char);
+  kvfree(b->pos_vidpid);
+  kvfree(b->sets);
+  kvfree(b->trans);
+  kvfree(b->hash_head);
+  kvfree(b->hash_next);
+}
+
+/*!
+** \brief compile a set of serial patterns into an automaton
+**
+** \param rules the USBWALL_KEY_SERIAL_PATTERN rules
+** \param count number of rules
+**
+** \return the automaton, ERR_PTR(-E2BIG) if the patterns are too long or
+**         need too many states, ERR_PTR(-ENOMEM)
+*/
+struct keypattern_dfa *keypattern_compile(const struct keypattern_rule *rules,
+                                          u32 count)
+{
+  struct keypattern_build b;
+  struct keypattern_dfa *dfa;
+  const char *pattern;
+  size_t len;
+  u32 start = 0;
+  u32 pos;
+  u32 i;
+  u32 j;
+  int ret;
+
+  memset(&b, 0, sizeof(b));
+  for (i = 0; i < count; i++) {
+    b.nr_pos += rules[i].len + 1;
+  }
+  if (b.nr_pos > KEYPATTERN_MAX_POSITIONS) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "serial patterns too long: %u positions", b.nr_pos);
+    return ERR_PTR(-E2BIG);
+  }
+  /* one class per literal byte, class 0 for all the others */
+  b.nr_classes = 1;
+  for (i = 0; i < count; i++) {
+    pattern = rules[i].pattern;
+    len = rules[i].len;
+    for (j = 0; j < len; j++) {
+      if (pattern[j] != '*' && pattern[j] != '?' && b.class_of[(u8)pattern[j]] == 0) {
+        b.class_of[(u8)pattern[j]] = b.nr_classes++;
+      }
+    }
+  }
+  b.words = BITS_TO_LONGS(b.nr_pos);
+  b.pos_char = kvmalloc(b.nr_pos, GFP_KERNEL);
+  b.pos_vidpid = kvmalloc_array(b.nr_pos, sizeof(u32), GFP_KERNEL);
+  b.sets = kvmalloc_array((size_t)KEYPATTERN_MAX_STATES * b.words, sizeof(unsigned long), GFP_KERNEL);
+  b.trans = kvmalloc_array((size_t)KEYPATTERN_MAX_STATES * b.nr_classes, sizeof(u32), GFP_KERNEL);
+  b.hash_head = kvcalloc(KEYPATTERN_MAX_STATES, sizeof(u32), GFP_KERNEL);
+  b.hash_next = kvmalloc_array(KEYPATTERN_MAX_STATES, sizeof(u32), GFP_KERNEL);
+  if (!b.pos_char || !b.pos_vidpid || !b.sets || !b.trans || !b.hash_head || !b.hash_next) {
+    dfa = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+  pos = 0;
+  for (i = 0; i < count; i++) {
+    pattern = rules[i].pattern;
+    len = rules[i].len;
+    for (j = 0; j <= len; j++, pos++) {
+      b.pos_char[pos] = (j < len) ? pattern[j] : 0;
+      b.pos_vidpid[pos] = (u32)rules[i].idVendor << 16 | rules[i].idProduct;
+    }
+  }
+  ret = keypattern_subset(&b, &start);
+  if (ret != 0) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "unable to compile %u serial patterns: error %d", count, ret);
+    dfa = ERR_PTR(ret);
+    goto out;
+  }
+  dfa = keypattern_pack(&b, start);
+  if (!IS_ERR(dfa)) {
+    DBG_TRACE(DBG_LEVEL_INFO, "%u serial patterns compiled: %u states, %u classes",
+              count, dfa->nr_states, dfa->nr_classes);
+  }
+out:
+  keypattern_build_free(&b);
+  return dfa;
+}
+
+/*!
+** \brief match a serial number against all the patterns at once
+**
+** \return 1 if a pattern of idVendor:idProduct matches the serial number
+*/
+int keypattern_match(const struct keypattern_dfa *dfa,
+                     u16 idVendor,
+                     u16 idProduct,
+                     const char *serial,
+                     size_t len)
+{
+  u32 vidpid = (u32)idVendor << 16 | idProduct;
+  u32 state = dfa->start;
+  u32 lo;
+  u32 hi;
+  u32 mid;
+  size_t i;
+
+  for (i = 0; i < len && serial[i] != '\0' && state != 0; i++) {
+    state = dfa->trans[state * dfa->nr_classes + dfa->class_of[(u8)serial[i]]];
+  }
+  lo = dfa->accept_off[state];
+  hi = dfa->accept_off[state + 1];
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (dfa->accept[mid] == vidpid) {
+      return 1;
+    }
+    if (dfa->accept[mid] < vidpid) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return 0;
+}
+
+/*!
+** \brief match a serial number against a single pattern, without automaton
+**
+** On a mismatch, only the last '*' is backtracked, by one more byte: the
+** bytes it could swallow before are a prefix of those it can swallow now.
+**
+** \return 1 if the pattern matches the whole serial number
+*/
+int keypattern_match_one(const char *pattern,
+                         size_t plen,
+                         const char *serial,
+                         size_t len)
+{
+  size_t p = 0;
+  size_t s = 0;
+  size_t star = 0;		/* after the last '*', 0 before any */
+  size_t star_s = 0;
+
+  while (s < len) {
+    if (p < plen && pattern[p] == '*') {
+      star = ++p;
+      star_s = s;
+    } else if (p < plen && (pattern[p] == '?' || pattern[p] == serial[s])) {
+      p++;
+      s++;
+    } else if (star != 0) {
+      p = star;
+      s = ++star_s;
+    } else {
+      return 0;
+    }
+  }
+  while (p < plen && pattern[p] == '*') {
+    p++;
+  }
+  return p == plen;
+}
+
+struct keypattern_dfa *keypattern_get(struct keypattern_dfa *dfa)
+{
+  if (dfa != NULL) {
+    refcount_inc(&dfa->ref);
+  }
+  return dfa;
+}
+
+void keypattern_put(struct keypattern_dfa *dfa)
+{
+  if (dfa != NULL && refcount_dec_and_test(&dfa->ref)) {
+    kvfree(dfa);
+  }
+}
@@ -0,0 +1,69 @@
+/*
+** File keypattern.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keypattern.h
+**
+** Serial number glob patterns, compiled into a single automaton
+**
+** All the USBWALL_KEY_SERIAL_PATTERN rules of a policy are compiled together
+** into a deterministic automaton on the serial number bytes. Each accepting
+** state carries the idVendor:idProduct of the patterns it matches, so that a
+** serial number is checked against all the patterns in one pass.
+*/
+
+#ifndef KEYPATTERN_H_
+#define KEYPATTERN_H_
+
+#include <linux/types.h>
+#include "usbwall.h"
+
+/* upper bounds of a compiled pattern set */
+#define KEYPATTERN_MAX_POSITIONS	8192
+#define KEYPATTERN_MAX_STATES		4096
+
+struct keypattern_dfa;
+
+/* a serial pattern rule: the pattern is not NUL terminated */
+struct keypattern_rule {
+  u16 idVendor;
+  u16 idProduct;
+  const char *pattern;
+  u32 len;
+};
+
+struct keypattern_dfa	*keypattern_compile(const struct keypattern_rule *rules,
+                                            u32 count);
+
+int	keypattern_match(const struct keypattern_dfa *dfa,
+                         u16 idVendor,
+                         u16 idProduct,
+                         const char *serial,
+                         size_t len);
+
+int	keypattern_match_one(const char *pattern,
+                             size_t plen,
+                             const char *serial,
+                             size_t len);
+
+struct keypattern_dfa	*keypattern_get(struct keypattern_dfa *dfa);
+
+void	keypattern_put(struct keypattern_dfa *dfa);
+
+#endif /*! KEYPATTERN_H_*/
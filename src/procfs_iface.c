@@ -39,135 +39,371 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/sched.h>
 #include <linux/version.h>
 #include <linux/slab.h>
+#include <linux/math64.h>
 #include <asm/uaccess.h>
 #include "procfs_iface.h"
 #include "trace.h"
 #include "usbwall.h"
 #include "keylist.h"
 #include "keylist_info.h"
-
-#define USBWALL_PROC_STATUS_BUFFER_SIZE 256
-#define USBWALL_PROC_RELEASE_BUFFER_SIZE 16
+#include "keycache.h"
+#include "usbwall_stats.h"
 
 static struct proc_dir_entry* usbwalldir = NULL;
 static struct proc_dir_entry* usbwallstatus = NULL;
 static struct proc_dir_entry* usbwallrelease = NULL;
+static struct proc_dir_entry* usbwallfilter = NULL;
+static struct proc_dir_entry* usbwallcache = NULL;
+static struct proc_dir_entry* usbwallstats = NULL;
+static struct proc_dir_entry* usbwalllatency = NULL;
+
+/*
+** proc_create() takes a struct proc_ops since 5.6, a struct file_operations
+** before. write_fn is NULL for the read-only files.
+*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+# define USBWALL_PROC_OPS(name, open_fn, write_fn, release_fn)	\
+  static const struct proc_ops name = {				\
+    .proc_open = open_fn,					\
+    .proc_read = seq_read,					\
+    .proc_write = write_fn,					\
+    .proc_lseek = seq_lseek,					\
+    .proc_release = release_fn,					\
+  }
+#else
+# define USBWALL_PROC_OPS(name, open_fn, write_fn, release_fn)	\
+  static const struct file_operations name = {			\
+    .owner = THIS_MODULE,					\
+    .open = open_fn,						\
+    .read = seq_read,						\
+    .write = write_fn,						\
+    .llseek = seq_lseek,					\
+    .release = release_fn,					\
+  }
+#endif
+
+/*!
+ ** \brief usbwall_status_show
+ **
+ ** Print the module release, then one key of the current policy per
+ ** iteration step: a read only formats the keys it returns, in a single page
+ ** buffer, whatever the size of the policy.
+ **
+ ** \param m the seq_file of the opened status file
+ ** \param v SEQ_START_TOKEN, or the key returned by the iterator
+ **
+ ** \return 0
+ */
+static int usbwall_status_show(struct seq_file *m, void *v)
+{
+   if (v == SEQ_START_TOKEN) {
+     seq_printf(m, "USBWall module release %s\n", USBWALL_MODVERSION);
+     return 0;
+   }
+   return keylist_seq_show(m, v);
+}
+
+static const struct seq_operations usbwall_status_seq_ops = {
+   .start = keylist_seq_start,
+   .next = keylist_seq_next,
+   .stop = keylist_seq_stop,
+   .show = usbwall_status_show,
+};
 
-static char status_buffer[USBWALL_PROC_STATUS_BUFFER_SIZE];
-static char release_buffer[USBWALL_PROC_RELEASE_BUFFER_SIZE];
+static int usbwall_status_open(struct inode *inode, struct file *file)
+{
+   return seq_open(file, &usbwall_status_seq_ops);
+}
 
+USBWALL_PROC_OPS(usbwall_status_fops, usbwall_status_open, NULL, seq_release);
 
 /*!
- ** \brief usbwall_status_read
- ** 
- ** \param page the kernel mapped memory page in which the data should be copied
- ** \param start unused
- ** \param off the current string offset asked by the userspace (if read in multiple times)
- ** \param count the asked bytes count to read
- ** \param eof EOF signal pointer to be setted
- ** \param data unused
- ** 
- ** \return the number of effectively copied bytes
+ ** \brief usbwall_release_show
+ **
+ ** Return the module release identifier, in order to be checked by the libusbwall to guarantee the interoperability
+ **
+ ** \param m the seq_file of the opened release file
+ ** \param v unused
+ **
+ ** \return 0
  */
-int usbwall_status_read(char *page,
-                        char **start,
-                        off_t off,
-                        int count,
-                        int *eof,
-                        void *data)
-{
-   int is_eof = 0;
-
-   DBG_TRACE(DBG_LEVEL_DEBUG, "entering status read, asking for reading %d bytes. Current offset is %ld", count, off);
-   /*
-   ** test buffer by now
-   */
-   sprintf(status_buffer, "USBWall module release %s\n", USBWALL_MODVERSION);
-   print_keylist(status_buffer);
-   if (off >= strlen(status_buffer)) {
-     DBG_TRACE(DBG_LEVEL_WARNING, "offset greater than string size, leaving");
-     count = 0;
-     is_eof = 1;
-     goto end;
+static int usbwall_release_show(struct seq_file *m, void *v)
+{
+   seq_printf(m, "%d", USBWALL_MAJOR << 16 | USBWALL_MEDIUM << 8 | USBWALL_CURRENT);
+   return 0;
+}
+
+static int usbwall_release_open(struct inode *inode, struct file *file)
+{
+   return single_open(file, usbwall_release_show, NULL);
+}
+
+USBWALL_PROC_OPS(usbwall_release_fops, usbwall_release_open, NULL, single_release);
+
+/*!
+ ** \brief usbwall_filter_show
+ **
+ ** Return the key lookup Bloom filter size and its measured false positive
+ ** rate, i.e. the part of the lookups not answered by the filter which
+ ** missed the key index.
+ **
+ ** \param m the seq_file of the opened filter file
+ ** \param v unused
+ **
+ ** \return 0
+ */
+static int usbwall_filter_show(struct seq_file *m, void *v)
+{
+   struct keylist_filter_stats stats;
+   u64 fp_rate = 0;
+
+   keylist_filter_stats(&stats);
+   /* false positive rate, in 1/100000 */
+   if (stats.negatives + stats.false_positives != 0) {
+     fp_rate = div64_u64(stats.false_positives * 100000,
+                         stats.negatives + stats.false_positives);
    }
-   if (count > (strlen(status_buffer) - off)) {
-     count = (strlen(status_buffer) - off + 1);
-     is_eof = 1;
+   seq_printf(m,
+              "bits : %llu\nhashes : %u\nkeys : %u\nqueries : %llu\n"
+              "negatives : %llu\nfalse positives : %llu\n"
+              "false positive rate : %llu.%03llu%%\n",
+              stats.bits, stats.hashes, stats.keys, stats.queries,
+              stats.negatives, stats.false_positives,
+              fp_rate / 1000, fp_rate % 1000);
+   return 0;
+}
+
+static int usbwall_filter_open(struct inode *inode, struct file *file)
+{
+   return single_open(file, usbwall_filter_show, NULL);
+}
+
+USBWALL_PROC_OPS(usbwall_filter_fops, usbwall_filter_open, NULL, single_release);
+
+/*!
+ ** \brief usbwall_cache_show
+ **
+ ** Return the event mode verdict cache occupancy and its hit rate, i.e. the
+ ** part of the devices decided without asking the authority.
+ **
+ ** \param m the seq_file of the opened cache file
+ ** \param v unused
+ **
+ ** \return 0
+ */
+static int usbwall_cache_show(struct seq_file *m, void *v)
+{
+   struct keycache_stats stats;
+   u64 hit_rate = 0;
+
+   keycache_get_stats(&stats);
+   /* hit rate, in 1/100000 */
+   if (stats.hits + stats.misses != 0) {
+     hit_rate = div64_u64(stats.hits * 100000, stats.hits + stats.misses);
    }
-   snprintf(&(page[off]), count, &(status_buffer[off]));
+   seq_printf(m,
+              "entries : %u\nmax entries : %u\nhits : %llu\nmisses : %llu\n"
+              "inserts : %llu\nevictions : %llu\nexpired : %llu\n"
+              "hit rate : %llu.%03llu%%\n",
+              stats.entries, stats.max_entries, stats.hits, stats.misses,
+              stats.inserts, stats.evictions, stats.expired,
+              hit_rate / 1000, hit_rate % 1000);
+   return 0;
+}
 
-end:
-   if (is_eof) {
-     DBG_TRACE(DBG_LEVEL_DEBUG, "EOF=1");
-     /* update file offset */
-      *eof = 1;
-   } else {
-      *eof = 0;
+static int usbwall_cache_open(struct inode *inode, struct file *file)
+{
+   return single_open(file, usbwall_cache_show, NULL);
+}
+
+/*!
+ ** \brief usbwall_cache_write
+ **
+ ** Flush the verdict cache, whatever is written: the next devices are all
+ ** decided by the authority again, e.g. after a change of its policy.
+ **
+ ** \return count
+ */
+static ssize_t usbwall_cache_write(struct file *file, const char __user *buf,
+                                   size_t count, loff_t *ppos)
+{
+   keycache_flush();
+   return count;
+}
+
+USBWALL_PROC_OPS(usbwall_cache_fops, usbwall_cache_open, usbwall_cache_write, single_release);
+
+/*!
+ ** \brief usbwall_stats_show
+ **
+ ** Return the activity counters since the last reset, one "name : value"
+ ** per line, then the size of the current policy.
+ **
+ ** \param m the seq_file of the opened stats file
+ ** \param v unused
+ **
+ ** \return 0
+ */
+static int usbwall_stats_show(struct seq_file *m, void *v)
+{
+   struct usbwall_stats stats;
+   u32 keys;
+   size_t size;
+   int i;
+
+   usbwall_stats_read(&stats);
+   for (i = 0; i < USBWALL_STAT_MAX; i++) {
+     seq_printf(m, "%s : %llu\n", usbwall_stat_names[i], stats.count[i]);
    }
-   DBG_TRACE(DBG_LEVEL_DEBUG, "end of function. Returning %d", count);
+   keylist_usage(&keys, &size);
+   seq_printf(m, "keys : %u\nkey bytes : %zu\n", keys, size);
+   return 0;
+}
+
+static int usbwall_stats_open(struct inode *inode, struct file *file)
+{
+   return single_open(file, usbwall_stats_show, NULL);
+}
+
+/*!
+ ** \brief usbwall_stats_write
+ **
+ ** Reset the activity counters, whatever is written. The keys and key bytes
+ ** always describe the current policy.
+ **
+ ** \return count
+ */
+static ssize_t usbwall_stats_write(struct file *file, const char __user *buf,
+                                   size_t count, loff_t *ppos)
+{
+   usbwall_stats_reset();
    return count;
 }
 
+USBWALL_PROC_OPS(usbwall_stats_fops, usbwall_stats_open, usbwall_stats_write, single_release);
+
 /*!
- ** \brief usbwall_release_read
+ ** \brief usbwall_latency_bound
  **
- ** Return the module release identifier, in order to be checked by the libusbwall to guarantee the interoperability
- ** 
- ** \param page the kernel mapped memory page in which the data should be copied
- ** \param start unused
- ** \param off the current string offset asked by the userspace (if read in multiple times)
- ** \param count the asked bytes count to read
- ** \param eof EOF signal pointer to be setted
- ** \param data unused
- ** 
- ** \return the number of effectively copied bytes
+ ** Print the bound of a log2 latency bucket: the durations of bucket b are
+ ** below 2^b ns, but the ones of the last bucket are only known to be above
+ ** its lower bound.
  */
-int usbwall_release_read(char *page,
-                         char **start,
-                         off_t off,
-                         int count,
-                         int *eof,
-                         void *data)
-{
-   int is_eof = 0;
-
-   DBG_TRACE(DBG_LEVEL_DEBUG, "entering release read, asking for reading %d bytes. Current offset is %ld", count, off);
-   /*
-   ** return the release code
-   */
-   sprintf(release_buffer, "%d", USBWALL_MAJOR << 16 | USBWALL_MEDIUM << 8 | USBWALL_CURRENT);
-   if (off >= strlen(release_buffer)) {
-     DBG_TRACE(DBG_LEVEL_WARNING, "offset greater than string size, leaving");
-     count = 0;
-     is_eof = 1;
-     goto end;
+static void usbwall_latency_bound(struct seq_file *m, const char *name, int b)
+{
+   if (b == USBWALL_LAT_BUCKETS - 1) {
+     seq_printf(m, " %s >= %llu ns", name, 1ULL << (b - 1));
+   } else {
+     seq_printf(m, " %s < %llu ns", name, 1ULL << b);
    }
-   if (count > (strlen(release_buffer) - off)) {
-     count = (strlen(release_buffer) - off + 1);
-     is_eof = 1;
+}
+
+/*!
+ ** \brief usbwall_latency_percentile
+ **
+ ** \return the bucket holding the given part, in 1/1000, of count durations
+ */
+static int usbwall_latency_percentile(const u64 *bucket, u64 count, u32 permille)
+{
+   u64 rank = div64_u64(count * permille + 999, 1000);
+   u64 seen = 0;
+   int b;
+
+   for (b = 0; b < USBWALL_LAT_BUCKETS - 1; b++) {
+     seen += bucket[b];
+     if (seen >= rank) {
+       break;
+     }
    }
-   snprintf(&(page[off]), count, &(release_buffer[off]));
+   return b;
+}
 
-end:
-   if (is_eof) {
-     DBG_TRACE(DBG_LEVEL_DEBUG, "EOF=1");
-     /* update file offset */
-      *eof = 1;
-   } else {
-      *eof = 0;
+/*!
+ ** \brief usbwall_latency_show
+ **
+ ** Return, for each timed phase of the device decisions, the number of
+ ** samples since the last reset, their mean and the bounds of their median,
+ ** 99th and 99.9th percentiles and maximum, then the non empty log2 buckets
+ ** of the histogram, by lower bound.
+ **
+ ** \param m the seq_file of the opened latency file
+ ** \param v unused
+ **
+ ** \return 0, or -ENOMEM
+ */
+static int usbwall_latency_show(struct seq_file *m, void *v)
+{
+   struct usbwall_lat_hist *hist;
+   u64 count;
+   int last;
+   int i;
+   int b;
+
+   /* too large for the stack */
+   hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+   if (hist == NULL) {
+     return -ENOMEM;
+   }
+   usbwall_lat_read(hist);
+   for (i = 0; i < USBWALL_LAT_MAX; i++) {
+     count = 0;
+     last = 0;
+     for (b = 0; b < USBWALL_LAT_BUCKETS; b++) {
+       count += hist->bucket[i][b];
+       if (hist->bucket[i][b] != 0) {
+         last = b;
+       }
+     }
+     seq_printf(m, "%s : count %llu", usbwall_lat_names[i], count);
+     if (count == 0) {
+       seq_putc(m, '\n');
+       continue;
+     }
+     seq_printf(m, " mean %llu ns", div64_u64(hist->sum_ns[i], count));
+     usbwall_latency_bound(m, "p50", usbwall_latency_percentile(hist->bucket[i], count, 500));
+     usbwall_latency_bound(m, "p99", usbwall_latency_percentile(hist->bucket[i], count, 990));
+     usbwall_latency_bound(m, "p999", usbwall_latency_percentile(hist->bucket[i], count, 999));
+     usbwall_latency_bound(m, "max", last);
+     seq_putc(m, '\n');
+     for (b = 0; b < USBWALL_LAT_BUCKETS; b++) {
+       if (hist->bucket[i][b] != 0) {
+         seq_printf(m, "  >= %llu ns : %llu\n", b ? 1ULL << (b - 1) : 0, hist->bucket[i][b]);
+       }
+     }
    }
-   DBG_TRACE(DBG_LEVEL_DEBUG, "end of function. Returning %d", count);
+   kfree(hist);
+   return 0;
+}
+
+static int usbwall_latency_open(struct inode *inode, struct file *file)
+{
+   return single_open(file, usbwall_latency_show, NULL);
+}
+
+/*!
+ ** \brief usbwall_latency_write
+ **
+ ** Reset the latency histograms, whatever is written.
+ **
+ ** \return count
+ */
+static ssize_t usbwall_latency_write(struct file *file, const char __user *buf,
+                                     size_t count, loff_t *ppos)
+{
+   usbwall_lat_reset();
    return count;
 }
 
+USBWALL_PROC_OPS(usbwall_latency_fops, usbwall_latency_open, usbwall_latency_write, single_release);
 
 /*!
  ** \fn usbwall_proc_init initialize the usbwall procfs itnerface
  ** 
- ** \return 1 if init failed, or 0.
+ ** \return -ENOMEM if init failed, or 0.
  */
 int usbwall_proc_init()
 {
@@ -175,28 +411,47 @@ int usbwall_proc_init()
     if (usbwalldir == NULL) {
 	goto fail_proc_mkdir;
     }
-    usbwallstatus = create_proc_entry("status", 0400, usbwalldir);
+    usbwallstatus = proc_create("status", 0400, usbwalldir, &usbwall_status_fops);
     if (usbwallstatus == NULL) {
 	goto fail_proc_entry_2;
     }
-    usbwallrelease = create_proc_entry("release", 0400, usbwalldir);
+    usbwallrelease = proc_create("release", 0400, usbwalldir, &usbwall_release_fops);
     if (usbwallrelease == NULL) {
 	goto fail_proc_entry_3;
     }
-
-
-    usbwallstatus->read_proc = usbwall_status_read;
-    usbwallrelease->read_proc = usbwall_release_read;
+    usbwallfilter = proc_create("filter", 0400, usbwalldir, &usbwall_filter_fops);
+    if (usbwallfilter == NULL) {
+	goto fail_proc_entry_4;
+    }
+    usbwallcache = proc_create("cache", 0600, usbwalldir, &usbwall_cache_fops);
+    if (usbwallcache == NULL) {
+	goto fail_proc_entry_5;
+    }
+    usbwallstats = proc_create("stats", 0600, usbwalldir, &usbwall_stats_fops);
+    if (usbwallstats == NULL) {
+	goto fail_proc_entry_6;
+    }
+    usbwalllatency = proc_create("latency", 0600, usbwalldir, &usbwall_latency_fops);
+    if (usbwalllatency == NULL) {
+	goto fail_proc_entry_7;
+    }
     return 0;
 
 /* failure management - std linux usage */
-fail_proc_entry_3:
+fail_proc_entry_7:
+    remove_proc_entry("stats", usbwalldir);
+fail_proc_entry_6:
+    remove_proc_entry("cache", usbwalldir);
+fail_proc_entry_5:
+    remove_proc_entry("filter", usbwalldir);
+fail_proc_entry_4:
     remove_proc_entry("release", usbwalldir);
-fail_proc_entry_2:
+fail_proc_entry_3:
     remove_proc_entry("status", usbwalldir);
+fail_proc_entry_2:
     remove_proc_entry("usbwall", NULL);
 fail_proc_mkdir:
-    return 1;
+    return -ENOMEM;
 }
 
 /*!
@@ -204,6 +459,10 @@ fail_proc_mkdir:
  */
 void usbwall_proc_release()
 {
+    remove_proc_entry("latency", usbwalldir);
+    remove_proc_entry("stats", usbwalldir);
+    remove_proc_entry("cache", usbwalldir);
+    remove_proc_entry("filter", usbwalldir);
     remove_proc_entry("release", usbwalldir);
     remove_proc_entry("status", usbwalldir);
     remove_proc_entry("usbwall", NULL);
@@ -35,14 +35,82 @@
 
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
 #include "trace.h"
 
+#define CREATE_TRACE_POINTS
+#include "usbwall_trace.h"
+
 static short dbglevel = 0;
 
+static atomic_t dbgline = ATOMIC_INIT(0);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+
+struct static_key_false dbglevel_keys[DBG_LEVEL_MAX] = {
+  [0 ... DBG_LEVEL_MAX - 1] = STATIC_KEY_FALSE_INIT
+};
+
+/* serializes the dbglevel changes, and the switch of the keys */
+static DEFINE_MUTEX(dbglevel_mutex);
+static bool dbglevel_live = false;
+
+/*!
+** \brief switch the keys of the levels to dbglevel, under dbglevel_mutex
+*/
+static void dbglevel_sync(void)
+{
+  int level;
+
+  for (level = DBG_LEVEL_ERROR; level < DBG_LEVEL_MAX; level++) {
+    if (dbglevel >= level) {
+      static_branch_enable(&dbglevel_keys[level]);
+    } else {
+      static_branch_disable(&dbglevel_keys[level]);
+    }
+  }
+}
+
+static int dbglevel_set(const char *val, const struct kernel_param *kp)
+{
+  int err;
+
+  mutex_lock(&dbglevel_mutex);
+  err = param_set_short(val, kp);
+  if (err == 0 && dbglevel_live) {
+    dbglevel_sync();
+  }
+  mutex_unlock(&dbglevel_mutex);
+  return err;
+}
+
+static const struct kernel_param_ops dbglevel_ops = {
+  .set = dbglevel_set,
+  .get = param_get_short,
+};
+
+module_param_cb(dbglevel, &dbglevel_ops, &dbglevel, 0640);
+
+void dbglevel_init(void)
+{
+  mutex_lock(&dbglevel_mutex);
+  dbglevel_live = true;
+  dbglevel_sync();
+  mutex_unlock(&dbglevel_mutex);
+}
+
+#else
+
 module_param(dbglevel, short, 0640);
-MODULE_PARM_DESC(dbglevel, "Module debug level, from 0 (no debug) to 5 (full debug)");
 
-static unsigned int dbgline = 0;
+void dbglevel_init(void)
+{
+}
+
+#endif
+
+MODULE_PARM_DESC(dbglevel, "Module debug level, from 0 (no debug) to 5 (full debug)");
 
 short dbglevel_get(void)
 {
@@ -51,5 +119,5 @@ short dbglevel_get(void)
 
 unsigned int dbgline_get_and_inc(void)
 {
-  return dbgline++;
+  return (unsigned int)atomic_inc_return(&dbgline) - 1;
 }
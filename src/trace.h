@@ -38,13 +38,16 @@
 #ifndef TRACE_H_
 # define TRACE_H_
 
+#include <linux/version.h>
+
 enum dbg_level {
   DBG_LEVEL_NONE = 0,
   DBG_LEVEL_ERROR,
   DBG_LEVEL_WARNING,
   DBG_LEVEL_INFO,
   DBG_LEVEL_NOTICE,
-  DBG_LEVEL_DEBUG
+  DBG_LEVEL_DEBUG,
+  DBG_LEVEL_MAX
 };
 
 #define DBG_PREFIX "usbwall:"
@@ -53,6 +56,28 @@ short dbglevel_get(void);
 
 unsigned int dbgline_get_and_inc(void);
 
+/*
+** make the dbglevel changes effective on DBG_TRACE. Called first at module
+** init: the static keys can only be switched once the module is live.
+*/
+void dbglevel_init(void);
+
+/*
+** DBG_TRACE levels are switched by static keys: dbglevel_keys[level] is
+** enabled while dbglevel >= level, so that a disabled trace costs a patched
+** out jump instead of a call and a test. The levels start at
+** DBG_LEVEL_ERROR.
+*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+# include <linux/jump_label.h>
+
+extern struct static_key_false dbglevel_keys[DBG_LEVEL_MAX];
+
+# define dbglevel_enabled(dbg)	static_branch_unlikely(&dbglevel_keys[dbg])
+#else
+# define dbglevel_enabled(dbg)	(dbglevel_get() >= (dbg))
+#endif
+
 /* INFO: thanks to Jean-Marc LACROIX for this macro */
 /*
 ** following variable used to create a counter on each output,
@@ -65,13 +90,15 @@ unsigned int dbgline_get_and_inc(void);
 ** dbg_trace 00000058 : 0300 : dummy_get_stats : enter device net_0
 */
 #define DBG_TRACE(dbg, fmt, arg...)             \
-if (dbglevel_get() >= dbg) {                    \
-printk("%s %08u : %04d : %s : " fmt "\n",       \
-       DBG_PREFIX,                              \
-       dbgline_get_and_inc(),	                \
-       __LINE__,                                \
-       __func__,                                \
-## arg);                                        \
-}
+do {                                            \
+  if (dbglevel_enabled(dbg)) {                  \
+    printk("%s %08u : %04d : %s : " fmt "\n",   \
+           DBG_PREFIX,                          \
+           dbgline_get_and_inc(),               \
+           __LINE__,                            \
+           __func__,                            \
+           ## arg);                             \
+  }                                             \
+} while (0)
 
 #endif /* !TRACE_H_ */
@@ -35,20 +35,61 @@
 #define USBWALL_H_
 
 #define USBWALL_MAJOR 0
-#define USBWALL_MEDIUM 2
-#define USBWALL_CURRENT 1
+#define USBWALL_MEDIUM 3
+#define USBWALL_CURRENT 0
 
-#define USBWALL_MODVERSION "0.2.1"
+#define USBWALL_MODVERSION "0.3.0"
 
 /*
 ** define the ioctl magic number
 */
 # define USBWALL_IOC_MAGIC		'u'
 
-# define USBWALL_IO_ADDKEY		_IOW(USBWALL_IOC_MAGIC, 0, long) /* pointer */
-# define USBWALL_IO_DELKEY		_IOW(USBWALL_IOC_MAGIC, 1, long) /* pointer */
+# define USBWALL_IO_ADDKEY		_IOW(USBWALL_IOC_MAGIC, 0, struct usbwall_token_info)
+# define USBWALL_IO_DELKEY		_IOW(USBWALL_IOC_MAGIC, 1, struct usbwall_token_info)
 
-#define USBWALL_IO_MAX			2
+/*
+** numbers of the 0.2 releases, which did not encode the size of the key:
+** their argument points to a struct usbwall_token_info_v1.
+*/
+# define USBWALL_IO_ADDKEY_V1		_IOW(USBWALL_IOC_MAGIC, 0, long) /* pointer */
+# define USBWALL_IO_DELKEY_V1		_IOW(USBWALL_IOC_MAGIC, 1, long) /* pointer */
+
+/*
+** staged policy update: begin a transaction, stage usbwall_token_info keys
+** with USBWALL_KEY_ADD or USBWALL_KEY_DEL in keyflags, then commit them all
+** at once (the new policy generation is written in the uint64_t pointed by
+** the argument) or abort. Staging fails with ENOSPC past 1048576 keys,
+** whether in this transaction or in all the open ones.
+*/
+# define USBWALL_IO_TXN_BEGIN		_IO(USBWALL_IOC_MAGIC, 2)
+# define USBWALL_IO_TXN_STAGE		_IOW(USBWALL_IOC_MAGIC, 3, struct usbwall_token_info)
+# define USBWALL_IO_TXN_COMMIT		_IOR(USBWALL_IOC_MAGIC, 4, long) /* pointer */
+# define USBWALL_IO_TXN_ABORT		_IO(USBWALL_IOC_MAGIC, 5)
+
+/*
+** vectored USBWALL_IO_ADDKEY/USBWALL_IO_DELKEY: the argument points to a
+** struct usbwall_key_batch. Its count keys are applied as one transaction.
+** If status is not 0, it receives one int32_t per key: 0, -EEXIST when adding
+** a present key or -ENOENT when deleting an absent one, so that only the
+** failed keys need to be retried.
+*/
+# define USBWALL_IO_ADDKEYS		_IOW(USBWALL_IOC_MAGIC, 6, long) /* pointer */
+# define USBWALL_IO_DELKEYS		_IOW(USBWALL_IOC_MAGIC, 7, long) /* pointer */
+
+/*
+** paginated listing of the policy: the argument points to a struct
+** usbwall_key_page. Up to count keys following the cursor are written to
+** keys, in the policy order, and the cursor is moved past the last one. A
+** key present during the whole listing is returned exactly once, whatever
+** the keys added or deleted between two pages.
+*/
+# define USBWALL_IO_LISTKEYS		_IOWR(USBWALL_IOC_MAGIC, 8, long) /* pointer */
+
+#define USBWALL_IO_MAX			9
+
+/* upper bound of the keys of a single batch */
+#define USBWALL_BATCH_MAX		65536
 
 enum keyflags
 {
@@ -58,11 +99,31 @@ enum keyflags
   USBWALL_KEY_ACCESS_WRITE = 0x1 << 3,
   USBWALL_KEY_ACCESS_EXEC = 0x1 << 4,
   USBWALL_KEY_ACCESS_SETUID = 0x1 << 5,
-  USBWALL_KEY_ACCESS_SETGID = 0x1 << 6
+  USBWALL_KEY_ACCESS_SETGID = 0x1 << 6,
+  /*
+  ** wildcard rules. USBWALL_KEY_ANY_SERIAL matches any serial number of
+  ** idVendor:idProduct, USBWALL_KEY_ANY_PRODUCT any device of idVendor.
+  ** The ignored fields are cleared when the rule is staged.
+  */
+  USBWALL_KEY_ANY_SERIAL = 0x1 << 7,
+  USBWALL_KEY_ANY_PRODUCT = 0x1 << 8,
+  /*
+  ** idSerialNumber is a glob pattern for the serial numbers of
+  ** idVendor:idProduct: '*' matches any string, '?' any character.
+  */
+  USBWALL_KEY_SERIAL_PATTERN = 0x1 << 9
 };
 
+#define USBWALL_KEY_MATCH_MASK (USBWALL_KEY_ANY_SERIAL | USBWALL_KEY_ANY_PRODUCT | USBWALL_KEY_SERIAL_PATTERN)
+
 typedef enum keyflags keyflags_t;
 
+/*
+** a USB string descriptor holds up to 126 characters: room for a full
+** serial number and its terminating NUL.
+*/
+#define USBWALL_SERIAL_MAX 128
+
 /**
  * \struct mass_storage_info
  *
@@ -73,13 +134,202 @@ struct usbwall_token_info
   keyflags_t keyflags;
   uint16_t idVendor;
   uint16_t idProduct;
-  char idSerialNumber[32];
+  char idSerialNumber[USBWALL_SERIAL_MAX];
+};
+
+/* key layout of USBWALL_IO_ADDKEY_V1 and USBWALL_IO_DELKEY_V1 */
+#define USBWALL_SERIAL_MAX_V1 32
+
+struct usbwall_token_info_v1
+{
+  keyflags_t keyflags;
+  uint16_t idVendor;
+  uint16_t idProduct;
+  char idSerialNumber[USBWALL_SERIAL_MAX_V1];
+};
+
+struct usbwall_key_batch
+{
+  uint64_t keys;		/* struct usbwall_token_info * */
+  uint64_t status;		/* int32_t *, or 0 */
+  uint32_t count;
+  uint32_t reserved;		/* must be 0 */
+};
+
+/*
+** position of a listing, opaque to userspace: zeroed before the first page,
+** then given back as returned by the previous one.
+*/
+struct usbwall_key_cursor
+{
+  uint32_t opaque[36];
+};
+
+/*
+** USBWALL_IO_LISTKEYS argument. The returned keys only hold the rule flags
+** in keyflags (USBWALL_KEY_ANY_SERIAL, USBWALL_KEY_ANY_PRODUCT,
+** USBWALL_KEY_SERIAL_PATTERN), their serial number is NUL padded.
+*/
+#define USBWALL_LIST_END		0x1 /* no key after the cursor */
+
+struct usbwall_key_page
+{
+  uint64_t keys;		/* struct usbwall_token_info * */
+  uint32_t count;		/* in: room in keys, out: keys written */
+  uint32_t flags;		/* out: USBWALL_LIST_END */
+  uint64_t generation;		/* out: policy generation of this page */
+  struct usbwall_key_cursor cursor;
+};
+
+/*
+** binary policy image, loaded at module init from the firmware file named by
+** the policyimage module parameter (relative to /lib/firmware).
+**
+** All the fields are little endian. The header is followed by three
+** sections, at 4 bytes aligned offsets from the start of the image:
+** - vidpid: count uint32_t, idVendor << 16 | idProduct,
+** - serial: count uint32_t, serial number arena offset << 3 | rule tier,
+**   the tier being 1 for an exact serial, 2 for a serial pattern, 3 for a
+**   USBWALL_KEY_ANY_SERIAL rule and 4 for a USBWALL_KEY_ANY_PRODUCT rule,
+** - arena: arena_size bytes of serial numbers, each one a length byte
+**   followed by the characters, without NUL. Offset 0 is the empty serial of
+**   the wildcard rules, so the first byte is 0.
+** The keys are sorted on (vidpid, tier, serial number bytes, length), without
+** duplicates. Wildcard rules have an empty serial, and a 0 idProduct for
+** tier 4. crc32 is the CRC-32 (as computed by zlib) of the whole image, with
+** the crc32 field set to 0.
+*/
+#define USBWALL_IMAGE_MAGIC		0x57425355 /* "USBW" */
+#define USBWALL_IMAGE_VERSION		1
+
+struct usbwall_image_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t arena_size;
+  uint32_t vidpid_off;
+  uint32_t serial_off;
+  uint32_t arena_off;
+  uint32_t crc32;
+};
+
+/*
+** read-only mmap() of /dev/usbwall: a struct usbwall_map_header, followed at
+** image_off by the policy image (see above) of the keys of generation.
+**
+** The first mmap() of an open file takes a snapshot of the current policy,
+** the next ones on the same file map that same snapshot, so the header can be
+** mapped first to learn the total size. The mapped keys never change: the
+** kernel only updates live_generation, on each commit, and a new snapshot is
+** taken by opening the device again once it differs from generation. All the
+** fields are little endian.
+*/
+#define USBWALL_MAP_MAGIC		0x50414d55 /* "UMAP" */
+
+struct usbwall_map_header
+{
+  uint32_t magic;
+  uint32_t image_off;
+  uint32_t image_size;
+  uint32_t reserved;
+  uint64_t generation;
+  uint64_t live_generation;
+};
+
+/*
+** event authorization mode (authmode=0): generic netlink family
+** USBWALL_GENL_NAME. The authority first sends a USBWALL_CMD_AUTH_REGISTER
+** from its socket (needs CAP_NET_ADMIN, fails with EBUSY while another socket
+** is registered, which it stays until closed). For each probed device, the
+** module then unicasts to that socket a USBWALL_CMD_AUTH_REQUEST holding a
+** request id and the device identity, and the authority answers from the same
+** socket with a USBWALL_CMD_AUTH_VERDICT holding the request id and the
+** verdict. Requests without authority or answer before the authtimeout module
+** parameter get the defaultverdict.
+**
+** A verdict with a non zero USBWALL_ATTR_TTL is cached for that many seconds
+** (one day at most): the same idVendor, idProduct and idSerialNumber then
+** gets it again without request. Writing to /proc/usbwall/cache flushes the
+** cache.
+*/
+#define USBWALL_GENL_NAME		"usbwall"
+#define USBWALL_GENL_VERSION		2
+
+enum usbwall_genl_cmd
+{
+  USBWALL_CMD_UNSPEC = 0,
+  USBWALL_CMD_AUTH_REQUEST,	/* module to authority */
+  USBWALL_CMD_AUTH_VERDICT,	/* authority to module */
+  USBWALL_CMD_AUTH_REGISTER,	/* authority to module, no attribute */
+  __USBWALL_CMD_MAX
+};
+
+#define USBWALL_CMD_MAX			(__USBWALL_CMD_MAX - 1)
+
+enum usbwall_genl_attr
+{
+  USBWALL_ATTR_UNSPEC = 0,
+  USBWALL_ATTR_REQUEST_ID,	/* u32 */
+  USBWALL_ATTR_VENDOR,		/* u16 */
+  USBWALL_ATTR_PRODUCT,		/* u16 */
+  USBWALL_ATTR_SERIAL,		/* NUL terminated string */
+  USBWALL_ATTR_DEVICE,		/* NUL terminated string: USB interface name */
+  USBWALL_ATTR_VERDICT,		/* u8: USBWALL_VERDICT_* */
+  USBWALL_ATTR_TTL,		/* u32: seconds the verdict is cached, optional */
+  __USBWALL_ATTR_MAX
+};
+
+#define USBWALL_ATTR_MAX		(__USBWALL_ATTR_MAX - 1)
+
+#define USBWALL_VERDICT_BLOCK		0
+#define USBWALL_VERDICT_ALLOW		1
+
+/*
+** audit trail: read() of /dev/usbwall returns whole struct
+** usbwall_audit_record, one per decision on a device, oldest first for each
+** cpu (cpu field). A read blocks until a record is available, unless the
+** file is O_NONBLOCK, and poll() reports POLLIN once one is. Each record is
+** returned to a single reader. When the ring of a cpu is full, the next
+** records of that cpu are dropped: dropped counts them in its next record,
+** and /proc/usbwall/stats in total.
+**
+** A USBWALL_SOURCE_LIST record identifies the matching rule as the key of
+** the policy image of generation (see below) with the same tier, idVendor
+** and idProduct (rule_idProduct being 0 for tier 4), and serial number or
+** pattern at arena offset rule_serial_off (0 for the wildcard rules). These
+** fields are 0 for the other sources.
+*/
+#define USBWALL_SOURCE_LIST		0 /* a rule of the white list, see tier */
+#define USBWALL_SOURCE_CACHE		1 /* a cached verdict of the authority */
+#define USBWALL_SOURCE_AUTHORITY	2 /* the userspace authority */
+#define USBWALL_SOURCE_DEFAULT		3 /* defaultverdict */
+
+#define USBWALL_AUDIT_PORT_MAX		32
+
+struct usbwall_audit_record
+{
+  uint64_t timestamp;		/* CLOCK_REALTIME, in ns */
+  uint32_t dropped;		/* records of this cpu dropped just before */
+  uint16_t idVendor;
+  uint16_t idProduct;
+  uint8_t verdict;		/* USBWALL_VERDICT_* */
+  uint8_t source;		/* USBWALL_SOURCE_* */
+  uint8_t tier;			/* of the matching rule, as in the image, or 0 */
+  uint8_t reserved;
+  uint32_t cpu;
+  uint64_t generation;		/* of the policy holding the matching rule */
+  uint16_t rule_idVendor;
+  uint16_t rule_idProduct;
+  uint32_t rule_serial_off;
+  char port[USBWALL_AUDIT_PORT_MAX];	/* USB interface, e.g. "1-1.2:1.0" */
+  char idSerialNumber[USBWALL_SERIAL_MAX];
 };
 
 union procfs_info
 {
   struct usbwall_token_info info;
-  char   buffer[64];
+  char   buffer[sizeof(struct usbwall_token_info)];
 };
 
 typedef union procfs_info procfs_info_t;
@@ -0,0 +1,272 @@
+/*
+** File usbwall_audit.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_audit.c
+**
+** Audit trail of the device decisions
+**
+** Each cpu has a fixed ring of records, filled by the decisions running on
+** it, preemption disabled, and emptied by the readers of /dev/usbwall. The
+** cpu is the only producer of its ring and usbwall_audit_mutex serializes the
+** consumers, so head and tail are each written by one side only: the
+** producer publishes a record with a release store of head, and a consumer
+** gives its slot back with a release store of tail once it is copied. A full
+** ring never blocks nor overwrites: the record is dropped, and counted both
+** in the next record of the cpu and in the audit drops statistic.
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/overflow.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include "usbwall_audit.h"
+#include "keylist.h"
+#include "usbwall_stats.h"
+#include "trace.h"
+
+struct usbwall_audit_ring {
+  unsigned int head;		/* next record written, by the cpu */
+  u32 dropped;			/* records dropped since the last one written */
+  struct usbwall_audit_record *records;
+  /* next record read, by a consumer: away from the producer cache line */
+  unsigned int tail ____cacheline_aligned_in_smp;
+};
+
+/* poll() mask of an available record */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define USBWALL_AUDIT_READABLE	(EPOLLIN | EPOLLRDNORM)
+#else
+#define USBWALL_AUDIT_READABLE	(POLLIN | POLLRDNORM)
+#endif
+
+static struct usbwall_audit_ring __percpu *usbwall_audit_rings;
+static unsigned int usbwall_audit_size;
+static DEFINE_MUTEX(usbwall_audit_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(usbwall_audit_wait);
+
+int	usbwall_audit_init(unsigned int size)
+{
+  struct usbwall_audit_ring *ring;
+  int cpu;
+
+  if (size == 0) {
+    size = USBWALL_AUDIT_SIZE;
+  }
+  /* bounded: a ring is allocated for every possible cpu */
+  if (size > USBWALL_AUDIT_SIZE_MAX) {
+    DBG_TRACE(DBG_LEVEL_WARNING, "audit rings limited to %u records", USBWALL_AUDIT_SIZE_MAX);
+    size = USBWALL_AUDIT_SIZE_MAX;
+  }
+  usbwall_audit_size = roundup_pow_of_two(size);
+  usbwall_audit_rings = alloc_percpu(struct usbwall_audit_ring);
+  if (usbwall_audit_rings == NULL) {
+    return -ENOMEM;
+  }
+  for_each_possible_cpu(cpu) {
+    ring = per_cpu_ptr(usbwall_audit_rings, cpu);
+    ring->records = vzalloc_node(array_size(usbwall_audit_size, sizeof(*ring->records)),
+                                 cpu_to_node(cpu));
+    if (ring->records == NULL) {
+      usbwall_audit_exit();
+      return -ENOMEM;
+    }
+  }
+  DBG_TRACE(DBG_LEVEL_DEBUG, "audit rings of %u records", usbwall_audit_size);
+  return 0;
+}
+
+void	usbwall_audit_exit(void)
+{
+  int cpu;
+
+  if (usbwall_audit_rings == NULL) {
+    return;
+  }
+  for_each_possible_cpu(cpu) {
+    vfree(per_cpu_ptr(usbwall_audit_rings, cpu)->records);
+  }
+  free_percpu(usbwall_audit_rings);
+  usbwall_audit_rings = NULL;
+}
+
+void	usbwall_audit_log(const char *port,
+                          const struct usbwall_token_info *info,
+                          int verdict,
+                          int source,
+                          int tier,
+                          const struct keylist_rule *rule)
+{
+  struct usbwall_audit_ring *ring;
+  struct usbwall_audit_record *record;
+  unsigned int head;
+  int cpu;
+
+  cpu = get_cpu();
+  ring = per_cpu_ptr(usbwall_audit_rings, cpu);
+  head = ring->head;
+  /* pairs with the release of tail: the consumer is done with the slot */
+  if (head - smp_load_acquire(&ring->tail) >= usbwall_audit_size) {
+    ring->dropped++;
+    put_cpu();
+    usbwall_stat_inc(USBWALL_STAT_AUDIT_DROPS);
+    return;
+  }
+  record = &ring->records[head & (usbwall_audit_size - 1)];
+  record->timestamp = ktime_to_ns(ktime_get_real());
+  record->dropped = ring->dropped;
+  record->idVendor = info->idVendor;
+  record->idProduct = info->idProduct;
+  record->verdict = verdict ? USBWALL_VERDICT_ALLOW : USBWALL_VERDICT_BLOCK;
+  record->source = source;
+  record->tier = tier;
+  record->reserved = 0;
+  record->cpu = cpu;
+  if (rule != NULL) {
+    record->generation = rule->generation;
+    record->rule_idVendor = rule->vidpid >> 16;
+    record->rule_idProduct = rule->vidpid & 0xffff;
+    record->rule_serial_off = rule->serial_off;
+  } else {
+    record->generation = 0;
+    record->rule_idVendor = 0;
+    record->rule_idProduct = 0;
+    record->rule_serial_off = 0;
+  }
+  strncpy(record->port, port, sizeof(record->port));
+  record->port[sizeof(record->port) - 1] = '\0';
+  strncpy(record->idSerialNumber, info->idSerialNumber, sizeof(record->idSerialNumber));
+  record->idSerialNumber[sizeof(record->idSerialNumber) - 1] = '\0';
+  ring->dropped = 0;
+  smp_store_release(&ring->head, head + 1);
+  put_cpu();
+  /* the wait queue lock is only taken for a sleeping reader */
+  if (wq_has_sleeper(&usbwall_audit_wait)) {
+    wake_up_interruptible(&usbwall_audit_wait);
+  }
+}
+
+/*!
+** \brief whether a ring holds a record
+*/
+static int usbwall_audit_pending(void)
+{
+  struct usbwall_audit_ring *ring;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    ring = per_cpu_ptr(usbwall_audit_rings, cpu);
+    if (READ_ONCE(ring->head) != READ_ONCE(ring->tail)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*!
+** \brief copy up to max records of the rings to buf, under usbwall_audit_mutex
+** \return the number of records copied, or -EFAULT if none could be
+*/
+static ssize_t usbwall_audit_drain(char __user *buf, size_t max)
+{
+  struct usbwall_audit_ring *ring;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int slot;
+  size_t copied = 0;
+  size_t n;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    if (copied == max) {
+      break;
+    }
+    ring = per_cpu_ptr(usbwall_audit_rings, cpu);
+    tail = ring->tail;
+    /* pairs with the release of head: the records up to head are written */
+    head = smp_load_acquire(&ring->head);
+    while (tail != head && copied < max) {
+      slot = tail & (usbwall_audit_size - 1);
+      /* up to the end of the ring, the wrapped records in a next pass */
+      n = min_t(size_t, head - tail, usbwall_audit_size - slot);
+      n = min_t(size_t, n, max - copied);
+      if (copy_to_user(buf + copied * sizeof(struct usbwall_audit_record),
+                       &ring->records[slot], n * sizeof(struct usbwall_audit_record))) {
+        smp_store_release(&ring->tail, tail);
+        return copied ? copied : -EFAULT;
+      }
+      tail += n;
+      copied += n;
+    }
+    smp_store_release(&ring->tail, tail);
+  }
+  return copied;
+}
+
+ssize_t	usbwall_audit_read(char __user *buf, size_t count, int nonblock)
+{
+  size_t max = count / sizeof(struct usbwall_audit_record);
+  ssize_t ret;
+
+  if (max == 0) {
+    return -EINVAL;
+  }
+  if (mutex_lock_interruptible(&usbwall_audit_mutex)) {
+    return -ERESTARTSYS;
+  }
+  while ((ret = usbwall_audit_drain(buf, max)) == 0) {
+    mutex_unlock(&usbwall_audit_mutex);
+    if (nonblock) {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(usbwall_audit_wait, usbwall_audit_pending())) {
+      return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&usbwall_audit_mutex)) {
+      return -ERESTARTSYS;
+    }
+  }
+  mutex_unlock(&usbwall_audit_mutex);
+  if (ret < 0) {
+    return ret;
+  }
+  return ret * sizeof(struct usbwall_audit_record);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+__poll_t
+#else
+unsigned int
+#endif
+usbwall_audit_poll(struct file *filp, poll_table *wait)
+{
+  poll_wait(filp, &usbwall_audit_wait, wait);
+  if (usbwall_audit_pending()) {
+    return USBWALL_AUDIT_READABLE;
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+/*
+** File usbwall_audit.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_audit.h
+**
+** Audit trail of the device decisions, read from /dev/usbwall as struct
+** usbwall_audit_record (see usbwall.h)
+*/
+
+#ifndef USBWALL_AUDIT_H_
+# define USBWALL_AUDIT_H_
+
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include "usbwall.h"
+
+struct keylist_rule;
+
+/* default number of records of the ring of each cpu */
+#define USBWALL_AUDIT_SIZE	256
+/* upper bound of the records of each ring: 12.5 MB of records per cpu */
+#define USBWALL_AUDIT_SIZE_MAX	(1U << 16)
+
+/*
+** allocate the ring of each cpu, of size records rounded up to a power of 2,
+** at most USBWALL_AUDIT_SIZE_MAX
+*/
+int	usbwall_audit_init(unsigned int size);
+
+void	usbwall_audit_exit(void);
+
+/*
+** record a decision on the interface port, from process context. rule is the
+** matching rule of tier, NULL if none. Never blocks: the record is counted as
+** dropped if the ring of the cpu is full.
+*/
+void	usbwall_audit_log(const char *port,
+                          const struct usbwall_token_info *info,
+                          int verdict,
+                          int source,
+                          int tier,
+                          const struct keylist_rule *rule);
+
+/*
+** move as many whole records as fit in count bytes to buf, waiting for one
+** unless nonblock. Returns the bytes copied, or a negative error.
+*/
+ssize_t	usbwall_audit_read(char __user *buf, size_t count, int nonblock);
+
+/*
+** EPOLLIN | EPOLLRDNORM (POLLIN | POLLRDNORM before 4.16) if a record is
+** available
+*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+__poll_t	usbwall_audit_poll(struct file *filp, poll_table *wait);
+#else
+unsigned int	usbwall_audit_poll(struct file *filp, poll_table *wait);
+#endif
+
+#endif /* !USBWALL_AUDIT_H_ */
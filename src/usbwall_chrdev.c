@@ -13,11 +13,16 @@
 #include <linux/init.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/poll.h>
 #include <linux/cdev.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
 #include <linux/version.h>
 #include <linux/device.h>
 
@@ -29,6 +34,9 @@
 #include "trace.h"
 #include "usbwall.h"
 #include "keylist.h"
+#include "usbwall_stats.h"
+#include "usbwall_audit.h"
+#include "usbwall_trace.h"
 
 static struct cdev	*cdev;
 
@@ -58,10 +66,27 @@ static struct device		*usbwall_class_device;
 
 static unsigned int usbwall_major = 0;
 
-static int open_count = 0;
-
+/*
+** per file state: any number of files can be open at once. The lookups,
+** USBWALL_IO_LISTKEYS and mmap() only read RCU snapshots and never wait for
+** a commit, of this file or another one.
+*/
 struct context {
-  uint32_t	ioctlstats;
+  atomic_t		ioctlstats[USBWALL_IO_MAX];	/* calls per ioctl number */
+  /*
+  ** mmap(): policy snapshot taken by the first mapping. Set once with
+  ** cmpxchg(), not under lock: mmap() runs under mmap_lock, which a fault
+  ** of write() takes while holding lock.
+  */
+  struct keylist_export	*export;
+  struct mutex		lock;		/* protects the fields below */
+  int			txn_open;
+  struct keylist_txn	txn;
+  /* write(): record split between two writes */
+  struct usbwall_token_info partial;
+  size_t		partial_len;
+  /* write(): error met after some bytes, returned by the next write or close */
+  int			write_err;
 };
 
 static int32_t
@@ -69,99 +94,621 @@ usbwall_chrdev_open(struct inode		*inode __attribute__((unused)),
                     struct file		*filp)
 {
   struct context *ctx = NULL;
+  int i;
 
   DBG_TRACE(DBG_LEVEL_DEBUG, "Entering open");
-  /* simple (need to be updated) support for single access */
-  if (open_count != 0) {
-    DBG_TRACE(DBG_LEVEL_ERROR, "Device busy, check lsof");
-    return -EBUSY;
-  }
   ctx = kmalloc(sizeof(struct context), GFP_KERNEL);
   if (NULL == ctx) {
     DBG_TRACE(DBG_LEVEL_ERROR, "unable to allocate local context");
     return -ENOMEM;
   }
+  for (i = 0; i < USBWALL_IO_MAX; i++) {
+    atomic_set(&ctx->ioctlstats[i], 0);
+  }
+  mutex_init(&ctx->lock);
+  ctx->txn_open = 0;
+  ctx->partial_len = 0;
+  ctx->write_err = 0;
+  ctx->export = NULL;
   filp->private_data = (void*)ctx;
-  open_count += 1;
   DBG_TRACE(DBG_LEVEL_DEBUG, "Leaving open");
   return 0;
 }
 
+/*
+** @brief apply a struct usbwall_key_batch from userspace as one transaction.
+** The keys are copied in at once, and the status of each key is written back
+** at once.
+** @return 0 if the batch was committed, negative error otherwise.
+*/
+static int
+usbwall_chrdev_batch(unsigned long	arg,
+                     keyflags_t	op)
+{
+  struct usbwall_key_batch batch;
+  struct usbwall_token_info *keys = NULL;
+  int32_t *status = NULL;
+  int err;
+
+  if (copy_from_user(&batch, (struct usbwall_key_batch*)arg, sizeof(batch))) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "bad argument: unable to get back content from userspace");
+    return -EFAULT;
+  }
+  if (batch.reserved != 0 || batch.count > USBWALL_BATCH_MAX) {
+    return -EINVAL;
+  }
+  if (batch.count == 0) {
+    return 0;
+  }
+  keys = kvmalloc_array(batch.count, sizeof(*keys), GFP_KERNEL);
+  status = kvmalloc_array(batch.count, sizeof(*status), GFP_KERNEL);
+  if (keys == NULL || status == NULL) {
+    err = -ENOMEM;
+    goto out;
+  }
+  if (copy_from_user(keys, (void __user *)(unsigned long)batch.keys,
+                     batch.count * sizeof(*keys))) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "bad argument: unable to get back %u keys from userspace",
+              batch.count);
+    err = -EFAULT;
+    goto out;
+  }
+  DBG_TRACE(DBG_LEVEL_NOTICE, "%s %u keys", op == USBWALL_KEY_ADD ? "adding" : "deleting",
+            batch.count);
+  err = keylist_apply_batch(keys, batch.count, op, status, NULL);
+  if (err != 0) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "unable to apply %u keys: error %d", batch.count, err);
+    goto out;
+  }
+  if (batch.status != 0 &&
+      copy_to_user((void __user *)(unsigned long)batch.status, status,
+                   batch.count * sizeof(*status))) {
+    err = -EFAULT;
+  }
+out:
+  kvfree(status);
+  kvfree(keys);
+  return err;
+}
+
+/*
+** @brief USBWALL_IO_LISTKEYS: copy a page of keys following the cursor
+*/
+static int
+usbwall_chrdev_list(unsigned long	arg)
+{
+  struct usbwall_key_page page;
+  struct usbwall_token_info *keys;
+  int end;
+  int ret;
+
+  if (copy_from_user(&page, (struct usbwall_key_page*)arg, sizeof(page))) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "bad argument: unable to get back content from userspace");
+    return -EFAULT;
+  }
+  page.count = min_t(uint32_t, page.count, USBWALL_BATCH_MAX);
+  keys = kvmalloc_array(max_t(uint32_t, page.count, 1), sizeof(*keys), GFP_KERNEL);
+  if (keys == NULL) {
+    return -ENOMEM;
+  }
+  ret = keylist_list_keys(&page.cursor, keys, page.count, &end, &page.generation);
+  if (ret < 0) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "invalid listing cursor");
+    goto out;
+  }
+  page.count = ret;
+  page.flags = end ? USBWALL_LIST_END : 0;
+  ret = 0;
+  if (copy_to_user((void __user *)(unsigned long)page.keys, keys, page.count * sizeof(*keys)) ||
+      copy_to_user((struct usbwall_key_page*)arg, &page, sizeof(page))) {
+    ret = -EFAULT;
+  }
+out:
+  kvfree(keys);
+  return ret;
+}
+
+/*
+** @brief copy the key argument of USBWALL_IO_ADDKEY or USBWALL_IO_DELKEY, in
+** the layout given by the size encoded in cmd: the legacy numbers get a
+** struct usbwall_token_info_v1.
+*/
+static int
+usbwall_chrdev_get_key(unsigned int			cmd,
+                       unsigned long			arg,
+                       struct usbwall_token_info	*keyinfo)
+{
+  struct usbwall_token_info_v1 legacy;
+
+  if (_IOC_SIZE(cmd) == sizeof(*keyinfo)) {
+    DBG_TRACE(DBG_LEVEL_DEBUG, "reading %zu len from userspace", sizeof(*keyinfo));
+    return copy_from_user(keyinfo, (struct usbwall_token_info*)arg, sizeof(*keyinfo)) ? -EFAULT : 0;
+  }
+  DBG_TRACE(DBG_LEVEL_DEBUG, "reading %zu len from userspace, legacy layout", sizeof(legacy));
+  if (copy_from_user(&legacy, (struct usbwall_token_info_v1*)arg, sizeof(legacy))) {
+    return -EFAULT;
+  }
+  /* the longer serial number field stays NUL terminated */
+  memset(keyinfo, 0, sizeof(*keyinfo));
+  keyinfo->keyflags = legacy.keyflags;
+  keyinfo->idVendor = legacy.idVendor;
+  keyinfo->idProduct = legacy.idProduct;
+  memcpy(keyinfo->idSerialNumber, legacy.idSerialNumber, sizeof(legacy.idSerialNumber));
+  return 0;
+}
+
 static long
 usbwall_chrdev_ioctl(
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,34)) /* check the last old mode ioctl structure */
                   struct inode	*inode __attribute__((unused)),
 #endif
-                  struct file	*filep __attribute__((unused)),
+                  struct file	*filep,
                   unsigned int	cmd,
                   unsigned long	arg)
 {
+  struct context *ctx = filep->private_data;
   struct internal_token_info *internal_keyinfo = NULL;
+  struct usbwall_token_info keyinfo;
+  uint64_t generation;
+  int err;
   DBG_TRACE(DBG_LEVEL_DEBUG, "Entering ioctl");
 
+  if (_IOC_TYPE(cmd) == USBWALL_IOC_MAGIC && _IOC_NR(cmd) < USBWALL_IO_MAX) {
+    atomic_inc(&ctx->ioctlstats[_IOC_NR(cmd)]);
+  }
+
   switch (cmd) {
       case USBWALL_IO_ADDKEY:
-          internal_keyinfo = kmalloc(sizeof(internal_keyinfo),GFP_KERNEL);
-          if (internal_keyinfo == NULL) {
-              DBG_TRACE(DBG_LEVEL_ERROR, "net enough memory to add key");
-              goto err_nomem;
-          }
-          DBG_TRACE(DBG_LEVEL_DEBUG, "reading %ld len from userspace", sizeof(internal_keyinfo));
-          if(copy_from_user(&(internal_keyinfo->info), (struct usbwall_key_info*)arg, sizeof(struct usbwall_token_info))) {
+      case USBWALL_IO_ADDKEY_V1:
+          if (usbwall_chrdev_get_key(cmd, arg, &keyinfo) != 0) {
               /* MOD_DEC_USE_COUNT; */
               DBG_TRACE(DBG_LEVEL_ERROR, "bad argument: unable to get back content from userspace");
               goto err_badarg;
           }
-          DBG_TRACE(DBG_LEVEL_NOTICE, "reading: vendor: %x, product: %x, serial: %s",
-                    internal_keyinfo->info.idVendor,
-                    internal_keyinfo->info.idProduct,
-                    internal_keyinfo->info.idSerialNumber);
-          key_add(internal_keyinfo);
+          DBG_TRACE(DBG_LEVEL_NOTICE, "reading: vendor: %x, product: %x, serial: %.*s",
+                    keyinfo.idVendor,
+                    keyinfo.idProduct,
+                    USBWALL_SERIAL_MAX, keyinfo.idSerialNumber);
+          err = key_add(&keyinfo);
+          if (err != 0) {
+              DBG_TRACE(DBG_LEVEL_ERROR, "unable to add key: error %d", err);
+              goto err_txn;
+          }
           break;
 
       case USBWALL_IO_DELKEY:
-          internal_keyinfo = kmalloc(sizeof(internal_keyinfo),GFP_KERNEL);
-          if (internal_keyinfo == NULL) {
-              DBG_TRACE(DBG_LEVEL_ERROR, "net enough memory to add key");
-              goto err_nomem;
-          }
-          DBG_TRACE(DBG_LEVEL_DEBUG, "reading %ld len from userspace", sizeof(internal_keyinfo));
-          if(copy_from_user(&(internal_keyinfo->info), (struct usbwall_key_info*)arg, sizeof(struct usbwall_token_info))) {
+      case USBWALL_IO_DELKEY_V1:
+          if (usbwall_chrdev_get_key(cmd, arg, &keyinfo) != 0) {
               /* MOD_DEC_USE_COUNT; */
               DBG_TRACE(DBG_LEVEL_ERROR, "bad argument: unable to get back content from userspace");
               goto err_badarg;
           }
-          DBG_TRACE(DBG_LEVEL_NOTICE, "reading: vendor: %x, product: %x, serial: %s",
-                    internal_keyinfo->info.idVendor,
-                    internal_keyinfo->info.idProduct,
-                    internal_keyinfo->info.idSerialNumber);
-          key_del(internal_keyinfo);
-          kfree(internal_keyinfo);
+          DBG_TRACE(DBG_LEVEL_NOTICE, "reading: vendor: %x, product: %x, serial: %.*s",
+                    keyinfo.idVendor,
+                    keyinfo.idProduct,
+                    USBWALL_SERIAL_MAX, keyinfo.idSerialNumber);
+          err = key_del(&keyinfo);
+          if (err != 0) {
+              DBG_TRACE(DBG_LEVEL_ERROR, "unable to delete key: error %d", err);
+              goto err_txn;
+          }
+          break;
+
+      case USBWALL_IO_ADDKEYS:
+      case USBWALL_IO_DELKEYS:
+          err = usbwall_chrdev_batch(arg, cmd == USBWALL_IO_ADDKEYS ? USBWALL_KEY_ADD : USBWALL_KEY_DEL);
+          if (err != 0) {
+              goto err_txn;
+          }
+          break;
+
+      case USBWALL_IO_LISTKEYS:
+          err = usbwall_chrdev_list(arg);
+          if (err != 0) {
+              goto err_txn;
+          }
+          break;
+
+      case USBWALL_IO_TXN_BEGIN:
+          mutex_lock(&ctx->lock);
+          if (ctx->txn_open) {
+              mutex_unlock(&ctx->lock);
+              DBG_TRACE(DBG_LEVEL_ERROR, "a transaction is already open");
+              err = -EBUSY;
+              goto err_txn;
+          }
+          keylist_txn_begin(&ctx->txn);
+          ctx->txn_open = 1;
+          mutex_unlock(&ctx->lock);
+          break;
+
+      case USBWALL_IO_TXN_STAGE:
+          internal_keyinfo = keyinfo_alloc();
+          if (copy_from_user(&(internal_keyinfo->info), (struct usbwall_token_info*)arg, sizeof(struct usbwall_token_info))) {
+              DBG_TRACE(DBG_LEVEL_ERROR, "bad argument: unable to get back content from userspace");
+              goto err_badarg;
+          }
+          mutex_lock(&ctx->lock);
+          err = ctx->txn_open ? keylist_txn_stage(&ctx->txn, internal_keyinfo) : -ENOENT;
+          mutex_unlock(&ctx->lock);
+          if (err != 0) {
+              DBG_TRACE(DBG_LEVEL_ERROR, "unable to stage key: error %d", err);
+              keyinfo_free(internal_keyinfo);
+              goto err_txn;
+          }
+          break;
+
+      case USBWALL_IO_TXN_COMMIT:
+          mutex_lock(&ctx->lock);
+          err = ctx->txn_open ? keylist_txn_commit(&ctx->txn, &generation) : -ENOENT;
+          if (err == 0) {
+              keylist_txn_release(&ctx->txn);
+              ctx->txn_open = 0;
+          }
+          mutex_unlock(&ctx->lock);
+          if (err != 0) {
+              DBG_TRACE(DBG_LEVEL_ERROR, "unable to commit: error %d", err);
+              goto err_txn;
+          }
+          if (arg != 0 && copy_to_user((uint64_t*)arg, &generation, sizeof(generation))) {
+              goto err_badarg;
+          }
+          break;
+
+      case USBWALL_IO_TXN_ABORT:
+          mutex_lock(&ctx->lock);
+          if (ctx->txn_open) {
+              keylist_txn_release(&ctx->txn);
+              ctx->txn_open = 0;
+          }
+          mutex_unlock(&ctx->lock);
           break;
 
       default:
           goto err_cmd;
   }
   DBG_TRACE(DBG_LEVEL_DEBUG, "Leaving ioctl");
+  trace_usbwall_ioctl(cmd, 0);
   return 0;
 
+err_txn:
+  DBG_TRACE(DBG_LEVEL_DEBUG, "Leaving ioctl with error %d", err);
+  usbwall_stat_inc(USBWALL_STAT_IOCTL_ERRORS);
+  trace_usbwall_ioctl(cmd, err);
+  return err;
 err_badarg:
   DBG_TRACE(DBG_LEVEL_DEBUG, "Leaving ioctl with error FAULT");
-  kfree(internal_keyinfo);
+  if (internal_keyinfo != NULL) {
+    keyinfo_free(internal_keyinfo);
+  }
+  usbwall_stat_inc(USBWALL_STAT_IOCTL_ERRORS);
+  trace_usbwall_ioctl(cmd, -EFAULT);
   return -EFAULT;
 err_cmd:
   DBG_TRACE(DBG_LEVEL_DEBUG, "Leaving ioctl with error INVAL");
+  usbwall_stat_inc(USBWALL_STAT_IOCTL_ERRORS);
+  trace_usbwall_ioctl(cmd, -EINVAL);
   return -EINVAL;
-err_nomem:
-  DBG_TRACE(DBG_LEVEL_DEBUG, "Leaving ioctl with error NOMEM");
-  return -ENOMEM;
 }
 
+/*
+** @brief tell whether a written record is either an addition or a deletion
+*/
+static int
+usbwall_chrdev_record_valid(const struct usbwall_token_info	*record)
+{
+  return !(record->keyflags & USBWALL_KEY_ADD) != !(record->keyflags & USBWALL_KEY_DEL);
+}
+
+/*
+** @brief stage the record completed in ctx->partial in the open transaction,
+** else append it to the records to commit. ctx->lock must be held.
+*/
+static int
+usbwall_chrdev_write_record(struct context		*ctx,
+                            struct usbwall_token_info	*records,
+                            uint32_t			*nr_records)
+{
+  struct internal_token_info *keyinfo;
+  int err;
+
+  if (!ctx->txn_open) {
+    if (!usbwall_chrdev_record_valid(&ctx->partial)) {
+      return -EINVAL;
+    }
+    records[(*nr_records)++] = ctx->partial;
+    return 0;
+  }
+  keyinfo = keyinfo_alloc();
+  if (keyinfo == NULL) {
+    return -ENOMEM;
+  }
+  keyinfo->info = ctx->partial;
+  err = keylist_txn_stage(&ctx->txn, keyinfo);
+  if (err != 0) {
+    keyinfo_free(keyinfo);
+  }
+  return err;
+}
+
+/*
+** @brief load a stream of struct usbwall_token_info records, each one with
+** either USBWALL_KEY_ADD or USBWALL_KEY_DEL in keyflags.
+**
+** A record may be split between writes. While a transaction is open, the
+** records are staged in it. Otherwise the complete records of a write are
+** committed before it returns, every USBWALL_BATCH_MAX records and at its
+** end, so a writer keeping the file open has its keys applied at once.
+**
+** As for any write(2), an error met once some bytes were consumed is not
+** returned by the write: it returns the bytes consumed, and the next write
+** (or close()) returns the error. The records are checked one by one: a
+** write consumes the records before an invalid one, but not the invalid one
+** itself, unless it began in an earlier write. A failed commit consumes none
+** of its records.
+*/
+static ssize_t
+usbwall_chrdev_write(struct file	*filp,
+                     const char __user	*buf,
+                     size_t		count,
+                     loff_t		*ppos __attribute__((unused)))
+{
+  struct context *ctx = filp->private_data;
+  struct usbwall_token_info *records = NULL;
+  struct usbwall_token_info head;
+  const size_t size = sizeof(struct usbwall_token_info);
+  size_t head_len;
+  size_t committed = 0;
+  size_t done = 0;
+  size_t len;
+  uint32_t nr_records = 0;
+  uint32_t nr;
+  uint32_t i;
+  int first;
+  int err = 0;
+  int ret;
+
+  mutex_lock(&ctx->lock);
+  if (ctx->write_err != 0) {
+    err = ctx->write_err;
+    ctx->write_err = 0;
+    mutex_unlock(&ctx->lock);
+    return err;
+  }
+  /* given back by a failed commit of the record it begins */
+  head = ctx->partial;
+  head_len = ctx->partial_len;
+  if (!ctx->txn_open && ctx->partial_len + count >= size) {
+    records = kvmalloc_array(min_t(size_t, (ctx->partial_len + count) / size, USBWALL_BATCH_MAX),
+                             size, GFP_KERNEL);
+    if (records == NULL) {
+      mutex_unlock(&ctx->lock);
+      return -ENOMEM;
+    }
+  }
+  while (done < count && err == 0) {
+    if (ctx->partial_len == 0 && !ctx->txn_open && count - done >= size) {
+      /* whole records: copied straight to the batch, then checked */
+      nr = min_t(size_t, (count - done) / size, USBWALL_BATCH_MAX - nr_records);
+      if (copy_from_user(&records[nr_records], buf + done, nr * size)) {
+        err = -EFAULT;
+      } else {
+        for (i = 0; i < nr && usbwall_chrdev_record_valid(&records[nr_records + i]); i++) {
+        }
+        nr_records += i;
+        done += i * size;
+        if (i < nr) {
+          err = -EINVAL;
+        }
+      }
+    } else {
+      first = (ctx->partial_len == 0);
+      len = min(count - done, size - ctx->partial_len);
+      if (copy_from_user((char *)&ctx->partial + ctx->partial_len, buf + done, len)) {
+        err = -EFAULT;
+      } else {
+        ctx->partial_len += len;
+        done += len;
+        if (ctx->partial_len == size) {
+          ctx->partial_len = 0;
+          err = usbwall_chrdev_write_record(ctx, records, &nr_records);
+          if (err != 0 && first) {
+            /* the whole record is of this write: left to the next one */
+            done -= len;
+          }
+        }
+      }
+    }
+    if (nr_records == USBWALL_BATCH_MAX || (nr_records != 0 && (done == count || err != 0))) {
+      ret = keylist_apply_batch(records, nr_records, 0, NULL, NULL);
+      if (ret != 0) {
+        DBG_TRACE(DBG_LEVEL_ERROR, "unable to apply %u written keys: error %d", nr_records, ret);
+        /* from the end of the last commit, with the record begun before if none */
+        err = ret;
+        done = committed;
+        ctx->partial = head;
+        ctx->partial_len = (committed == 0) ? head_len : 0;
+        break;
+      }
+      nr_records = 0;
+      committed = done;
+    }
+  }
+  kvfree(records);
+  if (err != 0) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "write: error %d after %zu bytes", err, done);
+    if (done != 0) {
+      ctx->write_err = err;
+      err = 0;
+    }
+  }
+  mutex_unlock(&ctx->lock);
+  return err != 0 ? err : done;
+}
+
+/*
+** @brief read the audit records of the decisions (see struct
+** usbwall_audit_record). Only whole records are returned, and each record
+** to a single reader.
+*/
+static ssize_t
+usbwall_chrdev_read(struct file		*filp,
+                    char __user		*buf,
+                    size_t		count,
+                    loff_t		*ppos __attribute__((unused)))
+{
+  return usbwall_audit_read(buf, count, filp->f_flags & O_NONBLOCK);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+static __poll_t
+#else
+static unsigned int
+#endif
+usbwall_chrdev_poll(struct file		*filp,
+                    poll_table		*wait)
+{
+  return usbwall_audit_poll(filp, wait);
+}
+
+/*
+** @brief return the error left by the last write when the file is closed,
+** so that close() reports it.
+*/
+static int
+usbwall_chrdev_flush(struct file	*filp,
+                     fl_owner_t		id __attribute__((unused)))
+{
+  struct context *ctx = filp->private_data;
+  int err;
+
+  mutex_lock(&ctx->lock);
+  err = ctx->write_err;
+  ctx->write_err = 0;
+  mutex_unlock(&ctx->lock);
+  return err;
+}
+
+static void
+usbwall_chrdev_vma_open(struct vm_area_struct	*vma)
+{
+  keylist_export_hold(vma->vm_private_data);
+}
+
+static void
+usbwall_chrdev_vma_close(struct vm_area_struct	*vma)
+{
+  keylist_export_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct usbwall_vm_ops =
+{
+  open : usbwall_chrdev_vma_open,
+  close : usbwall_chrdev_vma_close,
+};
+
+/*
+** @brief map the policy snapshot of the file read-only (see struct
+** usbwall_map_header). The pages are those of the snapshot, nothing is
+** copied to userspace.
+*/
+static int
+usbwall_chrdev_mmap(struct file			*filp,
+                    struct vm_area_struct	*vma)
+{
+  struct context *ctx = filp->private_data;
+  struct keylist_export *export;
+  struct keylist_export *old;
+  size_t size;
+  void *map;
+  int err;
+
+  if (vma->vm_flags & VM_WRITE) {
+    return -EPERM;
+  }
+  export = smp_load_acquire(&ctx->export);
+  if (export == NULL) {
+    export = keylist_export_get();
+    if (IS_ERR(export)) {
+      return PTR_ERR(export);
+    }
+    /* a concurrent mmap() of the same file may have set it first */
+    old = cmpxchg(&ctx->export, NULL, export);
+    if (old != NULL) {
+      keylist_export_put(export);
+      export = old;
+    }
+  }
+
+  map = keylist_export_map(export, &size);
+  /* fails if the mapping goes past the snapshot pages */
+  err = remap_vmalloc_range(vma, map, vma->vm_pgoff);
+  if (err != 0) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "mmap: %lu bytes at page %lu of a %zu bytes snapshot",
+              vma->vm_end - vma->vm_start, vma->vm_pgoff, size);
+    return err;
+  }
+  /* no mprotect(PROT_WRITE) later */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_clear(vma, VM_MAYWRITE);
+#else
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+  keylist_export_hold(export);
+  vma->vm_private_data = export;
+  vma->vm_ops = &usbwall_vm_ops;
+  return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+/*
+** @brief per file state, in /proc/<pid>/fdinfo/<fd>
+*/
+static void
+usbwall_chrdev_show_fdinfo(struct seq_file	*m,
+                           struct file		*filp)
+{
+  struct context *ctx = filp->private_data;
+  struct keylist_export *export;
+  size_t size;
+  int i;
+
+  mutex_lock(&ctx->lock);
+  seq_printf(m, "txn:\t%s\n", ctx->txn_open ? "open" : "none");
+  if (ctx->txn_open) {
+    seq_printf(m, "staged:\t%u\n", ctx->txn.nr_ops);
+  }
+  seq_printf(m, "partial:\t%zu\n", ctx->partial_len);
+  mutex_unlock(&ctx->lock);
+  export = smp_load_acquire(&ctx->export);
+  if (export != NULL) {
+    seq_printf(m, "mapped generation:\t%llu\n",
+               (unsigned long long)le64_to_cpu(((struct usbwall_map_header *)
+                                                keylist_export_map(export, &size))->generation));
+  }
+  seq_printf(m, "ioctls:\t");
+  for (i = 0; i < USBWALL_IO_MAX; i++) {
+    seq_printf(m, " %d", atomic_read(&ctx->ioctlstats[i]));
+  }
+  seq_printf(m, "\n");
+}
+#endif
+
 static int
 usbwall_chrdev_release(struct inode        *inode __attribute__((unused)),
-                       struct file	   *file __attribute__((unused)))
+                       struct file	   *file)
 {
-  open_count -= 1;
+  struct context *ctx = file->private_data;
+
+  /* an uncommitted transaction is dropped with its file */
+  if (ctx->txn_open) {
+    keylist_txn_release(&ctx->txn);
+  }
+  /* the mappings hold their own reference */
+  if (ctx->export != NULL) {
+    keylist_export_put(ctx->export);
+  }
+  kfree(ctx);
   return 0;
 }
 
@@ -171,7 +718,13 @@ usbwall_chrdev_release(struct inode        *inode __attribute__((unused)),
 ** Only hc_write is called when /dev/hc is written from userspace.
 ** @arg owner definition correspond to the current module
 ** @arg open replacement function
+** @arg write key records loading function
+** @arg read audit records of the decisions
+** @arg poll wait for an audit record
 ** @arg ioctl replacement function
+** @arg mmap read-only policy snapshot
+** @arg flush error left by the last write
+** @arg show_fdinfo per file state
 ** @arg close replacement function
 **
 */
@@ -179,7 +732,15 @@ static struct file_operations usbwall_fops =
 {
   owner : THIS_MODULE,
   open : usbwall_chrdev_open,
+  write : usbwall_chrdev_write,
+  read : usbwall_chrdev_read,
+  poll : usbwall_chrdev_poll,
   unlocked_ioctl : usbwall_chrdev_ioctl,
+  mmap : usbwall_chrdev_mmap,
+  flush : usbwall_chrdev_flush,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+  show_fdinfo : usbwall_chrdev_show_fdinfo,
+#endif
   release : usbwall_chrdev_release,
 };
 
@@ -189,13 +750,11 @@ static struct file_operations usbwall_fops =
 ** - create the associated structures (cdev_list vector)
 ** - register a usbwall_class kernel device class
 ** - register the "usbwall" device
-** @return 0 if okay, possitive value otherwise.
+** @return 0 if okay, negative error number otherwise.
 */
 int32_t
 usbwall_chrdev_init(void)
 {
-  int8_t ret = 0;
-  int8_t		udev_ret = 1;
   int32_t		err;
   int32_t		devno;
 
@@ -212,12 +771,12 @@ usbwall_chrdev_init(void)
   ** supported by the module, starting at 0.
   ** This module devices prefix is "usbwall"
   */
-  udev_ret = alloc_chrdev_region(&dev, 0, 1, "usbwall");
-  if (udev_ret != 0)
+  err = alloc_chrdev_region(&dev, 0, 1, "usbwall");
+  if (err != 0)
   {
     DBG_TRACE(DBG_LEVEL_ERROR, "Allocation of char device region failed");
-    DBG_TRACE(DBG_LEVEL_ERROR, "alloc_chrdev_region returns %d\n", udev_ret);
-    goto failure;
+    DBG_TRACE(DBG_LEVEL_ERROR, "alloc_chrdev_region returns %d\n", err);
+    return err;
   }
   usbwall_major = MAJOR(dev);
   DBG_TRACE(DBG_LEVEL_NOTICE, "dynamic major: %d\n", usbwall_major);
@@ -230,7 +789,8 @@ usbwall_chrdev_init(void)
   if (cdev == NULL)
   {
     DBG_TRACE(DBG_LEVEL_ERROR, "Allocating of the cdev impossible");
-    goto failure;
+    err = -ENOMEM;
+    goto failure_region;
   }
   /* initialize the corresponding cdev */
   cdev_init(cdev, &usbwall_fops);
@@ -244,14 +804,24 @@ usbwall_chrdev_init(void)
   if (err != 0)
   {
     DBG_TRACE(DBG_LEVEL_ERROR, "Unable to add cdev !\n");
-    ret = 1;
-  }
-  else
-  {
-    DBG_TRACE(DBG_LEVEL_INFO, "cdev loaded correctly.");
+    /* never added: only drop the reference of cdev_alloc() */
+    kobject_put(&cdev->kobj);
+    goto failure_region;
   }
+  DBG_TRACE(DBG_LEVEL_INFO, "cdev loaded correctly.");
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+  /* the owner module argument was removed */
+  usbwall_class = class_create("usbwall_class");
+#else
   usbwall_class = class_create(THIS_MODULE, "usbwall_class");
+#endif
+  if (IS_ERR(usbwall_class))
+  {
+    DBG_TRACE(DBG_LEVEL_ERROR, "Unable to create the usbwall class !\n");
+    err = PTR_ERR(usbwall_class);
+    goto failure_cdev;
+  }
   /*
   ** This needs a relativly recent kernel (2.6.18 doesn't support NULL
   ** parrent). Otherwise just print a warning when loading.
@@ -269,8 +839,11 @@ usbwall_chrdev_init(void)
 
   return 0;
 
-failure:
-  return ret;
+failure_cdev:
+  cdev_del(cdev);
+failure_region:
+  unregister_chrdev_region(dev, 1);
+  return err;
 }
 
 void
@@ -279,5 +852,5 @@ usbwall_chrdev_exit(void)
   device_destroy(usbwall_class, dev);
   class_destroy(usbwall_class);
   cdev_del(cdev);
-  unregister_chrdev_region(dev, usbwall_major);
+  unregister_chrdev_region(dev, 1);
 }
@@ -40,12 +40,24 @@
 #include <asm/uaccess.h>
 #include <linux/version.h>
 #include <linux/usb/ch9.h>
+#include <linux/firmware.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
 #include "trace.h"
 #include "usbwall.h"
 #include "keylist.h"
 #include "procfs_iface.h"
 #include "keylist_info.h"
 #include "usbwall_chrdev.h"
+#include "usbwall_netlink.h"
+#include "keycache.h"
+#include "usbwall_stats.h"
+#include "usbwall_audit.h"
+#include "usbwall_trace.h"
 
 /* Module informations */
 MODULE_AUTHOR ("David FERNANDES");
@@ -65,6 +77,36 @@ short authmode = USBWALL_AUTH_LIST;
 module_param(authmode, short, 0640);
 MODULE_PARM_DESC(authmode, "Module device authentication method: 0 for event based (ask for userspace answer), 1 for list based (internal device list)");
 
+/* verdict for the devices matching no rule of the list, or left unanswered */
+short defaultverdict = 0;
+
+module_param(defaultverdict, short, 0640);
+MODULE_PARM_DESC(defaultverdict, "Verdict for devices matching no rule in list mode, or without answer in event mode: 0 to block (default), 1 to allow");
+
+/* event mode: time given to the userspace authority to answer */
+unsigned int authtimeout = 5000;
+
+module_param(authtimeout, uint, 0640);
+MODULE_PARM_DESC(authtimeout, "Time given to the userspace authority to answer in event mode, in milliseconds (default 5000)");
+
+/* event mode: verdicts kept for a replug, when the authority gives a ttl */
+static unsigned int verdictcache = 256;
+
+module_param(verdictcache, uint, 0440);
+MODULE_PARM_DESC(verdictcache, "Number of authority verdicts cached in event mode, at most 1048576, 0 to always ask the authority (default 256)");
+
+/* audit trail: records of each cpu kept until read from /dev/usbwall */
+static unsigned int auditsize = USBWALL_AUDIT_SIZE;
+
+module_param(auditsize, uint, 0440);
+MODULE_PARM_DESC(auditsize, "Audit records kept per cpu until read, rounded up to a power of 2, at most 65536 (default 256)");
+
+/* binary policy image loaded at init, through the firmware loader */
+static char *policyimage = NULL;
+
+module_param(policyimage, charp, 0440);
+MODULE_PARM_DESC(policyimage, "Policy image file, relative to the firmware directory (/lib/firmware), loaded before /dev/usbwall is created");
+
 /**
  * \struct usb_device_id usbwall_id_table []
  *
@@ -77,47 +119,247 @@ static struct usb_device_id usbwall_id_table[] = {
 
 MODULE_DEVICE_TABLE (usb, usbwall_id_table);
 
-/* kernel's representation of a USB device */
-static struct usb_device *dev;
-
-/* my variables */
-static char idSerialNumber[32] = "";
-static struct internal_token_info my_device;
 static int usbwall_register;
 
-/** 
- * \fn usbwall_probe
+static struct usb_driver usbwall_driver;
+
+/*
+** The decisions are taken on usbwall_wq rather than in usbwall_probe(),
+** which runs in the USB core enumeration thread: fetching the serial number,
+** looking it up or waiting for the userspace authority would delay every
+** other device of the hub. The probe claims the interface at once, so the
+** device stays blocked until its decision. An allowed interface is then
+** released and attached again, for usb_storage to bind it.
+*/
+struct usbwall_decision {
+  struct work_struct work;
+  struct usb_interface *intf;
+  ktime_t probed;		/* start of USBWALL_LAT_DECISION */
+  struct list_head releasing;	/* in usbwall_releasing while attached again */
+};
+
+static struct workqueue_struct *usbwall_wq;
+
+/* interfaces being attached again after an allow verdict */
+static LIST_HEAD(usbwall_releasing);
+static DEFINE_SPINLOCK(usbwall_releasing_lock);
+
+/**
+ * \fn usbwall_is_releasing
  * \param *intf usb_interface
- * \param *devid usb_device_id
- * \return -ENOTSUP if the device is on the white liste else 0 
+ * \return 1 if the interface is being attached again after an allow verdict
+ */
+static int usbwall_is_releasing (struct usb_interface *intf)
+{
+  struct usbwall_decision *decision;
+  int found = 0;
+
+  spin_lock (&usbwall_releasing_lock);
+  list_for_each_entry (decision, &usbwall_releasing, releasing)
+  {
+    if (decision->intf == intf)
+    {
+      found = 1;
+      break;
+    }
+  }
+  spin_unlock (&usbwall_releasing_lock);
+  return found;
+}
+
+/**
+ * \fn usbwall_verdict
+ * \param *intf usb_interface
+ * \param *my_device the device identity
+ * \param *source set to the USBWALL_SOURCE_* of the verdict
+ * \param *tier set to the tier of the matching rule, in list mode
+ * \param *rule set to the matching rule, if tier is not KEYLIST_MATCH_NONE
+ * \return 1 if the device is allowed, else 0
  *
- * Function called by the kernel when a device is detected
+ * Decide on a device, from the authority in event mode or from the white
+ * list, else from defaultverdict. The authority is only asked on a miss of
+ * the verdict cache. May sleep for authtimeout.
  */
-static int usbwall_probe (struct usb_interface *intf, const struct usb_device_id *devid)
+static int usbwall_verdict (struct usb_interface *intf, struct internal_token_info *my_device,
+                            int *source, int *tier, struct keylist_rule *rule)
 {
-  DBG_TRACE (DBG_LEVEL_DEBUG, "entering in the function probe");
+  int verdict;
+  unsigned int ttl;
+  u64 generation;
+  ktime_t start;
 
-  dev = interface_to_usbdev (intf);
-  usb_string (dev, dev->descriptor.iSerialNumber, idSerialNumber, 32);
+  *source = USBWALL_SOURCE_DEFAULT;
+  *tier = KEYLIST_MATCH_NONE;
+  if (authmode == USBWALL_AUTH_EVENT)
+  {
+    verdict = keycache_lookup (my_device, &generation);
+    if (verdict >= 0)
+    {
+      *source = USBWALL_SOURCE_CACHE;
+      DBG_TRACE (DBG_LEVEL_INFO, "cached verdict of the authority : %d", verdict);
+    }
+    else
+    {
+      *source = USBWALL_SOURCE_AUTHORITY;
+      /* ask the userspace authority, which may keep us waiting up to authtimeout */
+      start = ktime_get ();
+      verdict = usbwall_netlink_authorize (&my_device->info, dev_name (&intf->dev), authtimeout, &ttl);
+      usbwall_lat_record (USBWALL_LAT_AUTHORITY, start);
+      if (verdict >= 0)
+      {
+        keycache_insert (my_device, verdict, ttl, generation);
+      }
+    }
+    switch (verdict)
+    {
+      case USBWALL_VERDICT_ALLOW:
+        DBG_TRACE (DBG_LEVEL_INFO, "the device is allowed by the authority");
+        return 1;
+      case USBWALL_VERDICT_BLOCK:
+        DBG_TRACE (DBG_LEVEL_INFO, "the device is blocked by the authority");
+        return 0;
+      default:
+        *source = USBWALL_SOURCE_DEFAULT;
+        break;
+    }
+  }
+  else
+  {
+    /* Research if the device is on the white list */
+    start = ktime_get ();
+    *tier = keylist_match (my_device, rule);
+    usbwall_lat_record (USBWALL_LAT_LOOKUP, start);
+    /* If the device is on the white liste : the module is released */
+    if (*tier != KEYLIST_MATCH_NONE)
+    {
+      *source = USBWALL_SOURCE_LIST;
+      DBG_TRACE (DBG_LEVEL_INFO, "the device is on the white list");
+      return 1;
+    }
+  }
+  if (defaultverdict)
+  {
+    DBG_TRACE (DBG_LEVEL_INFO, "the device isn't authorized, allowed by default");
+    return 1;
+  }
+  /* Else : creation a fake device */
+  DBG_TRACE (DBG_LEVEL_INFO, "the device isn't on the white list");
+  return 0;
+}
 
-  my_device.info.idVendor = dev->descriptor.idVendor;
-  my_device.info.idProduct = dev->descriptor.idProduct;
-  strcpy(my_device.info.idSerialNumber, idSerialNumber);
+/**
+ * \fn usbwall_decide
+ * \param *work the work of a struct usbwall_decision
+ *
+ * Decide on a claimed interface, then keep it or hand it over to the other
+ * drivers. The interface may have been disconnected meanwhile: it is only
+ * released if it still belongs to this decision, under the device lock.
+ */
+static void usbwall_decide (struct work_struct *work)
+{
+  struct usbwall_decision *decision = container_of (work, struct usbwall_decision, work);
+  struct usb_interface *intf = decision->intf;
+  struct usb_device *dev = interface_to_usbdev (intf);
+  struct internal_token_info my_device;
+  ktime_t start;
+  int allowed;
+  int source;
+  int tier;
+  struct keylist_rule rule;
+  int err;
+
+  memset(&my_device, 0, sizeof(my_device));
+  start = ktime_get ();
+  usb_string (dev, dev->descriptor.iSerialNumber, my_device.info.idSerialNumber,
+              sizeof(my_device.info.idSerialNumber));
+  usbwall_lat_record (USBWALL_LAT_SERIAL, start);
 
+  my_device.info.idVendor = le16_to_cpu(dev->descriptor.idVendor);
+  my_device.info.idProduct = le16_to_cpu(dev->descriptor.idProduct);
+
+  start = ktime_get ();
   DBG_TRACE (DBG_LEVEL_INFO, "the device introduced has the following info");
   DBG_TRACE (DBG_LEVEL_INFO, "idVendor : %x", my_device.info.idVendor);
   DBG_TRACE (DBG_LEVEL_INFO, "idProduct : %x", my_device.info.idProduct);
   DBG_TRACE (DBG_LEVEL_INFO, "SerialNumber : %s", my_device.info.idSerialNumber);
+  usbwall_lat_record (USBWALL_LAT_TRACE, start);
+
+  allowed = usbwall_verdict (intf, &my_device, &source, &tier, &rule);
+  usbwall_stat_inc (allowed ? USBWALL_STAT_ALLOWS : USBWALL_STAT_DENIES);
+  trace_usbwall_decision (dev_name (&intf->dev), &my_device.info, allowed, source, tier,
+                          ktime_to_ns (ktime_sub (ktime_get (), decision->probed)));
+  usbwall_audit_log (dev_name (&intf->dev), &my_device.info, allowed, source, tier,
+                     tier != KEYLIST_MATCH_NONE ? &rule : NULL);
 
-  /* Research if the device is on the white list */
-  /* If the device is on the white liste : the module is released */
-  if(is_key_authorized(&my_device))
+  usb_lock_device (dev);
+  if (usb_get_intfdata (intf) == decision)
   {
-    DBG_TRACE (DBG_LEVEL_INFO, "the device is on the white list");
-    return -EMEDIUMTYPE;
+    usb_set_intfdata (intf, NULL);
+    if (allowed)
+    {
+      spin_lock (&usbwall_releasing_lock);
+      list_add (&decision->releasing, &usbwall_releasing);
+      spin_unlock (&usbwall_releasing_lock);
+      usb_driver_release_interface (&usbwall_driver, intf);
+      /* the parent lock is held, as required for an interface */
+      err = device_attach (&intf->dev);
+      if (err < 0)
+      {
+        DBG_TRACE (DBG_LEVEL_ERROR, "attaching %s again failed, error : %d", dev_name (&intf->dev), err);
+      }
+      spin_lock (&usbwall_releasing_lock);
+      list_del (&decision->releasing);
+      spin_unlock (&usbwall_releasing_lock);
+    }
   }
-  /* Else : creation a fake device */
-  DBG_TRACE (DBG_LEVEL_INFO, "the device isn't on the white list");
+  else
+  {
+    DBG_TRACE (DBG_LEVEL_INFO, "device disconnected before its decision");
+  }
+  usb_unlock_device (dev);
+  usbwall_lat_record (USBWALL_LAT_DECISION, decision->probed);
+  usb_put_intf (intf);
+  kfree (decision);
+}
+
+/** 
+ * \fn usbwall_probe
+ * \param *intf usb_interface
+ * \param *devid usb_device_id
+ * \return -ENODEV if the interface was just allowed, else 0
+ *
+ * Function called by the kernel when a device is detected: the interface is
+ * claimed, blocking the device until usbwall_decide() runs.
+ */
+static int usbwall_probe (struct usb_interface *intf, const struct usb_device_id *devid)
+{
+  struct usbwall_decision *decision;
+  struct usb_device *dev = interface_to_usbdev (intf);
+  ktime_t start = ktime_get ();
+
+  DBG_TRACE (DBG_LEVEL_DEBUG, "entering in the function probe");
+
+  if (usbwall_is_releasing (intf))
+  {
+    /* let the next driver bind the allowed interface */
+    return -ENODEV;
+  }
+  usbwall_stat_inc (USBWALL_STAT_PROBES);
+  trace_usbwall_probe (dev_name (&intf->dev), le16_to_cpu (dev->descriptor.idVendor),
+                       le16_to_cpu (dev->descriptor.idProduct));
+  decision = kzalloc (sizeof (*decision), GFP_KERNEL);
+  if (decision == NULL)
+  {
+    /* keep the device blocked rather than letting it through */
+    DBG_TRACE (DBG_LEVEL_ERROR, "no memory for the decision on %s, blocked", dev_name (&intf->dev));
+    return 0;
+  }
+  decision->intf = usb_get_intf (intf);
+  decision->probed = start;
+  INIT_WORK (&decision->work, usbwall_decide);
+  usb_set_intfdata (intf, decision);
+  queue_work (usbwall_wq, &decision->work);
+  usbwall_lat_record (USBWALL_LAT_PROBE, start);
   return 0;
 }
 
@@ -125,10 +367,12 @@ static int usbwall_probe (struct usb_interface *intf, const struct usb_device_id
  * \fn usbwall_disconnect
  * \param  struct usb_interface *intf
  *
- * Function called when a device is desconnected
+ * Function called when a device is desconnected. A pending decision finds
+ * the interface released, and only frees itself.
  */
 static void usbwall_disconnect (struct usb_interface *intf)
 {
+  usb_set_intfdata (intf, NULL);
   DBG_TRACE (DBG_LEVEL_INFO, "device disconnected");
 }
 
@@ -145,6 +389,40 @@ static struct usb_driver usbwall_driver = {
 };
 
 
+/**
+ * \fn usbwall_load_policy
+ *
+ * Load the policy image named by policyimage, if any. An image that can't be
+ * loaded leaves the empty policy: the devices then get defaultverdict, and
+ * the keys can still be injected through the char device.
+ *
+ * The image replaces the whole policy, so it is loaded before the char
+ * device exists: no key injected meanwhile can be lost. The firmware loader
+ * is given no device.
+ */
+static void usbwall_load_policy (void)
+{
+  const struct firmware *fw;
+  int err;
+
+  if (policyimage == NULL || policyimage[0] == '\0')
+  {
+    return;
+  }
+  err = request_firmware (&fw, policyimage, NULL);
+  if (err)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Reading policy image %s failed, error : %d", policyimage, err);
+    return;
+  }
+  err = keylist_load_image (fw->data, fw->size, NULL);
+  if (err)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Loading policy image %s failed, error : %d", policyimage, err);
+  }
+  release_firmware (fw);
+}
+
 /** 
  * \fn __init usbwall_init
  * \return usbwall_register; O if register success, else error number (register failed). 
@@ -153,21 +431,83 @@ static struct usb_driver usbwall_driver = {
  */
 static int __init usbwall_init (void)
 {
+  dbglevel_init();
   if (authmode >= USBWALL_AUTH_MAX) {
     DBG_TRACE(DBG_LEVEL_ERROR, "invalid authmode %d", authmode);
     return -EINVAL;
   }
-  /* USB driver register*/
-  usbwall_register = 0;
+  /* the key list must be ready before the first probe */
+  usbwall_register = keylist_init();
+  if (usbwall_register)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Initializing key list failed, error : %d", usbwall_register);
+    return usbwall_register;
+  }
+  usbwall_register = usbwall_audit_init (auditsize);
+  if (usbwall_register)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Allocating the audit rings failed, error : %d", usbwall_register);
+    goto fail_audit;
+  }
+  usbwall_register = keycache_init (verdictcache);
+  if (usbwall_register)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Allocating the verdict cache failed, error : %d", usbwall_register);
+    goto fail_keycache;
+  }
+  /* the whole policy is in place before the first key injection or probe */
+  usbwall_load_policy();
+  usbwall_register = usbwall_chrdev_init();
+  if (usbwall_register)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Registering char device failed, error : %d", usbwall_register);
+    goto fail_chrdev;
+  }
+  /* as well as the event mode, which authmode can switch to at any time */
+  usbwall_register = usbwall_netlink_init();
+  if (usbwall_register)
+  {
+    goto fail_netlink;
+  }
+  /* unbound: the decisions mostly sleep, and may all wait for the authority */
+  usbwall_wq = alloc_workqueue ("usbwall", WQ_UNBOUND, 0);
+  if (usbwall_wq == NULL)
+  {
+    usbwall_register = -ENOMEM;
+    goto fail_wq;
+  }
+  usbwall_register = usbwall_proc_init();
+  if (usbwall_register)
+  {
+    DBG_TRACE (DBG_LEVEL_ERROR, "Creating /proc/usbwall failed, error : %d", usbwall_register);
+    goto fail_proc;
+  }
+  /* USB driver register, last: the probes may start right away */
   usbwall_register = usb_register (&usbwall_driver);
   if (usbwall_register)
   {
     DBG_TRACE (DBG_LEVEL_ERROR, "Registering usb driver failed, error : %d", usbwall_register);
+    goto fail_usb;
   }
-  usbwall_proc_init();
-  usbwall_chrdev_init();
-  keylist_init();
   DBG_TRACE (DBG_LEVEL_INFO, "module loaded");
+  return 0;
+
+/* failure management, in the reverse order of the initialization */
+fail_usb:
+  usbwall_proc_release();
+fail_proc:
+  destroy_workqueue (usbwall_wq);
+fail_wq:
+  usbwall_netlink_exit();
+fail_netlink:
+  usbwall_chrdev_exit();
+fail_chrdev:
+  keycache_release();
+fail_keycache:
+  usbwall_audit_exit();
+fail_audit:
+  /* along with the policy loaded from the image, if any */
+  keylist_release();
   return usbwall_register;
 }
 
@@ -178,11 +518,16 @@ static int __init usbwall_init (void)
  */
 static void __exit usbwall_exit (void)
 {
-  keylist_release();
   usbwall_chrdev_exit();
   usbwall_proc_release();
   /* USB driver unregister*/
   usb_deregister (&usbwall_driver);
+  /* wait for the pending decisions, which found their interfaces released */
+  destroy_workqueue (usbwall_wq);
+  usbwall_netlink_exit();
+  keycache_release();
+  usbwall_audit_exit();
+  keylist_release();
   DBG_TRACE (DBG_LEVEL_INFO, "module unloaded");
 }
 
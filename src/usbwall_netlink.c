@@ -0,0 +1,317 @@
+/*
+** File usbwall_netlink.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_netlink.c
+**
+** Event authorization mode, through a generic netlink family
+**
+** Each device waiting for a verdict has a pending request, registered in an
+** IDR under the request id sent to the authority. The request lives on the
+** stack of the waiter: a verdict only completes it under
+** usbwall_requests_lock, and the waiter removes it under that same lock
+** before returning, whether it was answered or timed out. Any number of
+** devices can wait at once, and a late verdict finds no request.
+**
+** The requests hold the device serial numbers, so they are only unicast to
+** the authority, a socket registered by USBWALL_CMD_AUTH_REGISTER, which needs
+** CAP_NET_ADMIN on every kernel, unlike the subscription to a multicast
+** group. Only that socket may answer, and its release unregisters it before
+** its port id can be reused.
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/idr.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/netlink.h>
+#include <linux/notifier.h>
+#include <net/genetlink.h>
+#include "usbwall_netlink.h"
+#include "trace.h"
+
+struct usbwall_request {
+  struct completion done;
+  int verdict;
+  unsigned int ttl;
+};
+
+static DEFINE_IDR(usbwall_requests);
+static DEFINE_SPINLOCK(usbwall_requests_lock);
+/* port id of the authority socket, 0 if none, under usbwall_requests_lock */
+static u32 usbwall_authority;
+
+static const struct nla_policy usbwall_genl_policy[USBWALL_ATTR_MAX + 1] = {
+  [USBWALL_ATTR_REQUEST_ID] = { .type = NLA_U32 },
+  [USBWALL_ATTR_VENDOR] = { .type = NLA_U16 },
+  [USBWALL_ATTR_PRODUCT] = { .type = NLA_U16 },
+  [USBWALL_ATTR_SERIAL] = { .type = NLA_NUL_STRING, .len = USBWALL_SERIAL_MAX - 1 },
+  [USBWALL_ATTR_DEVICE] = { .type = NLA_NUL_STRING },
+  [USBWALL_ATTR_VERDICT] = { .type = NLA_U8 },
+  [USBWALL_ATTR_TTL] = { .type = NLA_U32 },
+};
+
+static int usbwall_netlink_register(struct sk_buff *skb, struct genl_info *info);
+static int usbwall_netlink_verdict(struct sk_buff *skb, struct genl_info *info);
+
+static const struct genl_ops usbwall_genl_ops[] = {
+  {
+    .cmd = USBWALL_CMD_AUTH_REGISTER,
+    .flags = GENL_ADMIN_PERM,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0)
+    .policy = usbwall_genl_policy,
+#endif
+    .doit = usbwall_netlink_register,
+  },
+  {
+    .cmd = USBWALL_CMD_AUTH_VERDICT,
+    .flags = GENL_ADMIN_PERM,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 2, 0)
+    .policy = usbwall_genl_policy,
+#endif
+    .doit = usbwall_netlink_verdict,
+  },
+};
+
+static struct genl_family usbwall_genl_family = {
+  .name = USBWALL_GENL_NAME,
+  .version = USBWALL_GENL_VERSION,
+  .maxattr = USBWALL_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+  .policy = usbwall_genl_policy,
+#endif
+  .module = THIS_MODULE,
+  .ops = usbwall_genl_ops,
+  .n_ops = ARRAY_SIZE(usbwall_genl_ops),
+};
+
+/*!
+** \brief USBWALL_CMD_AUTH_REGISTER handler: make the sender the authority
+*/
+static int usbwall_netlink_register(struct sk_buff *skb, struct genl_info *info)
+{
+  u32 portid = info->snd_portid;
+  int err = 0;
+
+  spin_lock(&usbwall_requests_lock);
+  if (usbwall_authority == 0) {
+    usbwall_authority = portid;
+  } else if (usbwall_authority != portid) {
+    err = -EBUSY;
+  }
+  spin_unlock(&usbwall_requests_lock);
+  if (err) {
+    DBG_TRACE(DBG_LEVEL_WARNING, "port %u: an authority is already registered", portid);
+  } else {
+    DBG_TRACE(DBG_LEVEL_INFO, "port %u registered as the authority", portid);
+  }
+  return err;
+}
+
+/*!
+** \brief unregister the authority when its socket is released
+*/
+static int usbwall_netlink_release(struct notifier_block *nb, unsigned long event, void *ptr)
+{
+  struct netlink_notify *notify = ptr;
+
+  if (event != NETLINK_URELEASE || notify->protocol != NETLINK_GENERIC ||
+      !net_eq(notify->net, &init_net)) {
+    return NOTIFY_DONE;
+  }
+  spin_lock(&usbwall_requests_lock);
+  if (usbwall_authority == notify->portid) {
+    usbwall_authority = 0;
+  }
+  spin_unlock(&usbwall_requests_lock);
+  return NOTIFY_DONE;
+}
+
+static struct notifier_block usbwall_netlink_notifier = {
+  .notifier_call = usbwall_netlink_release,
+};
+
+/*!
+** \brief USBWALL_CMD_AUTH_VERDICT handler: complete the pending request
+*/
+static int usbwall_netlink_verdict(struct sk_buff *skb, struct genl_info *info)
+{
+  struct usbwall_request *req;
+  u32 id;
+  u8 verdict;
+  u32 ttl = 0;
+
+  if (info->attrs[USBWALL_ATTR_REQUEST_ID] == NULL || info->attrs[USBWALL_ATTR_VERDICT] == NULL) {
+    return -EINVAL;
+  }
+  id = nla_get_u32(info->attrs[USBWALL_ATTR_REQUEST_ID]);
+  verdict = nla_get_u8(info->attrs[USBWALL_ATTR_VERDICT]);
+  if (verdict != USBWALL_VERDICT_ALLOW && verdict != USBWALL_VERDICT_BLOCK) {
+    return -EINVAL;
+  }
+  if (info->attrs[USBWALL_ATTR_TTL] != NULL) {
+    ttl = nla_get_u32(info->attrs[USBWALL_ATTR_TTL]);
+  }
+  spin_lock(&usbwall_requests_lock);
+  if (usbwall_authority == 0 || usbwall_authority != info->snd_portid) {
+    spin_unlock(&usbwall_requests_lock);
+    return -EPERM;
+  }
+  req = idr_find(&usbwall_requests, id);
+  if (req != NULL) {
+    req->verdict = verdict;
+    req->ttl = ttl;
+    complete(&req->done);
+  }
+  spin_unlock(&usbwall_requests_lock);
+  if (req == NULL) {
+    DBG_TRACE(DBG_LEVEL_WARNING, "verdict for request %u, which is no more pending", id);
+    return -ENOENT;
+  }
+  return 0;
+}
+
+/*!
+** \brief unicast the authorization request id of a device to the authority
+*/
+static int usbwall_netlink_request(u32 id,
+                                   const struct usbwall_token_info *info,
+                                   const char *device)
+{
+  struct sk_buff *skb;
+  void *hdr;
+  int err = -ESRCH;
+
+  skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+  if (skb == NULL) {
+    return -ENOMEM;
+  }
+  hdr = genlmsg_put(skb, 0, 0, &usbwall_genl_family, 0, USBWALL_CMD_AUTH_REQUEST);
+  if (hdr == NULL) {
+    goto nla_put_failure;
+  }
+  if (nla_put_u32(skb, USBWALL_ATTR_REQUEST_ID, id) ||
+      nla_put_u16(skb, USBWALL_ATTR_VENDOR, info->idVendor) ||
+      nla_put_u16(skb, USBWALL_ATTR_PRODUCT, info->idProduct) ||
+      nla_put_string(skb, USBWALL_ATTR_SERIAL, info->idSerialNumber) ||
+      nla_put_string(skb, USBWALL_ATTR_DEVICE, device)) {
+    goto nla_put_failure;
+  }
+  genlmsg_end(skb, hdr);
+  /*
+  ** sent under the lock, so that a port id released meanwhile can't be
+  ** reused by another socket before; the family is not netnsok, so the
+  ** authority is in the initial namespace, and the send does not block
+  */
+  spin_lock(&usbwall_requests_lock);
+  if (usbwall_authority != 0) {
+    err = genlmsg_unicast(&init_net, skb, usbwall_authority);
+    skb = NULL;
+  }
+  spin_unlock(&usbwall_requests_lock);
+  if (skb != NULL) {
+    nlmsg_free(skb);
+  }
+  /* -ECONNREFUSED: released meanwhile */
+  return err == -ECONNREFUSED ? -ESRCH : err;
+
+nla_put_failure:
+  nlmsg_free(skb);
+  return -EMSGSIZE;
+}
+
+int	usbwall_netlink_authorize(const struct usbwall_token_info *info,
+                                  const char *device,
+                                  unsigned int timeout_ms,
+                                  unsigned int *ttl)
+{
+  struct usbwall_request req;
+  ktime_t start;
+  int id;
+  int ret;
+
+  init_completion(&req.done);
+  req.verdict = -ETIMEDOUT;
+  req.ttl = 0;
+  *ttl = 0;
+  idr_preload(GFP_KERNEL);
+  spin_lock(&usbwall_requests_lock);
+  id = idr_alloc_cyclic(&usbwall_requests, &req, 1, 0, GFP_NOWAIT);
+  spin_unlock(&usbwall_requests_lock);
+  idr_preload_end();
+  if (id < 0) {
+    return id;
+  }
+
+  start = ktime_get();
+  ret = usbwall_netlink_request(id, info, device);
+  if (ret == 0) {
+    wait_for_completion_timeout(&req.done, msecs_to_jiffies(timeout_ms));
+  }
+  spin_lock(&usbwall_requests_lock);
+  idr_remove(&usbwall_requests, id);
+  if (ret == 0) {
+    ret = req.verdict;
+    *ttl = req.ttl;
+  }
+  spin_unlock(&usbwall_requests_lock);
+
+  if (ret < 0) {
+    DBG_TRACE(DBG_LEVEL_WARNING, "request %d for %s: no verdict, error %d", id, device, ret);
+  } else {
+    DBG_TRACE(DBG_LEVEL_INFO, "request %d for %s: verdict %d for %u s after %lld us", id, device,
+              ret, *ttl, (long long)ktime_us_delta(ktime_get(), start));
+  }
+  return ret;
+}
+
+/*!
+** \brief register the generic netlink family
+*/
+int	usbwall_netlink_init(void)
+{
+  int err;
+
+  err = netlink_register_notifier(&usbwall_netlink_notifier);
+  if (err) {
+    return err;
+  }
+  err = genl_register_family(&usbwall_genl_family);
+  if (err) {
+    DBG_TRACE(DBG_LEVEL_ERROR, "unable to register the %s netlink family: error %d",
+              USBWALL_GENL_NAME, err);
+    netlink_unregister_notifier(&usbwall_netlink_notifier);
+  }
+  return err;
+}
+
+/*!
+** \brief unregister the generic netlink family. No request may be pending.
+*/
+void	usbwall_netlink_exit(void)
+{
+  genl_unregister_family(&usbwall_genl_family);
+  netlink_unregister_notifier(&usbwall_netlink_notifier);
+  usbwall_authority = 0;
+  idr_destroy(&usbwall_requests);
+}
@@ -0,0 +1,47 @@
+/*
+** File usbwall_netlink.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_netlink.h
+**
+** Event authorization mode: devices authorized by a userspace authority
+** through the USBWALL_GENL_NAME generic netlink family (see usbwall.h)
+*/
+
+#ifndef USBWALL_NETLINK_H_
+# define USBWALL_NETLINK_H_
+
+#include "usbwall.h"
+
+int	usbwall_netlink_init(void);
+
+void	usbwall_netlink_exit(void);
+
+/*
+** ask the authority for a verdict on a device, waiting at most timeout_ms.
+** Returns USBWALL_VERDICT_ALLOW or USBWALL_VERDICT_BLOCK, -ESRCH if no
+** authority is registered, -ETIMEDOUT if it did not answer in time. ttl is
+** set to the seconds the verdict may be cached, 0 if it may not.
+*/
+int	usbwall_netlink_authorize(const struct usbwall_token_info *info,
+                                  const char *device,
+                                  unsigned int timeout_ms,
+                                  unsigned int *ttl);
+
+#endif /* !USBWALL_NETLINK_H_ */
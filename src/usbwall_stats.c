@@ -0,0 +1,144 @@
+/*
+** File usbwall_stats.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_stats.c
+**
+** Module activity counters and latency histograms
+**
+** The per cpu counters only grow. usbwall_stats_base and usbwall_lat_base
+** hold their sums at the last reset, and are only read and written under
+** usbwall_stats_lock, with the sums: a read never sees half a reset, and
+** never goes below zero.
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include "usbwall_stats.h"
+
+DEFINE_PER_CPU(struct usbwall_stats, usbwall_stats_cpu);
+DEFINE_PER_CPU(struct usbwall_lat_hist, usbwall_lat_cpu);
+
+static struct usbwall_stats usbwall_stats_base;
+static struct usbwall_lat_hist usbwall_lat_base;
+static DEFINE_SPINLOCK(usbwall_stats_lock);
+
+const char *const usbwall_stat_names[USBWALL_STAT_MAX] = {
+  [USBWALL_STAT_PROBES] = "probes",
+  [USBWALL_STAT_ALLOWS] = "allows",
+  [USBWALL_STAT_DENIES] = "denies",
+  [USBWALL_STAT_LOOKUPS] = "lookups",
+  [USBWALL_STAT_KEY_ADDS] = "key adds",
+  [USBWALL_STAT_KEY_DELS] = "key dels",
+  [USBWALL_STAT_IOCTL_ERRORS] = "ioctl errors",
+  [USBWALL_STAT_AUDIT_DROPS] = "audit drops",
+};
+
+/*!
+** \brief sum the counters of every cpu, under usbwall_stats_lock
+*/
+static void usbwall_stats_sum(struct usbwall_stats *stats)
+{
+  const struct usbwall_stats *counters;
+  int cpu;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  for_each_possible_cpu(cpu) {
+    counters = per_cpu_ptr(&usbwall_stats_cpu, cpu);
+    for (i = 0; i < USBWALL_STAT_MAX; i++) {
+      stats->count[i] += READ_ONCE(counters->count[i]);
+    }
+  }
+}
+
+void	usbwall_stats_read(struct usbwall_stats *stats)
+{
+  int i;
+
+  spin_lock(&usbwall_stats_lock);
+  usbwall_stats_sum(stats);
+  for (i = 0; i < USBWALL_STAT_MAX; i++) {
+    stats->count[i] -= usbwall_stats_base.count[i];
+  }
+  spin_unlock(&usbwall_stats_lock);
+}
+
+void	usbwall_stats_reset(void)
+{
+  spin_lock(&usbwall_stats_lock);
+  usbwall_stats_sum(&usbwall_stats_base);
+  spin_unlock(&usbwall_stats_lock);
+}
+
+const char *const usbwall_lat_names[USBWALL_LAT_MAX] = {
+  [USBWALL_LAT_PROBE] = "probe",
+  [USBWALL_LAT_SERIAL] = "serial",
+  [USBWALL_LAT_LOOKUP] = "lookup",
+  [USBWALL_LAT_AUTHORITY] = "authority",
+  [USBWALL_LAT_TRACE] = "trace",
+  [USBWALL_LAT_DECISION] = "decision",
+};
+
+/*!
+** \brief sum the histograms of every cpu, under usbwall_stats_lock
+*/
+static void usbwall_lat_sum(struct usbwall_lat_hist *hist)
+{
+  const struct usbwall_lat_hist *counters;
+  int cpu;
+  int i;
+  int b;
+
+  memset(hist, 0, sizeof(*hist));
+  for_each_possible_cpu(cpu) {
+    counters = per_cpu_ptr(&usbwall_lat_cpu, cpu);
+    for (i = 0; i < USBWALL_LAT_MAX; i++) {
+      for (b = 0; b < USBWALL_LAT_BUCKETS; b++) {
+        hist->bucket[i][b] += READ_ONCE(counters->bucket[i][b]);
+      }
+      hist->sum_ns[i] += READ_ONCE(counters->sum_ns[i]);
+    }
+  }
+}
+
+void	usbwall_lat_read(struct usbwall_lat_hist *hist)
+{
+  int i;
+  int b;
+
+  spin_lock(&usbwall_stats_lock);
+  usbwall_lat_sum(hist);
+  for (i = 0; i < USBWALL_LAT_MAX; i++) {
+    for (b = 0; b < USBWALL_LAT_BUCKETS; b++) {
+      hist->bucket[i][b] -= usbwall_lat_base.bucket[i][b];
+    }
+    hist->sum_ns[i] -= usbwall_lat_base.sum_ns[i];
+  }
+  spin_unlock(&usbwall_stats_lock);
+}
+
+void	usbwall_lat_reset(void)
+{
+  spin_lock(&usbwall_stats_lock);
+  usbwall_lat_sum(&usbwall_lat_base);
+  spin_unlock(&usbwall_stats_lock);
+}
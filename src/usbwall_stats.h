@@ -0,0 +1,121 @@
+/*
+** File usbwall_stats.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_stats.h
+**
+** Module activity counters, reported by /proc/usbwall/stats, and latency
+** histograms of the device decisions, reported by /proc/usbwall/latency
+**
+** Each CPU increments its own copy of the counters, without atomic operation
+** nor shared cache line; a read sums them. A reset does not touch them, it
+** records their current sums as the new zero.
+*/
+
+#ifndef USBWALL_STATS_H_
+# define USBWALL_STATS_H_
+
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+
+enum usbwall_stat {
+  USBWALL_STAT_PROBES = 0,	/* devices probed */
+  USBWALL_STAT_ALLOWS,		/* devices allowed */
+  USBWALL_STAT_DENIES,		/* devices blocked */
+  USBWALL_STAT_LOOKUPS,		/* white list lookups */
+  USBWALL_STAT_KEY_ADDS,	/* keys added */
+  USBWALL_STAT_KEY_DELS,	/* keys deleted */
+  USBWALL_STAT_IOCTL_ERRORS,	/* failed ioctls */
+  USBWALL_STAT_AUDIT_DROPS,	/* audit records dropped, ring full */
+  USBWALL_STAT_MAX
+};
+
+struct usbwall_stats {
+  u64 count[USBWALL_STAT_MAX];
+};
+
+DECLARE_PER_CPU(struct usbwall_stats, usbwall_stats_cpu);
+
+static inline void usbwall_stat_add(enum usbwall_stat stat, u64 n)
+{
+  this_cpu_add(usbwall_stats_cpu.count[stat], n);
+}
+
+static inline void usbwall_stat_inc(enum usbwall_stat stat)
+{
+  this_cpu_inc(usbwall_stats_cpu.count[stat]);
+}
+
+/* name of each counter in /proc/usbwall/stats */
+extern const char *const usbwall_stat_names[USBWALL_STAT_MAX];
+
+/*
+** counters since the last reset
+*/
+void	usbwall_stats_read(struct usbwall_stats *stats);
+
+void	usbwall_stats_reset(void);
+
+/* timed phases of a device decision */
+enum usbwall_lat {
+  USBWALL_LAT_PROBE = 0,	/* usbwall_probe() */
+  USBWALL_LAT_SERIAL,		/* usb_string() of the serial number */
+  USBWALL_LAT_LOOKUP,		/* keylist_match() */
+  USBWALL_LAT_AUTHORITY,	/* event mode request, up to authtimeout */
+  USBWALL_LAT_TRACE,		/* tracing of the device identity */
+  USBWALL_LAT_DECISION,		/* from the probe to the verdict applied */
+  USBWALL_LAT_MAX
+};
+
+/*
+** log2 buckets: a duration of ns nanoseconds falls in bucket fls64(ns), i.e.
+** [2^(b-1), 2^b) ns for b > 0. The last bucket also holds all the longer
+** durations, from 2^38 ns (about 4.5 minutes).
+*/
+#define USBWALL_LAT_BUCKETS	40
+
+struct usbwall_lat_hist {
+  u64 bucket[USBWALL_LAT_MAX][USBWALL_LAT_BUCKETS];
+  u64 sum_ns[USBWALL_LAT_MAX];
+};
+
+DECLARE_PER_CPU(struct usbwall_lat_hist, usbwall_lat_cpu);
+
+/*
+** account the time elapsed since start to a phase
+*/
+static inline void usbwall_lat_record(enum usbwall_lat lat, ktime_t start)
+{
+  u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+  this_cpu_inc(usbwall_lat_cpu.bucket[lat][min_t(u64, fls64(ns), USBWALL_LAT_BUCKETS - 1)]);
+  this_cpu_add(usbwall_lat_cpu.sum_ns[lat], ns);
+}
+
+extern const char *const usbwall_lat_names[USBWALL_LAT_MAX];
+
+/*
+** histograms since the last reset
+*/
+void	usbwall_lat_read(struct usbwall_lat_hist *hist);
+
+void	usbwall_lat_reset(void);
+
+#endif /* !USBWALL_STATS_H_ */
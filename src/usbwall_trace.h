@@ -0,0 +1,170 @@
+/*
+** File usbwall_trace.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_trace.h
+**
+** usbwall tracepoints, in the usbwall system of ftrace and perf:
+**
+**   echo 1 > /sys/kernel/tracing/events/usbwall/enable
+**   perf record -e 'usbwall:*'
+**
+** Unlike DBG_TRACE, the events are recorded in binary in the trace buffers,
+** and only formatted when read. The tracepoints are defined in trace.c.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usbwall
+
+#if !defined(USBWALL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define USBWALL_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+#include "usbwall.h"
+
+#ifndef USBWALL_TRACE_ONCE_
+# define USBWALL_TRACE_ONCE_
+
+/* __assign_str() takes the field only since 6.10 */
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#  define usbwall_assign_str(field, src)	__assign_str(field)
+# else
+#  define usbwall_assign_str(field, src)	__assign_str(field, src)
+# endif
+
+#endif /* !USBWALL_TRACE_ONCE_ */
+
+TRACE_EVENT(usbwall_probe,
+
+  TP_PROTO(const char *device, u16 vendor, u16 product),
+
+  TP_ARGS(device, vendor, product),
+
+  TP_STRUCT__entry(
+    __string(device, device)
+    __field(u16, vendor)
+    __field(u16, product)
+  ),
+
+  TP_fast_assign(
+    usbwall_assign_str(device, device);
+    __entry->vendor = vendor;
+    __entry->product = product;
+  ),
+
+  TP_printk("%s %04x:%04x", __get_str(device), __entry->vendor, __entry->product)
+);
+
+TRACE_EVENT(usbwall_decision,
+
+  TP_PROTO(const char *device, const struct usbwall_token_info *info,
+           int allowed, int source, int tier, u64 duration_ns),
+
+  TP_ARGS(device, info, allowed, source, tier, duration_ns),
+
+  TP_STRUCT__entry(
+    __string(device, device)
+    __field(u16, vendor)
+    __field(u16, product)
+    __string(serial, info->idSerialNumber)
+    __field(u8, allowed)
+    __field(u8, source)
+    __field(u8, tier)
+    __field(u64, duration_ns)
+  ),
+
+  TP_fast_assign(
+    usbwall_assign_str(device, device);
+    __entry->vendor = info->idVendor;
+    __entry->product = info->idProduct;
+    usbwall_assign_str(serial, info->idSerialNumber);
+    __entry->allowed = allowed;
+    __entry->source = source;
+    __entry->tier = tier;
+    __entry->duration_ns = duration_ns;
+  ),
+
+  TP_printk("%s %04x:%04x serial '%s' %s by %s (tier %u) in %llu ns",
+            __get_str(device), __entry->vendor, __entry->product, __get_str(serial),
+            __entry->allowed ? "allowed" : "blocked",
+            __print_symbolic(__entry->source,
+                             { USBWALL_SOURCE_LIST, "list" },
+                             { USBWALL_SOURCE_CACHE, "cache" },
+                             { USBWALL_SOURCE_AUTHORITY, "authority" },
+                             { USBWALL_SOURCE_DEFAULT, "default" }),
+            __entry->tier, __entry->duration_ns)
+);
+
+/* one event per staged key of a committed transaction, len bytes of serial */
+TRACE_EVENT(usbwall_key,
+
+  TP_PROTO(int del, u32 vidpid, int tier, const char *serial, u32 len, int status),
+
+  TP_ARGS(del, vidpid, tier, serial, len, status),
+
+  TP_STRUCT__entry(
+    __field(u8, del)
+    __field(u8, tier)
+    __field(u32, vidpid)
+    __field(int, status)
+    __dynamic_array(char, serial, len + 1)
+  ),
+
+  TP_fast_assign(
+    __entry->del = del;
+    __entry->tier = tier;
+    __entry->vidpid = vidpid;
+    __entry->status = status;
+    memcpy(__get_dynamic_array(serial), serial, len);
+    ((char *)__get_dynamic_array(serial))[len] = '\0';
+  ),
+
+  TP_printk("%s %04x:%04x tier %u serial '%s': %d",
+            __entry->del ? "del" : "add", __entry->vidpid >> 16, __entry->vidpid & 0xffff,
+            __entry->tier, __get_str(serial), __entry->status)
+);
+
+TRACE_EVENT(usbwall_ioctl,
+
+  TP_PROTO(unsigned int cmd, long ret),
+
+  TP_ARGS(cmd, ret),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, cmd)
+    __field(long, ret)
+  ),
+
+  TP_fast_assign(
+    __entry->cmd = cmd;
+    __entry->ret = ret;
+  ),
+
+  TP_printk("cmd 0x%x: %ld", __entry->cmd, __entry->ret)
+);
+
+#endif /* !USBWALL_TRACE_H_ || TRACE_HEADER_MULTI_READ */
+
+/* out of tree: define_trace.h looks for this file in the module directory */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usbwall_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,367 @@
+/*
+** File keylist_bench.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keylist_bench.c
+**
+** Throughput and latency of the policy engine, from 1k to 1M keys
+**
+** For each policy size, the keys are loaded in batches of USBWALL_BATCH_MAX,
+** as written to /dev/usbwall, then single keys are added and deleted again
+** with key_add() and key_del(), and devices are looked up with
+** is_key_authorized(), half of them being in the policy. Each line gives the
+** operations per second, measured over a loop without any clock read, and
+** the latency percentiles of each operation, timed one by one in a second
+** loop.
+**
+** The load is the commit cost of a stream of records written to
+** /dev/usbwall in large writes: write() commits every USBWALL_BATCH_MAX
+** records and at its end, and the commits line gives their number and total
+** time. Each single addition
+** builds a whole new snapshot, so their count is bounded for the large
+** policies. A single deletion only marks the key dead in place.
+**
+** With -b, the same devices are also looked up in the white list of the 0.2
+** releases, which the snapshot replaced: one allocated node per key, walked
+** in order with a strcmp() of each serial number. The walk visits every key
+** on a miss, so its lookups are bounded too.
+*/
+
+#include <linux/kernel.h>
+#include <unistd.h>
+#include "keylist.h"
+
+#define BENCH_VENDORS		512
+#define BENCH_PRODUCTS		64
+/* copied keys per size for the single additions and deletions */
+#define BENCH_SINGLE_WORK	(20ULL * 1000 * 1000)
+/* visited nodes per size for the list walk lookups */
+#define BENCH_LIST_WORK		(200ULL * 1000 * 1000)
+
+/* node of the 0.2 white list */
+struct bench_node {
+  struct list_head list;
+  struct usbwall_token_info info;
+};
+
+static LIST_HEAD(bench_list);
+
+static u64 bench_state;
+
+static u64 bench_rand(void)
+{
+  /* splitmix64: a bijection, so the key numbers give distinct serials */
+  u64 z = (bench_state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/*!
+** \brief the key number n: an exact serial number, one in a hundred being
+** a product wildcard and one in a thousand a vendor wildcard
+*/
+static void bench_key(struct usbwall_token_info *info, u64 n)
+{
+  u64 bits = n * 0x9e3779b97f4a7c15ULL;
+
+  memset(info, 0, sizeof(*info));
+  info->idVendor = 0x1000 + (bits >> 40) % BENCH_VENDORS;
+  info->idProduct = (bits >> 20) % BENCH_PRODUCTS;
+  snprintf(info->idSerialNumber, sizeof(info->idSerialNumber), "%016llx",
+           (unsigned long long)bits);
+  if (n % 1000 == 999) {
+    info->keyflags = USBWALL_KEY_ANY_PRODUCT;
+  } else if (n % 100 == 99) {
+    info->keyflags = USBWALL_KEY_ANY_SERIAL;
+  }
+}
+
+static u64 bench_ns(ktime_t start)
+{
+  return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+  u64 x = *(const u64 *)a;
+  u64 y = *(const u64 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void bench_report(u32 keys, const char *op, u64 ops, u64 total_ns, u64 *samples, u64 nr)
+{
+  printf("%8u  %-8s %10llu %12.0f", keys, op, (unsigned long long)ops,
+         total_ns ? ops * 1e9 / total_ns : 0.0);
+  if (nr == 0) {
+    printf("%10s %10s %10s\n", "-", "-", "-");
+    return;
+  }
+  qsort(samples, nr, sizeof(*samples), bench_cmp);
+  printf("%10llu %10llu %10llu\n", (unsigned long long)samples[nr / 2],
+         (unsigned long long)samples[nr * 99 / 100], (unsigned long long)samples[nr - 1]);
+}
+
+/*!
+** \brief load keys keys in batches of USBWALL_BATCH_MAX, as write() commits
+** them
+*/
+static int bench_load(u32 keys)
+{
+  struct usbwall_token_info *batch;
+  ktime_t start;
+  u64 total = 0;
+  u32 done;
+  u32 n;
+  u32 i;
+  int ret = 0;
+
+  batch = malloc(USBWALL_BATCH_MAX * sizeof(*batch));
+  if (batch == NULL) {
+    return -ENOMEM;
+  }
+  for (done = 0; done < keys && ret == 0; done += n) {
+    n = min_t(u32, USBWALL_BATCH_MAX, keys - done);
+    for (i = 0; i < n; i++) {
+      bench_key(&batch[i], done + i);
+    }
+    start = ktime_get();
+    ret = keylist_apply_batch(batch, n, USBWALL_KEY_ADD, NULL, NULL);
+    total += bench_ns(start);
+  }
+  free(batch);
+  bench_report(keys, "load", keys, total, NULL, 0);
+  printf("%8u  %-8s %10u in %.3f s\n", keys, "commits", DIV_ROUND_UP(keys, USBWALL_BATCH_MAX),
+         total / 1e9);
+  return ret;
+}
+
+/*!
+** \brief build the 0.2 white list of the same keys, in the same order
+*/
+static int bench_list_load(u32 keys)
+{
+  struct bench_node *node;
+  u32 i;
+
+  for (i = 0; i < keys; i++) {
+    node = malloc(sizeof(*node));
+    if (node == NULL) {
+      return -ENOMEM;
+    }
+    bench_key(&node->info, i);
+    list_add_tail(&node->list, &bench_list);
+  }
+  return 0;
+}
+
+static void bench_list_free(void)
+{
+  struct bench_node *node;
+  struct bench_node *next;
+
+  list_for_each_entry_safe(node, next, &bench_list, list) {
+    list_del(&node->list);
+    free(node);
+  }
+}
+
+/*!
+** \brief the 0.2 is_key_authorized(): exact keys only
+*/
+static int bench_list_lookup(const struct usbwall_token_info *info)
+{
+  struct bench_node *node;
+
+  list_for_each_entry(node, &bench_list, list) {
+    if (strcmp(node->info.idSerialNumber, info->idSerialNumber) == 0 &&
+        info->idVendor == node->info.idVendor && info->idProduct == node->info.idProduct) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*!
+** \brief add ops keys past the loaded ones one by one, then delete them
+*/
+static void bench_single(u32 keys, u32 ops, u64 *samples)
+{
+  struct usbwall_token_info info;
+  ktime_t start;
+  u64 total = 0;
+  u32 i;
+
+  for (i = 0; i < ops; i++) {
+    bench_key(&info, (u64)keys + i);
+    start = ktime_get();
+    key_add(&info);
+    samples[i] = bench_ns(start);
+    total += samples[i];
+  }
+  bench_report(keys, "add", ops, total, samples, ops);
+  total = 0;
+  for (i = 0; i < ops; i++) {
+    bench_key(&info, (u64)keys + i);
+    start = ktime_get();
+    key_del(&info);
+    samples[i] = bench_ns(start);
+    total += samples[i];
+  }
+  bench_report(keys, "del", ops, total, samples, ops);
+}
+
+/*!
+** \brief look up ops devices, one in two being allowed by an exact key,
+** then list_ops of them in the 0.2 white list
+*/
+static void bench_lookup(u32 keys, u32 ops, u32 list_ops, u64 *samples)
+{
+  struct internal_token_info *devices;
+  ktime_t start;
+  u64 total;
+  u32 i;
+  volatile int found = 0;
+
+  devices = calloc(ops, sizeof(*devices));
+  if (devices == NULL) {
+    return;
+  }
+  for (i = 0; i < ops; i++) {
+    bench_key(&devices[i].info, bench_rand() % keys);
+    devices[i].info.keyflags = 0;
+    if (i % 2) {
+      /* unknown serial number of a known product */
+      snprintf(devices[i].info.idSerialNumber, sizeof(devices[i].info.idSerialNumber),
+               "x%015llx", (unsigned long long)bench_rand());
+    }
+  }
+  start = ktime_get();
+  for (i = 0; i < ops; i++) {
+    found += is_key_authorized(&devices[i]);
+  }
+  total = bench_ns(start);
+  for (i = 0; i < ops; i++) {
+    start = ktime_get();
+    found += is_key_authorized(&devices[i]);
+    samples[i] = bench_ns(start);
+  }
+  bench_report(keys, "lookup", ops, total, samples, ops);
+  if (list_ops != 0) {
+    start = ktime_get();
+    for (i = 0; i < list_ops; i++) {
+      found += bench_list_lookup(&devices[i].info);
+    }
+    total = bench_ns(start);
+    for (i = 0; i < list_ops; i++) {
+      start = ktime_get();
+      found += bench_list_lookup(&devices[i].info);
+      samples[i] = bench_ns(start);
+    }
+    bench_report(keys, "listwalk", list_ops, total, samples, list_ops);
+  }
+  free(devices);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-k keys,...] [-l lookups] [-o ops] [-s seed] [-b]\n"
+          "  -k  policy sizes (default: 1000,10000,100000,1000000)\n"
+          "  -l  lookups per size (default: 1000000)\n"
+          "  -o  single additions and deletions per size, at most (default: 10000)\n"
+          "  -s  seed of the looked up devices\n"
+          "  -b  also look the devices up in the 0.2 white list, a walk of a list\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  char sizes_default[] = "1000,10000,100000,1000000";
+  char *sizes = sizes_default;
+  char *size;
+  u32 lookups = 1000000;
+  u32 max_ops = 10000;
+  u32 keys;
+  u32 ops;
+  u32 list_ops = 0;
+  u32 count;
+  size_t bytes;
+  u64 *samples;
+  int baseline = 0;
+  int opt;
+
+  bench_state = 1;
+  while ((opt = getopt(argc, argv, "k:l:o:s:b")) != -1) {
+    switch (opt) {
+      case 'k':
+        sizes = optarg;
+        break;
+      case 'l':
+        lookups = strtoul(optarg, NULL, 0);
+        break;
+      case 'o':
+        max_ops = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        bench_state = strtoull(optarg, NULL, 0);
+        break;
+      case 'b':
+        baseline = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  samples = malloc(max_t(u32, lookups, max_ops) * sizeof(*samples));
+  if (samples == NULL || lookups == 0) {
+    usage(argv[0]);
+  }
+
+  printf("%8s  %-8s %10s %12s %10s %10s %10s\n", "keys", "op", "count", "ops/s", "p50 ns",
+         "p99 ns", "max ns");
+  for (size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ",")) {
+    keys = strtoul(size, NULL, 0);
+    if (keys == 0) {
+      continue;
+    }
+    if (keylist_init() != 0 || bench_load(keys) != 0) {
+      fprintf(stderr, "unable to load %u keys\n", keys);
+      return 1;
+    }
+    ops = min_t(u64, max_ops, BENCH_SINGLE_WORK / keys + 1);
+    bench_single(keys, ops, samples);
+    if (baseline) {
+      if (bench_list_load(keys) != 0) {
+        fprintf(stderr, "unable to build the list of %u keys\n", keys);
+        return 1;
+      }
+      list_ops = min_t(u64, lookups, BENCH_LIST_WORK / keys + 1);
+    }
+    bench_lookup(keys, lookups, list_ops, samples);
+    bench_list_free();
+    keylist_usage(&count, &bytes);
+    printf("%8u  %-8s %10u keys in %zu bytes\n", keys, "memory", count, bytes);
+    keylist_release();
+  }
+  free(samples);
+  return 0;
+}
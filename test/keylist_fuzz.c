@@ -0,0 +1,385 @@
+/*
+** File keylist_fuzz.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keylist_fuzz.c
+**
+** Differential fuzzer of the policy engine
+**
+** Applies a random sequence of single key additions and deletions, batches
+** and transactions both to keylist.c and to the reference list of
+** keylist_ref.c, and checks after each step that they agree: the status of
+** every operation, the tier found for random devices, the keys listed and
+** their count. The keys are drawn from a small domain so that the same keys,
+** patterns and wildcards keep colliding. Now and then the policy is also
+** exported and loaded back as an image, which must not change it.
+**
+** Any change to the index, the filter or the pattern automaton must keep
+** this program quiet. A failure prints the seed and the step, the sequence
+** being reproducible from the seed alone:
+**
+**   keylist_fuzz -s 42 -n 100000
+*/
+
+#include <unistd.h>
+#include <linux/kernel.h>
+#include "keylist.h"
+#include "keylist_ref.h"
+
+#define FUZZ_MAX_BATCH	16
+#define FUZZ_PAGE_MAX	7
+
+static struct keylist_ref ref;
+static unsigned long step;
+static unsigned long long seed;
+static int verbose;
+
+static u64 fuzz_state;
+
+static u32 fuzz_rand(u32 bound)
+{
+  /* xorshift64*, independent from the shim random bytes */
+  fuzz_state ^= fuzz_state >> 12;
+  fuzz_state ^= fuzz_state << 25;
+  fuzz_state ^= fuzz_state >> 27;
+  return (u32)((fuzz_state * 0x2545f4914f6cdd1dULL) >> 32) % bound;
+}
+
+static void fuzz_fail(const char *what, const struct usbwall_token_info *info, int got, int want)
+{
+  fprintf(stderr, "keylist_fuzz: seed %llu, step %lu: %s", seed, step, what);
+  if (info != NULL) {
+    fprintf(stderr, " of %04x:%04x flags 0x%x serial '%s'", info->idVendor, info->idProduct,
+            info->keyflags, info->idSerialNumber);
+  }
+  fprintf(stderr, ": %d, expected %d\n", got, want);
+  exit(1);
+}
+
+/*!
+** \brief random string of up to max characters of alphabet
+*/
+static void fuzz_string(char *str, const char *alphabet, u32 max)
+{
+  u32 len = fuzz_rand(max + 1);
+  u32 i;
+
+  for (i = 0; i < len; i++) {
+    str[i] = alphabet[fuzz_rand(strlen(alphabet))];
+  }
+  str[len] = '\0';
+}
+
+/*!
+** \brief random device: a few vendors, products and short serial numbers
+*/
+static void fuzz_device(struct usbwall_token_info *info)
+{
+  memset(info, 0, sizeof(*info));
+  info->idVendor = 1 + fuzz_rand(3);
+  info->idProduct = 1 + fuzz_rand(3);
+  fuzz_string(info->idSerialNumber, "ab", 3);
+}
+
+/*!
+** \brief random rule, with the fields its kind ignores left set at times
+*/
+static void fuzz_key(struct usbwall_token_info *info)
+{
+  u32 kind = fuzz_rand(10);
+
+  fuzz_device(info);
+  if (kind == 0) {
+    info->keyflags = USBWALL_KEY_ANY_PRODUCT;
+  } else if (kind == 1) {
+    info->keyflags = USBWALL_KEY_ANY_SERIAL;
+  } else if (kind == 2) {
+    info->keyflags = USBWALL_KEY_SERIAL_PATTERN;
+    fuzz_string(info->idSerialNumber, "ab*?", 4);
+  }
+  if (fuzz_rand(4) == 0) {
+    /* flags outside of the rule kind are ignored */
+    info->keyflags |= USBWALL_KEY_ACCESS_READ << fuzz_rand(5);
+  }
+  if (fuzz_rand(8) == 0) {
+    info->keyflags |= USBWALL_KEY_ANY_SERIAL | USBWALL_KEY_SERIAL_PATTERN;
+  }
+}
+
+static void fuzz_single(int del)
+{
+  struct usbwall_token_info info;
+  struct usbwall_token_info key;
+  int got;
+  int want;
+
+  fuzz_key(&info);
+  key = info;
+  keylist_ref_normalize(&key);
+  if (!del && fuzz_rand(2) == 0 && ref.count != 0) {
+    /* add a present key again */
+    info = ref.keys[fuzz_rand(ref.count)];
+    key = info;
+  } else if (del && fuzz_rand(2) == 0 && ref.count != 0) {
+    info = ref.keys[fuzz_rand(ref.count)];
+    key = info;
+  }
+  got = del ? key_del(&info) : key_add(&info);
+  want = keylist_ref_apply(&ref, &key, del);
+  if (got != want) {
+    fuzz_fail(del ? "key_del" : "key_add", &key, got, want);
+  }
+}
+
+static void fuzz_batch(void)
+{
+  struct usbwall_token_info infos[FUZZ_MAX_BATCH];
+  int status[FUZZ_MAX_BATCH];
+  int del[FUZZ_MAX_BATCH];
+  int *statusp = fuzz_rand(2) ? status : NULL;
+  u32 count = 1 + fuzz_rand(FUZZ_MAX_BATCH);
+  keyflags_t op = 0;
+  u32 i;
+  int ret;
+
+  if (fuzz_rand(3) == 0) {
+    op = fuzz_rand(2) ? USBWALL_KEY_DEL : USBWALL_KEY_ADD;
+  }
+  for (i = 0; i < count; i++) {
+    if (i != 0 && fuzz_rand(3) == 0) {
+      /* the same key several times in a batch */
+      infos[i] = infos[fuzz_rand(i)];
+    } else {
+      fuzz_key(&infos[i]);
+    }
+    infos[i].keyflags &= ~(USBWALL_KEY_ADD | USBWALL_KEY_DEL);
+    del[i] = op ? (op == USBWALL_KEY_DEL) : fuzz_rand(2);
+    infos[i].keyflags |= del[i] ? USBWALL_KEY_DEL : USBWALL_KEY_ADD;
+  }
+  ret = keylist_apply_batch(infos, count, op, statusp, NULL);
+  if (ret != 0) {
+    fuzz_fail("keylist_apply_batch", NULL, ret, 0);
+  }
+  /* without status, only the final state tells */
+  for (i = 0; i < count; i++) {
+    keylist_ref_normalize(&infos[i]);
+    ret = keylist_ref_apply(&ref, &infos[i], del[i]);
+    if (statusp != NULL && status[i] != ret) {
+      fuzz_fail("batch status", &infos[i], status[i], ret);
+    }
+  }
+}
+
+static void fuzz_txn(void)
+{
+  struct keylist_txn txn;
+  struct internal_token_info *keyinfo;
+  u32 count = 1 + fuzz_rand(FUZZ_MAX_BATCH / 2);
+  int commit = fuzz_rand(5) != 0;
+  int del;
+  int want;
+  int ret;
+  u32 i;
+
+  keylist_txn_begin(&txn);
+  for (i = 0; i < count; i++) {
+    keyinfo = keyinfo_alloc();
+    fuzz_key(&keyinfo->info);
+    keyinfo->info.keyflags |= fuzz_rand(2) ? USBWALL_KEY_DEL : USBWALL_KEY_ADD;
+    ret = keylist_txn_stage(&txn, keyinfo);
+    if (ret != 0) {
+      fuzz_fail("keylist_txn_stage", &keyinfo->info, ret, 0);
+    }
+  }
+  if (commit) {
+    ret = keylist_txn_commit(&txn, NULL);
+    if (ret != 0) {
+      fuzz_fail("keylist_txn_commit", NULL, ret, 0);
+    }
+    list_for_each_entry(keyinfo, &txn.ops, list) {
+      del = !!(keyinfo->info.keyflags & USBWALL_KEY_DEL);
+      keylist_ref_normalize(&keyinfo->info);
+      want = keylist_ref_apply(&ref, &keyinfo->info, del);
+      if (keyinfo->status != want) {
+        fuzz_fail("transaction status", &keyinfo->info, keyinfo->status, want);
+      }
+    }
+  }
+  /* an uncommitted transaction leaves no trace */
+  keylist_txn_release(&txn);
+}
+
+static void fuzz_lookup(void)
+{
+  struct internal_token_info device;
+  struct keylist_rule rule;
+  u32 vidpid;
+  int got;
+  int want;
+
+  memset(&device, 0, sizeof(device));
+  fuzz_device(&device.info);
+  got = is_key_authorized(&device);
+  want = keylist_ref_lookup(&ref, device.info.idVendor, device.info.idProduct,
+                            device.info.idSerialNumber);
+  if (got != want) {
+    fuzz_fail("is_key_authorized", &device.info, got, want);
+  }
+  if (got == KEYLIST_MATCH_NONE || keylist_match(&device, &rule) != got) {
+    return;
+  }
+  /* the rule is a key of the current generation, of the device vid:pid */
+  vidpid = (u32)device.info.idVendor << 16 | device.info.idProduct;
+  if (got == KEYLIST_MATCH_VENDOR) {
+    vidpid &= 0xffff0000;
+  }
+  if (rule.generation != keylist_generation() || rule.vidpid != vidpid ||
+      (rule.serial_off != 0 && (got == KEYLIST_MATCH_PRODUCT || got == KEYLIST_MATCH_VENDOR))) {
+    fuzz_fail("keylist_match rule", &device.info, rule.serial_off, got);
+  }
+}
+
+/*!
+** \brief list the whole policy in small pages: exactly the reference keys
+*/
+static void fuzz_list(void)
+{
+  struct usbwall_key_cursor cursor;
+  struct usbwall_token_info keys[FUZZ_PAGE_MAX];
+  u32 listed = 0;
+  u32 count;
+  size_t size;
+  u64 generation;
+  int end = 0;
+  int ret;
+  int i;
+
+  memset(&cursor, 0, sizeof(cursor));
+  while (!end) {
+    ret = keylist_list_keys(&cursor, keys, 1 + fuzz_rand(FUZZ_PAGE_MAX), &end, &generation);
+    if (ret < 0) {
+      fuzz_fail("keylist_list_keys", NULL, ret, 0);
+    }
+    for (i = 0; i < ret; i++) {
+      if (!keylist_ref_contains(&ref, &keys[i])) {
+        fuzz_fail("listed key", &keys[i], 1, 0);
+      }
+    }
+    listed += ret;
+  }
+  if (listed != ref.count) {
+    fuzz_fail("listed keys", NULL, listed, ref.count);
+  }
+  keylist_usage(&count, &size);
+  if (count != ref.count) {
+    fuzz_fail("keylist_usage", NULL, count, ref.count);
+  }
+}
+
+/*!
+** \brief export the policy, and load the image back
+*/
+static void fuzz_image(void)
+{
+  struct keylist_export *export;
+  const struct usbwall_map_header *header;
+  size_t size;
+  int ret;
+
+  export = keylist_export_get();
+  if (IS_ERR(export)) {
+    fuzz_fail("keylist_export_get", NULL, PTR_ERR(export), 0);
+  }
+  header = keylist_export_map(export, &size);
+  ret = keylist_load_image((const char *)header + le32_to_cpu(header->image_off),
+                           le32_to_cpu(header->image_size), NULL);
+  keylist_export_put(export);
+  if (ret != 0) {
+    fuzz_fail("keylist_load_image", NULL, ret, 0);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-s seed] [-n steps] [-v]\n"
+          "  -s  seed of the sequence (default: the time)\n"
+          "  -n  number of steps (default: 100000)\n"
+          "  -v  print the policy size every 10000 steps\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long steps = 100000;
+  u32 choice;
+  int opt;
+
+  seed = time(NULL);
+  while ((opt = getopt(argc, argv, "s:n:v")) != -1) {
+    switch (opt) {
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'n':
+        steps = strtoul(optarg, NULL, 0);
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  fuzz_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  usbwall_shim_seed(seed);
+  if (keylist_init() != 0) {
+    fprintf(stderr, "keylist_init failed\n");
+    return 1;
+  }
+  keylist_ref_init(&ref);
+
+  for (step = 0; step < steps; step++) {
+    choice = fuzz_rand(100);
+    if (choice < 25) {
+      fuzz_single(0);
+    } else if (choice < 40) {
+      fuzz_single(1);
+    } else if (choice < 50) {
+      fuzz_batch();
+    } else if (choice < 55) {
+      fuzz_txn();
+    } else if (choice < 95) {
+      fuzz_lookup();
+    } else if (choice < 99) {
+      fuzz_list();
+    } else {
+      fuzz_image();
+    }
+    if (verbose && step % 10000 == 0) {
+      printf("step %lu: %u keys\n", step, ref.count);
+    }
+  }
+  fuzz_list();
+
+  keylist_release();
+  keylist_ref_release(&ref);
+  printf("keylist_fuzz: %lu steps, seed %llu: ok\n", steps, seed);
+  return 0;
+}
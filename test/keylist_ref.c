@@ -0,0 +1,165 @@
+/*
+** File keylist_ref.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keylist_ref.c
+**
+** Reference white list, see keylist_ref.h
+*/
+
+#include "keylist_ref.h"
+
+void	keylist_ref_init(struct keylist_ref *ref)
+{
+  ref->keys = NULL;
+  ref->count = 0;
+  ref->size = 0;
+}
+
+void	keylist_ref_release(struct keylist_ref *ref)
+{
+  free(ref->keys);
+  keylist_ref_init(ref);
+}
+
+void	keylist_ref_normalize(struct usbwall_token_info *info)
+{
+  info->keyflags &= USBWALL_KEY_MATCH_MASK;
+  info->idSerialNumber[USBWALL_SERIAL_MAX - 1] = '\0';
+  if (info->keyflags & USBWALL_KEY_ANY_PRODUCT) {
+    info->keyflags = USBWALL_KEY_ANY_PRODUCT | USBWALL_KEY_ANY_SERIAL;
+    info->idProduct = 0;
+  }
+  if (info->keyflags & USBWALL_KEY_ANY_SERIAL) {
+    info->keyflags &= ~USBWALL_KEY_SERIAL_PATTERN;
+    memset(info->idSerialNumber, 0, sizeof(info->idSerialNumber));
+  }
+}
+
+/*!
+** \brief position of a normalized rule, or -1
+*/
+static int keylist_ref_find(const struct keylist_ref *ref, const struct usbwall_token_info *info)
+{
+  const struct usbwall_token_info *key;
+  u32 i;
+
+  for (i = 0; i < ref->count; i++) {
+    key = &ref->keys[i];
+    if (key->keyflags == info->keyflags && key->idVendor == info->idVendor &&
+        key->idProduct == info->idProduct &&
+        strcmp(key->idSerialNumber, info->idSerialNumber) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int	keylist_ref_contains(const struct keylist_ref *ref, const struct usbwall_token_info *info)
+{
+  return keylist_ref_find(ref, info) >= 0;
+}
+
+int	keylist_ref_apply(struct keylist_ref *ref, const struct usbwall_token_info *info, int del)
+{
+  int pos = keylist_ref_find(ref, info);
+
+  if (del) {
+    if (pos < 0) {
+      return -ENOENT;
+    }
+    ref->keys[pos] = ref->keys[--ref->count];
+    return 0;
+  }
+  if (pos >= 0) {
+    return -EEXIST;
+  }
+  if (ref->count == ref->size) {
+    ref->size = ref->size ? 2 * ref->size : 64;
+    ref->keys = realloc(ref->keys, ref->size * sizeof(*ref->keys));
+    if (ref->keys == NULL) {
+      abort();
+    }
+  }
+  ref->keys[ref->count++] = *info;
+  return 0;
+}
+
+/*!
+** \brief whether a whole serial number matches a glob pattern
+*/
+static int keylist_ref_glob(const char *pattern, const char *serial)
+{
+  if (*pattern == '\0') {
+    return *serial == '\0';
+  }
+  if (*pattern == '*') {
+    do {
+      if (keylist_ref_glob(pattern + 1, serial)) {
+        return 1;
+      }
+    } while (*serial++ != '\0');
+    return 0;
+  }
+  if (*serial == '\0') {
+    return 0;
+  }
+  if (*pattern != '?' && *pattern != *serial) {
+    return 0;
+  }
+  return keylist_ref_glob(pattern + 1, serial + 1);
+}
+
+int	keylist_ref_lookup(const struct keylist_ref *ref,
+                           u16 idVendor,
+                           u16 idProduct,
+                           const char *serial)
+{
+  const struct usbwall_token_info *key;
+  int best = KEYLIST_MATCH_NONE;
+  int tier;
+  u32 i;
+
+  for (i = 0; i < ref->count; i++) {
+    key = &ref->keys[i];
+    if (key->idVendor != idVendor) {
+      continue;
+    }
+    if (key->keyflags & USBWALL_KEY_ANY_PRODUCT) {
+      tier = KEYLIST_MATCH_VENDOR;
+    } else if (key->idProduct != idProduct) {
+      continue;
+    } else if (key->keyflags & USBWALL_KEY_ANY_SERIAL) {
+      tier = KEYLIST_MATCH_PRODUCT;
+    } else if (key->keyflags & USBWALL_KEY_SERIAL_PATTERN) {
+      if (!keylist_ref_glob(key->idSerialNumber, serial)) {
+        continue;
+      }
+      tier = KEYLIST_MATCH_PATTERN;
+    } else if (strcmp(key->idSerialNumber, serial) == 0) {
+      tier = KEYLIST_MATCH_SERIAL;
+    } else {
+      continue;
+    }
+    if (best == KEYLIST_MATCH_NONE || tier < best) {
+      best = tier;
+    }
+  }
+  return best;
+}
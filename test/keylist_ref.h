@@ -0,0 +1,66 @@
+/*
+** File keylist_ref.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file keylist_ref.h
+**
+** Reference white list: the rules in an unsorted array, each lookup
+** scanning all of them. It implements the semantics documented in usbwall.h
+** as plainly as possible, for keylist_fuzz to check the indexed policy of
+** keylist.c against.
+*/
+
+#ifndef KEYLIST_REF_H_
+# define KEYLIST_REF_H_
+
+#include <linux/kernel.h>
+#include "keylist.h"
+
+struct keylist_ref {
+  struct usbwall_token_info *keys;	/* normalized rules */
+  u32 count;
+  u32 size;
+};
+
+void	keylist_ref_init(struct keylist_ref *ref);
+
+void	keylist_ref_release(struct keylist_ref *ref);
+
+/*
+** clear the fields a rule ignores, as a staged key is
+*/
+void	keylist_ref_normalize(struct usbwall_token_info *info);
+
+/*
+** add or delete a normalized rule: 0, -EEXIST when adding a present rule,
+** -ENOENT when deleting an absent one
+*/
+int	keylist_ref_apply(struct keylist_ref *ref, const struct usbwall_token_info *info, int del);
+
+int	keylist_ref_contains(const struct keylist_ref *ref, const struct usbwall_token_info *info);
+
+/*
+** tier of the most specific rule matching the device (enum keylist_match)
+*/
+int	keylist_ref_lookup(const struct keylist_ref *ref,
+                           u16 idVendor,
+                           u16 idProduct,
+                           const char *serial);
+
+#endif /* !KEYLIST_REF_H_ */
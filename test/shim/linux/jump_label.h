@@ -0,0 +1,14 @@
+#ifndef USBWALL_SHIM_JUMP_LABEL_H_
+# define USBWALL_SHIM_JUMP_LABEL_H_
+
+#include "../usbwall_shim.h"
+
+struct static_key_false {
+  int enabled;
+};
+
+#define static_branch_unlikely(key)	((key)->enabled)
+#define static_branch_enable(key)	((key)->enabled = 1)
+#define static_branch_disable(key)	((key)->enabled = 0)
+
+#endif /* !USBWALL_SHIM_JUMP_LABEL_H_ */
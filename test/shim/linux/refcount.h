@@ -0,0 +1 @@
+#include "../usbwall_shim.h"
@@ -0,0 +1,42 @@
+#ifndef USBWALL_SHIM_SEQ_FILE_H_
+# define USBWALL_SHIM_SEQ_FILE_H_
+
+#include <stdarg.h>
+#include "../usbwall_shim.h"
+
+/* a fixed buffer, marked full once a print did not fit */
+struct seq_file {
+  char *buf;
+  size_t size;
+  size_t count;
+  void *private;
+};
+
+#define SEQ_START_TOKEN	((void *)1)
+#define SEQ_SKIP	1
+
+static inline void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+  va_list args;
+  int len;
+
+  if (m->count >= m->size) {
+    return;
+  }
+  va_start(args, fmt);
+  len = vsnprintf(m->buf + m->count, m->size - m->count, fmt, args);
+  va_end(args);
+  m->count = (len < 0 || m->count + len >= m->size) ? m->size : m->count + len;
+}
+
+static inline void seq_putc(struct seq_file *m, char c)
+{
+  seq_printf(m, "%c", c);
+}
+
+static inline int seq_has_overflowed(struct seq_file *m)
+{
+  return m->count == m->size;
+}
+
+#endif /* !USBWALL_SHIM_SEQ_FILE_H_ */
@@ -0,0 +1,12 @@
+#ifndef USBWALL_SHIM_TRACEPOINT_H_
+# define USBWALL_SHIM_TRACEPOINT_H_
+
+#include "../usbwall_shim.h"
+
+/* the events compile to nothing */
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)	\
+  static inline void trace_##name(proto) { }
+
+#endif /* !USBWALL_SHIM_TRACEPOINT_H_ */
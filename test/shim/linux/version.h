@@ -0,0 +1,8 @@
+#ifndef USBWALL_SHIM_VERSION_H_
+# define USBWALL_SHIM_VERSION_H_
+
+/* the current kernel interfaces */
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(6, 8, 0)
+
+#endif /* !USBWALL_SHIM_VERSION_H_ */
@@ -0,0 +1 @@
+/* the events are not defined in userspace */
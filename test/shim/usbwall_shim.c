@@ -0,0 +1,214 @@
+/*
+** File usbwall_shim.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_shim.c
+**
+** Out of line parts of the userspace kernel shim: the same hash functions as
+** the kernel, so that the index and filter behave as in the module, a
+** reproducible get_random_bytes() and the DBG_TRACE switches of trace.c,
+** all off.
+*/
+
+#include "usbwall_shim.h"
+#include "trace.h"
+
+struct static_key_false dbglevel_keys[DBG_LEVEL_MAX];
+
+short	dbglevel_get(void)
+{
+  return DBG_LEVEL_NONE;
+}
+
+unsigned int	dbgline_get_and_inc(void)
+{
+  static unsigned int dbgline;
+
+  return dbgline++;
+}
+
+/*
+** SipHash-2-4
+*/
+#define SIPROUND(v0, v1, v2, v3)					\
+  do {									\
+    v0 += v1; v1 = rol64(v1, 13); v1 ^= v0; v0 = rol64(v0, 32);	\
+    v2 += v3; v3 = rol64(v3, 16); v3 ^= v2;				\
+    v0 += v3; v3 = rol64(v3, 21); v3 ^= v0;				\
+    v2 += v1; v1 = rol64(v1, 17); v1 ^= v2; v2 = rol64(v2, 32);	\
+  } while (0)
+
+static inline u64 rol64(u64 word, unsigned int shift)
+{
+  return (word << shift) | (word >> (64 - shift));
+}
+
+u64	siphash(const void *data, size_t len, const siphash_key_t *key)
+{
+  const u8 *bytes = data;
+  const u8 *end = bytes + (len - (len % sizeof(u64)));
+  u64 v0 = 0x736f6d6570736575ULL ^ key->key[0];
+  u64 v1 = 0x646f72616e646f6dULL ^ key->key[1];
+  u64 v2 = 0x6c7967656e657261ULL ^ key->key[0];
+  u64 v3 = 0x7465646279746573ULL ^ key->key[1];
+  u64 b = ((u64)len) << 56;
+  u64 m;
+  int i;
+
+  for (; bytes != end; bytes += sizeof(u64)) {
+    memcpy(&m, bytes, sizeof(m));
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  for (i = len % sizeof(u64) - 1; i >= 0; i--) {
+    b |= (u64)end[i] << (8 * i);
+  }
+  v3 ^= b;
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+/*
+** Bob Jenkins' lookup3, as linux/jhash.h
+*/
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+  return (word << shift) | (word >> (32 - shift));
+}
+
+#define JHASH_MIX(a, b, c)				\
+  do {							\
+    a -= c; a ^= rol32(c, 4); c += b;			\
+    b -= a; b ^= rol32(a, 6); a += c;			\
+    c -= b; c ^= rol32(b, 8); b += a;			\
+    a -= c; a ^= rol32(c, 16); c += b;			\
+    b -= a; b ^= rol32(a, 19); a += c;			\
+    c -= b; c ^= rol32(b, 4); b += a;			\
+  } while (0)
+
+#define JHASH_FINAL(a, b, c)				\
+  do {							\
+    c ^= b; c -= rol32(b, 14);				\
+    a ^= c; a -= rol32(c, 11);				\
+    b ^= a; b -= rol32(a, 25);				\
+    c ^= b; c -= rol32(b, 16);				\
+    a ^= c; a -= rol32(c, 4);				\
+    b ^= a; b -= rol32(a, 14);				\
+    c ^= b; c -= rol32(b, 24);				\
+  } while (0)
+
+u32	jhash(const void *key, u32 length, u32 initval)
+{
+  const u8 *k = key;
+  u32 a;
+  u32 b;
+  u32 c;
+  u32 word[3];
+
+  a = b = c = 0xdeadbeef + length + initval;
+  while (length > 12) {
+    memcpy(word, k, sizeof(word));
+    a += word[0];
+    b += word[1];
+    c += word[2];
+    JHASH_MIX(a, b, c);
+    length -= 12;
+    k += 12;
+  }
+  if (length == 0) {
+    return c;
+  }
+  memset(word, 0, sizeof(word));
+  memcpy(word, k, length);
+  a += word[0];
+  b += word[1];
+  c += word[2];
+  JHASH_FINAL(a, b, c);
+  return c;
+}
+
+/*
+** CRC-32 of zlib, without the final inversion, as crc32_le()
+*/
+u32	crc32_le(u32 crc, const unsigned char *p, size_t len)
+{
+  static u32 table[256];
+  u32 value;
+  int i;
+  int j;
+
+  if (table[1] == 0) {
+    for (i = 0; i < 256; i++) {
+      value = i;
+      for (j = 0; j < 8; j++) {
+        value = (value >> 1) ^ (0xedb88320 & -(value & 1));
+      }
+      table[i] = value;
+    }
+  }
+  while (len--) {
+    crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+/*
+** splitmix64: the programs are reproducible from their seed
+*/
+static u64 usbwall_shim_state = 0x5eed;
+
+void	usbwall_shim_seed(u64 seed)
+{
+  usbwall_shim_state = seed;
+}
+
+void	get_random_bytes(void *buf, size_t len)
+{
+  u8 *bytes = buf;
+  u64 z;
+  size_t n;
+
+  while (len > 0) {
+    z = (usbwall_shim_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    n = min(len, sizeof(z));
+    memcpy(bytes, &z, n);
+    bytes += n;
+    len -= n;
+  }
+}
+
+void	sort(void *base, size_t num, size_t size,
+             int (*cmp)(const void *, const void *),
+             void (*swap)(void *, void *, int))
+{
+  (void)swap;
+  qsort(base, num, size, cmp);
+}
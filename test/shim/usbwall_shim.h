@@ -0,0 +1,496 @@
+/*
+** File usbwall_shim.h for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_shim.h
+**
+** Userspace stand-in for the kernel API used by the policy engine
+** (keylist.c, keypattern.c and usbwall_stats.c), so that it can be built
+** and measured as a plain program. Every linux/ header of this directory
+** includes this one.
+**
+** The programs are single threaded: the locks are no-ops, an RCU grace
+** period is immediate, and there is a single cpu.
+*/
+
+#ifndef USBWALL_SHIM_H_
+# define USBWALL_SHIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+** types
+*/
+typedef uint8_t		u8;
+typedef uint16_t	u16;
+typedef uint32_t	u32;
+typedef uint64_t	u64;
+typedef int8_t		s8;
+typedef int16_t		s16;
+typedef int32_t		s32;
+typedef int64_t		s64;
+typedef u8		__u8;
+typedef u16		__u16;
+typedef u32		__u32;
+typedef u64		__u64;
+typedef u16		__le16;
+typedef u32		__le32;
+typedef u64		__le64;
+typedef unsigned int	gfp_t;
+typedef long long	ktime_t;
+
+#define GFP_KERNEL	0U
+#define GFP_NOWAIT	1U
+#define GFP_ATOMIC	2U
+#define __GFP_NOWARN	0U
+#define __GFP_ZERO	0U
+
+/*
+** compiler and annotations
+*/
+#define __init
+#define __exit
+#define __rcu
+#define __user
+#define __percpu
+#define __must_check
+#define __acquires(x)
+#define __releases(x)
+#define __cacheline_aligned
+#define ____cacheline_aligned_in_smp
+#define SMP_CACHE_BYTES		64
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+#define BUILD_BUG_ON(c)		_Static_assert(!(c), #c)
+#define EXPORT_SYMBOL(x)
+#define printk			printf
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define container_of(p, t, m)	((t *)((char *)(p) - offsetof(t, m)))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)		((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define struct_size(p, m, n)	(sizeof(*(p)) + sizeof((p)->m[0]) * (n))
+
+/* little endian hosts only */
+#define cpu_to_le16(x)		((u16)(x))
+#define cpu_to_le32(x)		((u32)(x))
+#define cpu_to_le64(x)		((u64)(x))
+#define le16_to_cpu(x)		((u16)(x))
+#define le32_to_cpu(x)		((u32)(x))
+#define le64_to_cpu(x)		((u64)(x))
+
+/*
+** errors
+*/
+#define MAX_ERRNO		4095
+#define IS_ERR_VALUE(x)		((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error)
+{
+  return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+  return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+  return IS_ERR_VALUE((unsigned long)ptr);
+}
+
+static inline bool IS_ERR_OR_NULL(const void *ptr)
+{
+  return ptr == NULL || IS_ERR(ptr);
+}
+
+/*
+** memory
+*/
+#define kmalloc(size, gfp)		malloc(size)
+#define kzalloc(size, gfp)		calloc(1, size)
+#define kcalloc(n, size, gfp)		calloc(n, size)
+#define kmalloc_array(n, size, gfp)	malloc((size_t)(n) * (size))
+#define kvmalloc(size, gfp)		malloc(size)
+#define kvzalloc(size, gfp)		calloc(1, size)
+#define kvcalloc(n, size, gfp)		calloc(n, size)
+#define kvmalloc_array(n, size, gfp)	malloc((size_t)(n) * (size))
+#define vmalloc(size)			malloc(size)
+#define vzalloc(size)			calloc(1, size)
+#define vmalloc_user(size)		calloc(1, size)
+#define kfree(ptr)			free((void *)(ptr))
+#define kvfree(ptr)			free((void *)(ptr))
+#define vfree(ptr)			free((void *)(ptr))
+
+struct kmem_cache {
+  size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                                   unsigned long flags, void (*ctor)(void *))
+{
+  struct kmem_cache *cache = malloc(sizeof(*cache));
+
+  (void)name;
+  (void)align;
+  (void)flags;
+  (void)ctor;
+  if (cache != NULL) {
+    cache->size = size;
+  }
+  return cache;
+}
+
+#define kmem_cache_destroy(cache)	free(cache)
+#define kmem_cache_alloc(cache, gfp)	malloc((cache)->size)
+#define kmem_cache_zalloc(cache, gfp)	calloc(1, (cache)->size)
+#define kmem_cache_free(cache, ptr)	free(ptr)
+
+typedef struct kmem_cache mempool_t;
+
+#define mempool_create_slab_pool(min, cache)	(cache)
+#define mempool_destroy(pool)			((void)(pool))
+#define mempool_alloc(pool, gfp)		malloc((pool)->size)
+#define mempool_free(ptr, pool)			free(ptr)
+
+/*
+** lists
+*/
+struct list_head {
+  struct list_head *next;
+  struct list_head *prev;
+};
+
+struct hlist_node {
+  struct hlist_node *next;
+  struct hlist_node **pprev;
+};
+
+struct hlist_head {
+  struct hlist_node *first;
+};
+
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+  list->next = list;
+  list->prev = list;
+}
+
+static inline void __list_add(struct list_head *entry, struct list_head *prev, struct list_head *next)
+{
+  next->prev = entry;
+  entry->next = next;
+  entry->prev = prev;
+  prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+  __list_add(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+  __list_add(entry, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+  entry->next->prev = entry->prev;
+  entry->prev->next = entry->next;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+  list_del(entry);
+  INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head *entry, struct list_head *head)
+{
+  list_del(entry);
+  list_add(entry, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+  return head->next == head;
+}
+
+#define list_entry(ptr, type, member)		container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member)	list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member)	list_entry((ptr)->prev, type, member)
+#define list_next_entry(pos, member)		list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each_entry(pos, head, member)				\
+  for (pos = list_first_entry(head, __typeof__(*pos), member);		\
+       &pos->member != (head);						\
+       pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+  for (pos = list_first_entry(head, __typeof__(*pos), member),		\
+         n = list_next_entry(pos, member);				\
+       &pos->member != (head);						\
+       pos = n, n = list_next_entry(n, member))
+#define list_for_each_entry_rcu(pos, head, member, ...)	list_for_each_entry(pos, head, member)
+#define list_add_tail_rcu				list_add_tail
+#define list_del_rcu					list_del
+
+#define INIT_HLIST_HEAD(head)	((head)->first = NULL)
+
+static inline void hlist_add_head(struct hlist_node *node, struct hlist_head *head)
+{
+  node->next = head->first;
+  if (head->first != NULL) {
+    head->first->pprev = &node->next;
+  }
+  head->first = node;
+  node->pprev = &head->first;
+}
+
+static inline void hlist_del(struct hlist_node *node)
+{
+  *node->pprev = node->next;
+  if (node->next != NULL) {
+    node->next->pprev = node->pprev;
+  }
+}
+
+#define hlist_entry_safe(ptr, type, member)				\
+  ({ __typeof__(ptr) ____ptr = (ptr); ____ptr ? container_of(____ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member)				\
+  for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member);	\
+       pos;								\
+       pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+#define hlist_for_each_entry_rcu(pos, head, member, ...)	hlist_for_each_entry(pos, head, member)
+#define hlist_add_head_rcu					hlist_add_head
+#define hlist_del_rcu						hlist_del
+
+/*
+** RCU and locks: single threaded
+*/
+struct rcu_head {
+  void (*func)(struct rcu_head *head);
+};
+
+#define rcu_read_lock()				do { } while (0)
+#define rcu_read_unlock()			do { } while (0)
+#define rcu_dereference(p)			(p)
+#define rcu_dereference_protected(p, c)		(p)
+#define rcu_access_pointer(p)			(p)
+#define rcu_assign_pointer(p, v)		((p) = (v))
+#define RCU_INIT_POINTER(p, v)			((p) = (v))
+#define synchronize_rcu()			do { } while (0)
+#define rcu_barrier()				do { } while (0)
+#define kfree_rcu(ptr, field)			kfree(ptr)
+#define kvfree_rcu(ptr, field)			kvfree(ptr)
+
+static inline void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+  func(head);
+}
+
+struct mutex {
+  int locked;
+};
+
+#define DEFINE_MUTEX(name)			struct mutex name = { 0 }
+#define mutex_init(lock)			((lock)->locked = 0)
+#define mutex_lock(lock)			((lock)->locked = 1)
+#define mutex_unlock(lock)			((lock)->locked = 0)
+#define mutex_lock_interruptible(lock)		(mutex_lock(lock), 0)
+#define lockdep_is_held(lock)			((lock)->locked)
+#define lockdep_assert_held(lock)		((void)(lock))
+
+typedef struct {
+  int locked;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(name)			spinlock_t name = { 0 }
+#define spin_lock_init(lock)			((lock)->locked = 0)
+#define spin_lock(lock)				((lock)->locked = 1)
+#define spin_unlock(lock)			((lock)->locked = 0)
+#define spin_lock_bh(lock)			spin_lock(lock)
+#define spin_unlock_bh(lock)			spin_unlock(lock)
+#define might_sleep()				do { } while (0)
+#define cond_resched()				do { } while (0)
+#define preempt_disable()			do { } while (0)
+#define preempt_enable()			do { } while (0)
+
+typedef struct {
+  unsigned int sequence;
+} seqcount_t;
+
+#define seqcount_init(s)			((s)->sequence = 0)
+#define write_seqcount_begin(s)			((s)->sequence++)
+#define write_seqcount_end(s)			((s)->sequence++)
+#define read_seqcount_begin(s)			((s)->sequence)
+#define read_seqcount_retry(s, start)		((s)->sequence != (start))
+
+/*
+** counters
+*/
+typedef struct {
+  int counter;
+} atomic_t;
+
+typedef struct {
+  long long counter;
+} atomic64_t;
+
+#define ATOMIC_INIT(i)			{ (i) }
+#define atomic_read(v)			((v)->counter)
+#define atomic_set(v, i)		((v)->counter = (i))
+#define atomic_inc(v)			((v)->counter++)
+#define atomic_dec(v)			((v)->counter--)
+#define atomic_sub(i, v)		((v)->counter -= (i))
+#define atomic_inc_return(v)		(++(v)->counter)
+#define atomic_add_unless(v, a, u)	((v)->counter != (u) ? ((v)->counter += (a), 1) : 0)
+#define atomic64_read(v)		((v)->counter)
+#define atomic64_set(v, i)		((v)->counter = (i))
+#define atomic64_inc(v)			((v)->counter++)
+#define atomic64_inc_return(v)		(++(v)->counter)
+
+typedef struct {
+  int refs;
+} refcount_t;
+
+#define refcount_set(r, n)			((r)->refs = (n))
+#define refcount_read(r)			((r)->refs)
+#define refcount_inc(r)				((r)->refs++)
+#define refcount_dec_and_test(r)		(--(r)->refs == 0)
+#define refcount_dec_and_mutex_lock(r, lock)	(--(r)->refs == 0 && (mutex_lock(lock), 1))
+
+#define DEFINE_PER_CPU(type, name)		type name
+#define DECLARE_PER_CPU(type, name)		extern type name
+#define per_cpu_ptr(ptr, cpu)			(ptr)
+#define per_cpu(var, cpu)			(var)
+#define this_cpu_inc(var)			((var)++)
+#define this_cpu_add(var, n)			((var) += (n))
+#define for_each_possible_cpu(cpu)		for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+/*
+** bitmaps
+*/
+#define BITS_PER_LONG		(8 * (int)sizeof(long))
+#define BITS_TO_LONGS(n)	DIV_ROUND_UP(n, BITS_PER_LONG)
+
+static inline void __set_bit(unsigned long nr, unsigned long *addr)
+{
+  addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr)
+{
+  return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+                                          unsigned long offset)
+{
+  for (; offset < size; offset++) {
+    if (test_bit(offset, addr)) {
+      break;
+    }
+  }
+  return offset;
+}
+
+#define for_each_set_bit(bit, addr, size)				\
+  for ((bit) = find_next_bit((addr), (size), 0);			\
+       (bit) < (size);							\
+       (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+#define bitmap_zalloc(nbits, gfp)	calloc(BITS_TO_LONGS(nbits), sizeof(unsigned long))
+#define bitmap_free(bitmap)		free(bitmap)
+#define bitmap_zero(dst, nbits)		memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long))
+#define bitmap_copy(dst, src, nbits)	memcpy(dst, src, BITS_TO_LONGS(nbits) * sizeof(unsigned long))
+
+static inline int bitmap_equal(const unsigned long *a, const unsigned long *b, unsigned int nbits)
+{
+  unsigned int i;
+
+  for (i = 0; i < nbits; i++) {
+    if (test_bit(i, a) != test_bit(i, b)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static inline int fls64(u64 x)
+{
+  return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/*
+** hashes, random bytes and sort, in usbwall_shim.c
+*/
+typedef struct {
+  u64 key[2];
+} siphash_key_t;
+
+u64	siphash(const void *data, size_t len, const siphash_key_t *key);
+
+u32	jhash(const void *key, u32 length, u32 initval);
+
+u32	crc32_le(u32 crc, const unsigned char *p, size_t len);
+
+#define crc32(crc, p, len)	crc32_le(crc, p, len)
+
+/* deterministic, see usbwall_shim_seed() */
+void	get_random_bytes(void *buf, size_t len);
+
+void	usbwall_shim_seed(u64 seed);
+
+void	sort(void *base, size_t num, size_t size,
+             int (*cmp)(const void *, const void *),
+             void (*swap)(void *, void *, int));
+
+/*
+** time
+*/
+static inline ktime_t ktime_get(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ktime_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_to_ns(t)		((s64)(t))
+#define ktime_us_delta(a, b)	(((a) - (b)) / 1000)
+
+#endif /* !USBWALL_SHIM_H_ */
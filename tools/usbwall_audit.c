@@ -0,0 +1,145 @@
+/*
+** File usbwall_audit.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_audit.c
+**
+** Audit trail consumer: prints the decisions of the module as they are
+** read from /dev/usbwall, in batches, sleeping in poll() meanwhile.
+**
+**   usbwall_audit [-d device] [-n count]
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "usbwall.h"
+
+#define AUDIT_BATCH	64
+
+static const char *source_name(uint8_t source)
+{
+  switch (source) {
+    case USBWALL_SOURCE_LIST:
+      return "list";
+    case USBWALL_SOURCE_CACHE:
+      return "cache";
+    case USBWALL_SOURCE_AUTHORITY:
+      return "authority";
+    case USBWALL_SOURCE_DEFAULT:
+      return "default";
+  }
+  return "?";
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-d device] [-n count]\n"
+          "  -d  usbwall device (default: /dev/usbwall)\n"
+          "  -n  exit after count records\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct usbwall_audit_record records[AUDIT_BATCH];
+  const char *device = "/dev/usbwall";
+  unsigned long count = 0;
+  unsigned long handled = 0;
+  unsigned long dropped = 0;
+  struct pollfd pfd;
+  char date[32];
+  struct tm tm;
+  time_t sec;
+  ssize_t ret;
+  size_t i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+    switch (opt) {
+      case 'd':
+        device = optarg;
+        break;
+      case 'n':
+        count = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  pfd.fd = open(device, O_RDONLY | O_NONBLOCK);
+  if (pfd.fd < 0) {
+    perror(device);
+    return 1;
+  }
+  pfd.events = POLLIN;
+  while (count == 0 || handled < count) {
+    ret = read(pfd.fd, records, sizeof(records));
+    if (ret < 0) {
+      if (errno == EAGAIN) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+          perror("poll");
+          return 1;
+        }
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read");
+      return 1;
+    }
+    for (i = 0; i < ret / sizeof(records[0]); i++) {
+      struct usbwall_audit_record *record = &records[i];
+
+      if (record->dropped != 0) {
+        printf("cpu %u: %u records dropped\n", record->cpu, record->dropped);
+        dropped += record->dropped;
+      }
+      sec = record->timestamp / 1000000000ULL;
+      localtime_r(&sec, &tm);
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+      printf("%s.%06llu cpu %u %s %04x:%04x serial '%s': %s by %s", date,
+             (unsigned long long)(record->timestamp % 1000000000ULL) / 1000, record->cpu,
+             record->port, record->idVendor, record->idProduct, record->idSerialNumber,
+             record->verdict == USBWALL_VERDICT_ALLOW ? "allow" : "block",
+             source_name(record->source));
+      if (record->source == USBWALL_SOURCE_LIST) {
+        /* the rule, as a key of the policy image of that generation */
+        printf(", tier %u rule %04x:%04x serial at %u of generation %llu", record->tier,
+               record->rule_idVendor, record->rule_idProduct, record->rule_serial_off,
+               (unsigned long long)record->generation);
+      }
+      printf("\n");
+      handled++;
+    }
+    fflush(stdout);
+  }
+  fprintf(stderr, "%lu records, %lu dropped\n", handled, dropped);
+  close(pfd.fd);
+  return 0;
+}
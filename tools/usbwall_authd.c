@@ -0,0 +1,327 @@
+/*
+** File usbwall_authd.c for project usbwall
+**
+** LACSC - ECE PARIS Engineering school
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+/*
+** \file usbwall_authd.c
+**
+** Test authority for the event authorization mode (authmode=0)
+**
+** Registers as the usbwall authority, which needs CAP_NET_ADMIN, and answers
+** each authorization request with a fixed verdict, after an optional delay. It only uses raw generic netlink
+** sockets, and prints the time spent on each request, so that the round trip
+** can be measured on a single machine, e.g. with dummy_hcd and
+** g_mass_storage to plug virtual devices:
+**
+**   insmod usbwall.ko authmode=0 dbglevel=3
+**   usbwall_authd -v allow -n 100
+**
+** The module logs the whole round trip of each request at dbglevel 3.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include "usbwall.h"
+
+#define AUTHD_BUFFER_SIZE	8192
+
+/* walk the attributes of a generic netlink message payload */
+#define for_each_attr(nla, head, len)					\
+  for ((nla) = (struct nlattr *)(head);					\
+       (len) >= (int)sizeof(struct nlattr) && (nla)->nla_len >= sizeof(struct nlattr) && \
+         (nla)->nla_len <= (len);					\
+       (len) -= NLA_ALIGN((nla)->nla_len),				\
+         (nla) = (struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+
+struct authd_msg {
+  struct nlmsghdr nlh;
+  struct genlmsghdr genl;
+  char attrs[256];
+};
+
+static int sock = -1;
+static uint32_t seq = 0;
+
+static void *nla_data(struct nlattr *nla)
+{
+  return (char *)nla + NLA_HDRLEN;
+}
+
+static void nla_add(struct authd_msg *msg, uint16_t type, const void *data, uint16_t len)
+{
+  struct nlattr *nla = (struct nlattr *)((char *)msg + NLMSG_ALIGN(msg->nlh.nlmsg_len));
+
+  nla->nla_type = type;
+  nla->nla_len = NLA_HDRLEN + len;
+  memcpy(nla_data(nla), data, len);
+  msg->nlh.nlmsg_len = NLMSG_ALIGN(msg->nlh.nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+static void msg_init(struct authd_msg *msg, uint16_t type, uint8_t cmd, uint8_t version)
+{
+  memset(msg, 0, sizeof(*msg));
+  msg->nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+  msg->nlh.nlmsg_type = type;
+  msg->nlh.nlmsg_flags = NLM_F_REQUEST;
+  msg->nlh.nlmsg_seq = ++seq;
+  msg->genl.cmd = cmd;
+  msg->genl.version = version;
+}
+
+static int msg_send(struct authd_msg *msg)
+{
+  struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+  if (sendto(sock, msg, msg->nlh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+    perror("sendto");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+** resolve the usbwall family id
+*/
+static int resolve_family(uint16_t *family)
+{
+  struct authd_msg msg;
+  char buf[AUTHD_BUFFER_SIZE];
+  struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+  struct nlattr *nla;
+  int len;
+  ssize_t ret;
+
+  msg_init(&msg, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+  nla_add(&msg, CTRL_ATTR_FAMILY_NAME, USBWALL_GENL_NAME, sizeof(USBWALL_GENL_NAME));
+  if (msg_send(&msg) < 0) {
+    return -1;
+  }
+  ret = recv(sock, buf, sizeof(buf), 0);
+  if (ret < 0 || !NLMSG_OK(nlh, ret) || nlh->nlmsg_type == NLMSG_ERROR) {
+    fprintf(stderr, "usbwall netlink family not found: is the module loaded?\n");
+    return -1;
+  }
+  *family = 0;
+  len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+  for_each_attr(nla, (char *)NLMSG_DATA(nlh) + GENL_HDRLEN, len) {
+    if (nla->nla_type == CTRL_ATTR_FAMILY_ID) {
+      *family = *(uint16_t *)nla_data(nla);
+    }
+  }
+  if (*family == 0) {
+    fprintf(stderr, "incomplete usbwall netlink family\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+** register this socket as the authority, the requests being then unicast to
+** it
+*/
+static int register_authority(uint16_t family)
+{
+  struct authd_msg msg;
+  char buf[AUTHD_BUFFER_SIZE];
+  struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+  struct nlmsgerr *err;
+  ssize_t ret;
+
+  msg_init(&msg, family, USBWALL_CMD_AUTH_REGISTER, USBWALL_GENL_VERSION);
+  msg.nlh.nlmsg_flags |= NLM_F_ACK;
+  if (msg_send(&msg) < 0) {
+    return -1;
+  }
+  ret = recv(sock, buf, sizeof(buf), 0);
+  if (ret < 0 || !NLMSG_OK(nlh, ret) || nlh->nlmsg_type != NLMSG_ERROR) {
+    fprintf(stderr, "no answer to the usbwall registration\n");
+    return -1;
+  }
+  err = NLMSG_DATA(nlh);
+  if (err->error != 0) {
+    fprintf(stderr, "registering as the usbwall authority: %s\n", strerror(-err->error));
+    return -1;
+  }
+  return 0;
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-v allow|block] [-t ttl] [-d delay_us] [-n count] [-q]\n"
+          "  -v  verdict given to every device (default: allow)\n"
+          "  -t  seconds the module may cache each verdict (default: 0, never)\n"
+          "  -d  delay before answering, to simulate a slow authority\n"
+          "  -n  exit after count requests, printing the time statistics\n"
+          "  -q  do not print each request\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+  char buf[AUTHD_BUFFER_SIZE];
+  struct authd_msg msg;
+  struct timespec start;
+  uint16_t family;
+  uint8_t verdict = USBWALL_VERDICT_ALLOW;
+  uint32_t ttl = 0;
+  unsigned long delay_us = 0;
+  unsigned long count = 0;
+  unsigned long handled = 0;
+  double total_us = 0;
+  double max_us = 0;
+  double us;
+  int quiet = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "v:t:d:n:q")) != -1) {
+    switch (opt) {
+      case 'v':
+        if (strcmp(optarg, "allow") == 0) {
+          verdict = USBWALL_VERDICT_ALLOW;
+        } else if (strcmp(optarg, "block") == 0) {
+          verdict = USBWALL_VERDICT_BLOCK;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        ttl = strtoul(optarg, NULL, 0);
+        break;
+      case 'd':
+        delay_us = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        count = strtoul(optarg, NULL, 0);
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+    perror("netlink socket");
+    return 1;
+  }
+  if (resolve_family(&family) < 0 || register_authority(family) < 0) {
+    return 1;
+  }
+  fprintf(stderr, "answering %s to the usbwall requests, cached for %u s\n",
+          verdict == USBWALL_VERDICT_ALLOW ? "allow" : "block", ttl);
+
+  while (count == 0 || handled < count) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct genlmsghdr *genl;
+    struct nlattr *nla;
+    uint32_t id = 0;
+    uint16_t vendor = 0;
+    uint16_t product = 0;
+    const char *serial = "";
+    const char *device = "";
+    int len;
+    ssize_t ret;
+
+    ret = recv(sock, buf, sizeof(buf), 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("recv");
+      return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; NLMSG_OK(nlh, ret); nlh = NLMSG_NEXT(nlh, ret)) {
+      if (nlh->nlmsg_type != family) {
+        continue;
+      }
+      genl = NLMSG_DATA(nlh);
+      if (genl->cmd != USBWALL_CMD_AUTH_REQUEST) {
+        continue;
+      }
+      len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+      for_each_attr(nla, (char *)genl + GENL_HDRLEN, len) {
+        switch (nla->nla_type) {
+          case USBWALL_ATTR_REQUEST_ID:
+            id = *(uint32_t *)nla_data(nla);
+            break;
+          case USBWALL_ATTR_VENDOR:
+            vendor = *(uint16_t *)nla_data(nla);
+            break;
+          case USBWALL_ATTR_PRODUCT:
+            product = *(uint16_t *)nla_data(nla);
+            break;
+          case USBWALL_ATTR_SERIAL:
+            serial = nla_data(nla);
+            break;
+          case USBWALL_ATTR_DEVICE:
+            device = nla_data(nla);
+            break;
+        }
+      }
+      if (delay_us != 0) {
+        usleep(delay_us);
+      }
+      msg_init(&msg, family, USBWALL_CMD_AUTH_VERDICT, USBWALL_GENL_VERSION);
+      nla_add(&msg, USBWALL_ATTR_REQUEST_ID, &id, sizeof(id));
+      nla_add(&msg, USBWALL_ATTR_VERDICT, &verdict, sizeof(verdict));
+      if (ttl != 0) {
+        nla_add(&msg, USBWALL_ATTR_TTL, &ttl, sizeof(ttl));
+      }
+      if (msg_send(&msg) < 0) {
+        return 1;
+      }
+      us = elapsed_us(&start);
+      handled++;
+      total_us += us;
+      if (us > max_us) {
+        max_us = us;
+      }
+      if (!quiet) {
+        printf("request %u: %s %04x:%04x serial '%s': %s in %.1f us\n", id, device, vendor,
+               product, serial, verdict == USBWALL_VERDICT_ALLOW ? "allow" : "block", us);
+        fflush(stdout);
+      }
+    }
+  }
+  printf("%lu requests: %.1f us average, %.1f us max in the authority\n",
+         handled, handled ? total_us / handled : 0, max_us);
+  close(sock);
+  return 0;
+}